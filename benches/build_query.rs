@@ -0,0 +1,177 @@
+//! Benchmarks for building and querying the font cache
+//!
+//! Run with `cargo bench`. The query benchmarks run on synthetic caches
+//! and are reproducible on any machine. The file benchmarks (parsing single
+//! fonts and `build_from_directories()`) need a fixed font corpus, point
+//! `RUST_FONTCONFIG_BENCH_FONTS` to a directory with fonts to enable them.
+
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use rust_fontconfig::{FcFontCache, FcPattern, PatternMatch, FcParseFontFile, ParseFontsConf};
+use std::path::PathBuf;
+
+mod common;
+use common::{family, synthetic_cache};
+
+const CACHE_SIZES: [usize;3] = [100, 10_000, 100_000];
+
+const FONTS_CONF: &str = r#"<?xml version="1.0"?>
+<!DOCTYPE fontconfig SYSTEM "urn:fontconfig:fonts.dtd">
+<fontconfig>
+	<description>Default configuration file</description>
+	<dir>/usr/share/fonts</dir>
+	<dir>/usr/local/share/fonts</dir>
+	<dir prefix="xdg">fonts</dir>
+	<dir>~/.fonts</dir>
+	<match target="pattern">
+		<test qual="any" name="family"><string>mono</string></test>
+		<edit name="family" mode="assign" binding="same"><string>monospace</string></edit>
+	</match>
+	<match target="pattern">
+		<test qual="any" name="family"><string>sans serif</string></test>
+		<edit name="family" mode="assign" binding="same"><string>sans-serif</string></edit>
+	</match>
+	<include ignore_missing="yes">conf.d</include>
+	<cachedir>/var/cache/fontconfig</cachedir>
+	<cachedir prefix="xdg">fontconfig</cachedir>
+	<config>
+		<rescan><int>30</int></rescan>
+	</config>
+</fontconfig>
+"#;
+
+fn corpus_dir() -> Option<PathBuf> {
+    let dir = PathBuf::from(std::env::var_os("RUST_FONTCONFIG_BENCH_FONTS")?);
+    if dir.is_dir() { Some(dir) } else { None }
+}
+
+fn corpus_files(dir: &PathBuf) -> Vec<PathBuf> {
+    let mut files = Vec::new();
+    let mut dirs = vec![dir.clone()];
+    while let Some(d) = dirs.pop() {
+        for entry in std::fs::read_dir(d).into_iter().flatten().filter_map(|e| e.ok()) {
+            let path = entry.path();
+            if path.is_dir() { dirs.push(path) } else { files.push(path) }
+        }
+    }
+    // sorted, so that the same corpus always benchmarks the same files
+    files.sort();
+    files
+}
+
+fn bench_parse_fonts_conf(c: &mut Criterion) {
+    let mut group = c.benchmark_group("ParseFontsConf");
+    group.throughput(Throughput::Bytes(FONTS_CONF.len() as u64));
+    group.bench_function("fonts.conf", |b| b.iter(|| {
+        let mut font_paths = [(None, "");32];
+        black_box(ParseFontsConf(black_box(FONTS_CONF), &mut font_paths))
+    }));
+    group.finish();
+}
+
+fn bench_parse_font(c: &mut Criterion) {
+
+    let dir = match corpus_dir() {
+        Some(s) => s,
+        None => {
+            eprintln!("RUST_FONTCONFIG_BENCH_FONTS not set, skipping FcParseFont benchmarks");
+            return;
+        },
+    };
+
+    let mut group = c.benchmark_group("FcParseFont");
+    for file in corpus_files(&dir).iter().take(8) {
+        let id = file.file_name().map(|f| f.to_string_lossy().to_string()).unwrap_or_default();
+        group.bench_with_input(BenchmarkId::from_parameter(id), file, |b, file| {
+            b.iter(|| black_box(FcParseFontFile(file)))
+        });
+    }
+    group.finish();
+}
+
+fn bench_build(c: &mut Criterion) {
+
+    let dir = match corpus_dir() {
+        Some(s) => s,
+        None => {
+            eprintln!("RUST_FONTCONFIG_BENCH_FONTS not set, skipping build benchmarks");
+            return;
+        },
+    };
+
+    let files = corpus_files(&dir).len();
+    let dirs = [dir];
+
+    let mut group = c.benchmark_group("build");
+    group.sample_size(10);
+    group.throughput(Throughput::Elements(files as u64));
+    group.bench_function("build_from_directories", |b| {
+        b.iter(|| black_box(FcFontCache::build_from_directories(&dirs)))
+    });
+    group.finish();
+}
+
+fn bench_query(c: &mut Criterion) {
+
+    let mut group = c.benchmark_group("query");
+
+    for size in CACHE_SIZES.iter().copied() {
+
+        let cache = synthetic_cache(size);
+        let last_family = family(size / 4 - 1);
+
+        let by_name = FcPattern {
+            name: Some(format!("{} Bold Italic", last_family)),
+            .. Default::default()
+        };
+
+        let by_family = FcPattern {
+            family: Some(last_family.clone()),
+            italic: PatternMatch::True,
+            .. Default::default()
+        };
+
+        let attributes_only = FcPattern {
+            monospace: PatternMatch::True,
+            bold: PatternMatch::True,
+            .. Default::default()
+        };
+
+        let miss = FcPattern {
+            name: Some(String::from("Does Not Exist")),
+            .. Default::default()
+        };
+
+        for (id, pattern) in [
+            ("name", &by_name),
+            ("family", &by_family),
+            ("attributes", &attributes_only),
+            ("miss", &miss),
+        ].iter() {
+            group.bench_with_input(BenchmarkId::new(*id, size), *pattern, |b, pattern| {
+                b.iter(|| black_box(cache.query(black_box(pattern))))
+            });
+            let compiled = cache.compile(pattern);
+            group.bench_with_input(BenchmarkId::new(format!("{} compiled", id), size), &compiled, |b, compiled| {
+                b.iter(|| black_box(cache.query_compiled(black_box(compiled))))
+            });
+        }
+
+        // hot-query cache hits, compare with the index probes above
+        let mut hot_cache = cache.clone();
+        hot_cache.set_hot_cache(Some(16));
+        for (id, pattern) in [("name hot", &by_name), ("family hot", &by_family)].iter() {
+            // promotion is sampled, repeat the query until it is cached
+            for _ in 0..1000 {
+                hot_cache.query(pattern);
+            }
+            group.bench_with_input(BenchmarkId::new(*id, size), *pattern, |b, pattern| {
+                b.iter(|| black_box(hot_cache.query(black_box(pattern))))
+            });
+        }
+    }
+
+    group.finish();
+}
+
+criterion_group!(benches, bench_parse_fonts_conf, bench_parse_font, bench_build, bench_query);
+criterion_main!(benches);
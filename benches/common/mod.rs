@@ -0,0 +1,38 @@
+//! Synthetic caches shared by the benchmarks and tests
+//!
+//! Include with `mod common;` from benches/ or with
+//! `#[path = "../benches/common/mod.rs"] mod common;` from tests/.
+
+#![allow(dead_code)]
+
+use rust_fontconfig::{FcFontCache, FcFontPath, FcPattern, PatternMatch};
+
+/// Styles of every family, in the order of the faces
+pub const STYLES: [&str;4] = ["Regular", "Bold", "Italic", "Bold Italic"];
+
+/// Name of the `i`th family
+pub fn family(i: usize) -> String {
+    format!("Family {:06}", i)
+}
+
+/// `faces` fonts: four styles per family (see `STYLES`), every 100th
+/// family is monospace, no font is oblique
+pub fn synthetic_cache(faces: usize) -> FcFontCache {
+    (0..faces).map(|i| {
+        let family = family(i / 4);
+        let bold = i % 4 == 1 || i % 4 == 3;
+        let italic = i % 4 >= 2;
+        let monospace = (i / 4) % 100 == 99;
+        (FcPattern {
+            name: Some(format!("{} {}", family, STYLES[i % 4])),
+            family: Some(family),
+            bold: if bold { PatternMatch::True } else { PatternMatch::False },
+            italic: if italic { PatternMatch::True } else { PatternMatch::False },
+            monospace: if monospace { PatternMatch::True } else { PatternMatch::False },
+            .. Default::default()
+        }, FcFontPath {
+            path: format!("/usr/share/fonts/synthetic/{:06}.ttf", i),
+            .. Default::default()
+        })
+    }).collect()
+}
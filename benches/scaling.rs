@@ -0,0 +1,234 @@
+//! Thread-scaling benchmark for `build()` and concurrent queries
+//!
+//! cargo bench --bench scaling
+//!
+//! Sweeps the number of threads (1, 2, 4, ... up to the number of cores)
+//! and prints speedup and parallel efficiency for
+//!
+//! - building the cache from `RUST_FONTCONFIG_BENCH_FONTS` (skipped if
+//!   not set) on a rayon pool of that size, and
+//! - a read-only query mix on one shared cache from that many threads
+//!   (without and with the hot-query cache),
+//! - a few popular queries that all threads repeat, answered from the
+//!   hot-query cache - hits don't write to shared memory, so this should
+//!   scale linearly, and
+//! - a single unindexed query (full scan) on a rayon pool of that size,
+//!   which shows where the adaptive parallel scan starts to pay off.
+//!
+//! Efficiency dropping well below 100% marks the point where a phase
+//! stops scaling. A large spread between the slowest and the fastest
+//! query thread points to contention on shared state.
+
+use rust_fontconfig::{FcFontCache, FcPattern, PatternMatch};
+use std::path::PathBuf;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::{Duration, Instant};
+
+mod common;
+use common::{family, synthetic_cache};
+
+const BUILD_RUNS: usize = 3;
+const QUERY_FACES: usize = 10_000;
+const QUERY_DURATION: Duration = Duration::from_millis(500);
+const HOT_CACHE_CAPACITY: usize = 256;
+const HOT_QUERIES: usize = 8;
+const SCAN_FACES: usize = 100_000;
+const SCAN_QUERIES: usize = 200;
+
+fn thread_counts() -> Vec<usize> {
+    let max = std::thread::available_parallelism().map(|n| n.get()).unwrap_or(1);
+    let mut counts = Vec::new();
+    let mut n = 1;
+    while n < max {
+        counts.push(n);
+        n *= 2;
+    }
+    counts.push(max);
+    counts
+}
+
+// name hits spread over the whole cache, family lookups and misses
+fn query_mix(faces: usize) -> Vec<FcPattern> {
+    let families = faces / 4;
+    let mut queries = Vec::new();
+    for i in 0..64 {
+        let family = family((i * 7919) % families);
+        queries.push(FcPattern { name: Some(format!("{} Bold", family)), .. Default::default() });
+        queries.push(FcPattern { family: Some(family), italic: PatternMatch::True, .. Default::default() });
+        if i % 4 == 0 {
+            queries.push(FcPattern { name: Some(format!("Missing {}", i)), .. Default::default() });
+        }
+    }
+    queries
+}
+
+// the same families over and over, as a text layout engine asks for them
+fn popular_queries(faces: usize) -> Vec<FcPattern> {
+    (0..HOT_QUERIES).map(|i| FcPattern {
+        family: Some(family((i * 7919) % (faces / 4))),
+        bold: if i % 2 == 0 { PatternMatch::True } else { PatternMatch::False },
+        .. Default::default()
+    }).collect()
+}
+
+fn print_row(threads: usize, value: String, speedup: f64, extra: String) {
+    println!(
+        "  {:>7} {:>16} {:>8.2}x {:>9.0}%  {}",
+        threads, value, speedup, speedup * 100.0 / threads as f64, extra
+    );
+}
+
+fn bench_build(counts: &[usize]) {
+
+    let dir = match std::env::var_os("RUST_FONTCONFIG_BENCH_FONTS") {
+        Some(s) => PathBuf::from(s),
+        None => {
+            println!("RUST_FONTCONFIG_BENCH_FONTS not set, skipping build scaling\n");
+            return;
+        },
+    };
+
+    let dirs = [dir];
+    println!("build_from_directories({}):", dirs[0].display());
+    println!("  {:>7} {:>16} {:>9} {:>10}", "threads", "time (best)", "speedup", "efficiency");
+
+    let mut baseline = None;
+
+    for threads in counts.iter().copied() {
+
+        let pool = match rayon::ThreadPoolBuilder::new().num_threads(threads).build() {
+            Ok(o) => o,
+            Err(e) => {
+                eprintln!("could not create thread pool with {} threads: {}", threads, e);
+                continue;
+            },
+        };
+
+        let mut faces = 0;
+        let best = (0..BUILD_RUNS).map(|_| {
+            let start = Instant::now();
+            let cache = pool.install(|| FcFontCache::build_from_directories(&dirs));
+            faces = cache.list().len();
+            start.elapsed()
+        }).min().unwrap_or_default();
+
+        let baseline = *baseline.get_or_insert(best);
+        print_row(threads, format!("{:?}", best), baseline.as_secs_f64() / best.as_secs_f64(), format!("{} faces", faces));
+    }
+
+    println!();
+}
+
+fn bench_queries(counts: &[usize], title: &str, queries: Vec<FcPattern>, hot_cache: bool) {
+
+    let mut cache = synthetic_cache(QUERY_FACES);
+    if hot_cache {
+        cache.set_hot_cache(Some(HOT_CACHE_CAPACITY));
+        // promotion is sampled, repeat the queries until they are cached
+        for _ in 0..1000 {
+            for q in queries.iter() {
+                cache.query(q);
+            }
+        }
+    }
+    let cache = Arc::new(cache);
+    let queries = Arc::new(queries);
+
+    let hot = if hot_cache { ", hot cache enabled" } else { "" };
+    println!("concurrent query() of {} on a shared cache of {} faces{}:", title, QUERY_FACES, hot);
+    println!("  {:>7} {:>16} {:>9} {:>10}  {}", "threads", "queries/s", "speedup", "efficiency", "per-thread min / max queries/s");
+
+    let mut baseline = None;
+
+    for threads in counts.iter().copied() {
+
+        let stop = Arc::new(AtomicBool::new(false));
+
+        let handles = (0..threads).map(|t| {
+            let cache = cache.clone();
+            let queries = queries.clone();
+            let stop = stop.clone();
+            std::thread::spawn(move || {
+                let start = Instant::now();
+                let mut done = 0_u64;
+                let mut i = t;
+                while !stop.load(Ordering::Relaxed) {
+                    // check the stop flag only every few queries
+                    for _ in 0..64 {
+                        std::hint::black_box(cache.query(&queries[i % queries.len()]));
+                        i += 1;
+                    }
+                    done += 64;
+                }
+                done as f64 / start.elapsed().as_secs_f64()
+            })
+        }).collect::<Vec<_>>();
+
+        std::thread::sleep(QUERY_DURATION);
+        stop.store(true, Ordering::Relaxed);
+
+        let per_thread = handles.into_iter().map(|h| h.join().unwrap_or(0.0)).collect::<Vec<_>>();
+        let total = per_thread.iter().sum::<f64>();
+        let min = per_thread.iter().cloned().fold(f64::INFINITY, f64::min);
+        let max = per_thread.iter().cloned().fold(0.0, f64::max);
+
+        let baseline = *baseline.get_or_insert(total);
+        print_row(threads, format!("{:.0}", total), total / baseline, format!("{:.0} / {:.0}", min, max));
+    }
+
+    println!();
+}
+
+fn bench_scan(counts: &[usize]) {
+
+    let cache = synthetic_cache(SCAN_FACES);
+    // no font is oblique: no index applies and the scan never exits early
+    let pattern = FcPattern { oblique: PatternMatch::True, .. Default::default() };
+
+    println!("unindexed query() scanning {} faces:", SCAN_FACES);
+    println!("  {:>7} {:>16} {:>9} {:>10}", "threads", "latency (mean)", "speedup", "efficiency");
+
+    let mut baseline = None;
+
+    for threads in counts.iter().copied() {
+
+        let pool = match rayon::ThreadPoolBuilder::new().num_threads(threads).build() {
+            Ok(o) => o,
+            Err(e) => {
+                eprintln!("could not create thread pool with {} threads: {}", threads, e);
+                continue;
+            },
+        };
+
+        let mean = pool.install(|| {
+            // warm up, so that the scan cost model has settled
+            for _ in 0..SCAN_QUERIES / 4 {
+                std::hint::black_box(cache.query(&pattern));
+            }
+            let start = Instant::now();
+            for _ in 0..SCAN_QUERIES {
+                std::hint::black_box(cache.query(&pattern));
+            }
+            start.elapsed() / SCAN_QUERIES as u32
+        });
+
+        let baseline = *baseline.get_or_insert(mean);
+        print_row(threads, format!("{:?}", mean), baseline.as_secs_f64() / mean.as_secs_f64(), String::new());
+    }
+
+    println!();
+}
+
+fn main() {
+    // `cargo bench` passes "--bench", `cargo test --benches` does not
+    if !std::env::args().any(|a| a == "--bench") {
+        return;
+    }
+    let counts = thread_counts();
+    bench_build(&counts);
+    bench_queries(&counts, "a query mix", query_mix(QUERY_FACES), false);
+    bench_queries(&counts, "a query mix", query_mix(QUERY_FACES), true);
+    bench_queries(&counts, "popular queries", popular_queries(QUERY_FACES), true);
+    bench_scan(&counts);
+}
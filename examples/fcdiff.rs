@@ -0,0 +1,209 @@
+//! Compares the fonts (and latencies) of this crate against the system fontconfig
+//!
+//! cargo run --release --example fcdiff -- [patterns.txt] [max_patterns]
+//!
+//! Without a pattern file, patterns are derived from the families found in
+//! the cache (regular, bold, italic and bold italic of each family, plus a few
+//! misses). A pattern file contains one pattern per line, in the form
+//! `family[:bold][:italic][:monospace]`. Uses `fc-match` and skips cleanly if
+//! fontconfig isn't installed.
+//!
+//! NOTE: `fc-match` is a new process per query, so its latencies include
+//! the process startup and config loading of libfontconfig.
+
+use rust_fontconfig::{FcFontCache, FcPattern, PatternMatch};
+use std::collections::BTreeSet;
+use std::path::Path;
+use std::process::Command;
+use std::time::{Duration, Instant};
+
+const DEFAULT_MAX_PATTERNS: usize = 200;
+const MAX_PRINTED_MISMATCHES: usize = 20;
+
+#[derive(Debug, Clone)]
+struct TestPattern {
+    family: String,
+    bold: bool,
+    italic: bool,
+    monospace: bool,
+}
+
+impl TestPattern {
+
+    fn parse(line: &str) -> Option<Self> {
+        let mut parts = line.split(':');
+        let family = parts.next()?.trim();
+        if family.is_empty() {
+            return None;
+        }
+        let mut p = TestPattern { family: family.to_string(), bold: false, italic: false, monospace: false };
+        for part in parts {
+            match part.trim() {
+                "bold" => p.bold = true,
+                "italic" => p.italic = true,
+                "monospace" => p.monospace = true,
+                _ => { },
+            }
+        }
+        Some(p)
+    }
+
+    fn to_fc_pattern(&self) -> FcPattern {
+        FcPattern {
+            family: Some(self.family.clone()),
+            bold: if self.bold { PatternMatch::True } else { PatternMatch::DontCare },
+            italic: if self.italic { PatternMatch::True } else { PatternMatch::DontCare },
+            monospace: if self.monospace { PatternMatch::True } else { PatternMatch::DontCare },
+            .. Default::default()
+        }
+    }
+
+    // fontconfig pattern syntax, see `man fc-pattern`
+    fn to_fontconfig_string(&self) -> String {
+        let mut s = String::new();
+        for c in self.family.chars() {
+            if c == '-' || c == ':' || c == ',' || c == '\\' {
+                s.push('\\');
+            }
+            s.push(c);
+        }
+        s.push_str(if self.bold { ":weight=bold" } else { ":weight=regular" });
+        s.push_str(if self.italic { ":slant=italic" } else { ":slant=roman" });
+        if self.monospace {
+            s.push_str(":spacing=mono");
+        }
+        s
+    }
+
+    fn label(&self) -> String {
+        format!(
+            "{}{}{}{}",
+            self.family,
+            if self.bold { ":bold" } else { "" },
+            if self.italic { ":italic" } else { "" },
+            if self.monospace { ":monospace" } else { "" },
+        )
+    }
+}
+
+fn fc_match_available() -> bool {
+    Command::new("fc-match").arg("--version").output().map(|o| o.status.success()).unwrap_or(false)
+}
+
+fn fc_match(pattern: &str) -> Option<String> {
+    let output = Command::new("fc-match").arg("-f").arg("%{file}").arg(pattern).output().ok()?;
+    if !output.status.success() {
+        return None;
+    }
+    let file = String::from_utf8_lossy(&output.stdout).trim().to_string();
+    if file.is_empty() { None } else { Some(file) }
+}
+
+fn canonical(path: &str) -> String {
+    Path::new(path).canonicalize().map(|p| p.to_string_lossy().to_string()).unwrap_or_else(|_| path.to_string())
+}
+
+fn percentile(sorted: &[Duration], p: f64) -> Duration {
+    if sorted.is_empty() {
+        return Duration::from_nanos(0);
+    }
+    let i = ((sorted.len() as f64 * p).ceil() as usize).max(1) - 1;
+    sorted[i.min(sorted.len() - 1)]
+}
+
+fn print_latencies(name: &str, latencies: &mut Vec<Duration>) {
+    latencies.sort();
+    println!(
+        "  {:<16} p50 {:>12?}  p90 {:>12?}  p99 {:>12?}  max {:>12?}",
+        name,
+        percentile(latencies, 0.50),
+        percentile(latencies, 0.90),
+        percentile(latencies, 0.99),
+        latencies.last().copied().unwrap_or_default(),
+    );
+}
+
+fn main() {
+
+    if !fc_match_available() {
+        println!("fc-match not found, skipping comparison against fontconfig");
+        return;
+    }
+
+    let mut args = std::env::args().skip(1);
+    let pattern_file = args.next();
+    let max_patterns = args.next().and_then(|s| s.parse().ok()).unwrap_or(DEFAULT_MAX_PATTERNS);
+
+    let start = Instant::now();
+    let cache = FcFontCache::build();
+    println!("built cache with {} fonts in {:?}", cache.list().len(), start.elapsed());
+
+    let patterns = match pattern_file {
+        Some(f) => {
+            let text = std::fs::read_to_string(&f).unwrap_or_else(|e| {
+                eprintln!("could not read {}: {}", f, e);
+                std::process::exit(1);
+            });
+            text.lines().filter_map(TestPattern::parse).take(max_patterns).collect::<Vec<_>>()
+        },
+        None => {
+            let families = cache.list().keys().filter_map(|p| p.family.clone()).collect::<BTreeSet<_>>();
+            let mut patterns = families.iter().flat_map(|family| {
+                [(false, false), (true, false), (false, true), (true, true)].iter().map(move |(bold, italic)| {
+                    TestPattern { family: family.clone(), bold: *bold, italic: *italic, monospace: false }
+                }).collect::<Vec<_>>()
+            }).take(max_patterns.saturating_sub(3)).collect::<Vec<_>>();
+            for miss in ["Does Not Exist", "Helvetica Neue Imaginary", "Zapfino Mono"].iter() {
+                patterns.push(TestPattern { family: miss.to_string(), bold: false, italic: false, monospace: false });
+            }
+            patterns
+        },
+    };
+
+    let mut ours = Vec::new();
+    let mut theirs = Vec::new();
+    let mut agree = 0;
+    let mut both_none = 0;
+    let mut mismatches = Vec::new();
+
+    for pattern in patterns.iter() {
+
+        let fc_pattern = pattern.to_fc_pattern();
+        let start = Instant::now();
+        let our_result = cache.query(&fc_pattern).map(|f| f.path.clone());
+        ours.push(start.elapsed());
+
+        let start = Instant::now();
+        let their_result = fc_match(&pattern.to_fontconfig_string());
+        theirs.push(start.elapsed());
+
+        match (&our_result, &their_result) {
+            (Some(a), Some(b)) if canonical(a) == canonical(b) => agree += 1,
+            (None, None) => both_none += 1,
+            _ => mismatches.push((pattern.label(), our_result, their_result)),
+        }
+    }
+
+    let total = patterns.len().max(1);
+    println!("\n{} patterns:", patterns.len());
+    println!("  agree:      {:>6} ({:.1}%)", agree, agree as f64 * 100.0 / total as f64);
+    println!("  both none:  {:>6}", both_none);
+    println!("  mismatches: {:>6} ({:.1}%)", mismatches.len(), mismatches.len() as f64 * 100.0 / total as f64);
+    println!("  (fontconfig always falls back to some font, misses show up as mismatches)");
+
+    println!("\nlatency:");
+    print_latencies("rust-fontconfig", &mut ours);
+    print_latencies("fc-match", &mut theirs);
+
+    if !mismatches.is_empty() {
+        println!("\nmismatches:");
+        for (label, a, b) in mismatches.iter().take(MAX_PRINTED_MISMATCHES) {
+            println!("  {}", label);
+            println!("    rust-fontconfig: {}", a.as_deref().unwrap_or("<none>"));
+            println!("    fc-match:        {}", b.as_deref().unwrap_or("<none>"));
+        }
+        if mismatches.len() > MAX_PRINTED_MISMATCHES {
+            println!("  ... and {} more", mismatches.len() - MAX_PRINTED_MISMATCHES);
+        }
+    }
+}
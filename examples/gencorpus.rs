@@ -0,0 +1,45 @@
+//! Writes a synthetic font corpus for benchmarking
+//!
+//! cargo run --release --features corpus --example gencorpus -- <dir> [families] [seed]
+//!
+//! RUST_FONTCONFIG_BENCH_FONTS=<dir> cargo bench
+
+use rust_fontconfig::corpus::{FcCorpusConfig, FcGenerateCorpus};
+use std::path::PathBuf;
+use std::time::Instant;
+
+fn main() {
+
+    let mut args = std::env::args().skip(1);
+
+    let dir = match args.next() {
+        Some(s) => PathBuf::from(s),
+        None => {
+            eprintln!("usage: gencorpus <dir> [families] [seed]");
+            std::process::exit(1);
+        },
+    };
+
+    let mut config = FcCorpusConfig::default();
+    if let Some(families) = args.next().and_then(|s| s.parse().ok()) {
+        config.families = families;
+    }
+    if let Some(seed) = args.next().and_then(|s| s.parse().ok()) {
+        config.seed = seed;
+    }
+
+    let start = Instant::now();
+    let summary = match FcGenerateCorpus(&dir, &config) {
+        Ok(o) => o,
+        Err(e) => {
+            eprintln!("failed to write corpus to {}: {}", dir.display(), e);
+            std::process::exit(1);
+        },
+    };
+    let end = Instant::now();
+
+    println!(
+        "wrote {} faces ({} more in collections, not indexed) in {} files ({} bytes, {} directories) in {:?}",
+        summary.faces, summary.unindexed_faces, summary.files, summary.bytes, summary.directories, end - start
+    );
+}
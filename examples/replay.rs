@@ -0,0 +1,106 @@
+//! Replays a query log (see `rust_fontconfig::querylog`) against the system fonts
+//!
+//! cargo run --release --example replay -- <queries.log> [threads] [rounds]
+//!
+//! Reports throughput, latency percentiles and how many results differ
+//! from the ones that were recorded.
+
+use rust_fontconfig::FcFontCache;
+use rust_fontconfig::querylog::{FcQueryLogEntry, FcQueryLogReader};
+use std::fs::File;
+use std::io::BufReader;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+fn percentile(sorted: &[Duration], p: f64) -> Duration {
+    if sorted.is_empty() {
+        return Duration::from_nanos(0);
+    }
+    let i = ((sorted.len() as f64 * p).ceil() as usize).max(1) - 1;
+    sorted[i.min(sorted.len() - 1)]
+}
+
+fn main() {
+
+    let mut args = std::env::args().skip(1);
+
+    let log_path = match args.next() {
+        Some(s) => s,
+        None => {
+            eprintln!("usage: replay <queries.log> [threads] [rounds]");
+            std::process::exit(1);
+        },
+    };
+    let threads = args.next().and_then(|s| s.parse().ok()).unwrap_or(1_usize).max(1);
+    let rounds = args.next().and_then(|s| s.parse().ok()).unwrap_or(1_usize).max(1);
+
+    let reader = File::open(&log_path)
+        .and_then(|f| FcQueryLogReader::new(BufReader::new(f)))
+        .unwrap_or_else(|e| {
+            eprintln!("could not read {}: {}", log_path, e);
+            std::process::exit(1);
+        });
+
+    // a log of a crashed process ends with an incomplete record,
+    // replay everything up to there
+    let mut entries = Vec::<FcQueryLogEntry>::new();
+    for entry in reader {
+        match entry {
+            Ok(e) => entries.push(e),
+            Err(e) => {
+                eprintln!("stopping after {} queries, {}: {}", entries.len(), log_path, e);
+                break;
+            },
+        }
+    }
+
+    let start = Instant::now();
+    let cache = Arc::new(FcFontCache::build());
+    println!("built cache with {} fonts in {:?}", cache.list().len(), start.elapsed());
+    println!("replaying {} queries x {} rounds on {} thread(s)", entries.len(), rounds, threads);
+
+    let entries = Arc::new(entries);
+    let start = Instant::now();
+
+    // thread i replays every `threads`-th query, starting at i
+    let handles = (0..threads).map(|thread| {
+        let cache = cache.clone();
+        let entries = entries.clone();
+        std::thread::spawn(move || {
+            let mut latencies = Vec::with_capacity(entries.len() / threads * rounds + 1);
+            let mut changed = 0;
+            for _ in 0..rounds {
+                for entry in entries.iter().skip(thread).step_by(threads) {
+                    let query_start = Instant::now();
+                    let result = cache.query(&entry.pattern);
+                    latencies.push(query_start.elapsed());
+                    if result != entry.result.as_ref() {
+                        changed += 1;
+                    }
+                }
+            }
+            (latencies, changed)
+        })
+    }).collect::<Vec<_>>();
+
+    let mut latencies = Vec::new();
+    let mut changed = 0;
+    for h in handles {
+        let (l, c) = h.join().expect("replay thread panicked");
+        latencies.extend(l);
+        changed += c;
+    }
+
+    let elapsed = start.elapsed();
+    latencies.sort();
+
+    println!("\n{} queries in {:?} = {:.0} queries/s", latencies.len(), elapsed, latencies.len() as f64 / elapsed.as_secs_f64());
+    println!("latency: p50 {:?}, p90 {:?}, p99 {:?}, p99.9 {:?}, max {:?}",
+        percentile(&latencies, 0.5),
+        percentile(&latencies, 0.9),
+        percentile(&latencies, 0.99),
+        percentile(&latencies, 0.999),
+        latencies.last().copied().unwrap_or_default(),
+    );
+    println!("results that differ from the recording: {} / {}", changed / rounds, entries.len());
+}
@@ -0,0 +1,56 @@
+//! Compiles the C part of the library and exports its functions - a cdylib
+//! only exports its Rust functions by itself:
+//!
+//! - src/variadic.c: the C-variadic functions
+//! - src/unsupported.c: aborting stubs for the rest of the libfontconfig
+//!   ABI, listed in src/unsupported.h
+//!
+//! On ELF targets, the library also gets the SONAME of libfontconfig.
+
+use std::env;
+use std::fs;
+use std::path::PathBuf;
+
+const VARIADIC_EXPORTS: &[&str] = &["FcObjectSetBuild", "FcObjectSetVaBuild"];
+
+const SONAME: &str = "libfontconfig.so.1";
+
+fn main() {
+
+    for file in ["src/variadic.c", "src/unsupported.c", "src/unsupported.h"].iter() {
+        println!("cargo:rerun-if-changed={}", file);
+    }
+    cc::Build::new()
+        .file("src/variadic.c")
+        .file("src/unsupported.c")
+        .compile("fontconfig_shim_c");
+
+    let unsupported = fs::read_to_string("src/unsupported.h").unwrap();
+    let exports = VARIADIC_EXPORTS.iter().copied()
+        .chain(unsupported.lines().filter_map(|l| l.strip_prefix("FC_UNSUPPORTED(")?.strip_suffix(")")))
+        .collect::<Vec<_>>();
+
+    let target_os = env::var("CARGO_CFG_TARGET_OS").unwrap_or_default();
+    let target_env = env::var("CARGO_CFG_TARGET_ENV").unwrap_or_default();
+
+    if target_env == "msvc" {
+        for symbol in exports.iter() {
+            println!("cargo:rustc-cdylib-link-arg=/EXPORT:{}", symbol);
+        }
+    } else if target_os == "macos" || target_os == "ios" {
+        for symbol in exports.iter() {
+            println!("cargo:rustc-cdylib-link-arg=-Wl,-u,_{}", symbol);
+            println!("cargo:rustc-cdylib-link-arg=-Wl,-exported_symbol,_{}", symbol);
+        }
+    } else {
+        // ELF: pull the symbols out of the static library, and add them to
+        // the version script of rustc, which only lists the Rust functions
+        let script = PathBuf::from(env::var_os("OUT_DIR").unwrap()).join("exports.map");
+        fs::write(&script, format!("{{\n    global: {};\n}};\n", exports.join("; "))).unwrap();
+        for symbol in exports.iter() {
+            println!("cargo:rustc-cdylib-link-arg=-Wl,--undefined={}", symbol);
+        }
+        println!("cargo:rustc-cdylib-link-arg=-Wl,--version-script={}", script.display());
+        println!("cargo:rustc-cdylib-link-arg=-Wl,-soname,{}", SONAME);
+    }
+}
@@ -0,0 +1,1528 @@
+//! libfontconfig-compatible shared library on top of rust-fontconfig
+//!
+//! ```sh
+//! cd fontconfig-shim && cargo build --release   # target/release/libfontconfig.so
+//! LD_PRELOAD=target/release/libfontconfig.so RUST_FONTCONFIG_CACHE=/tmp/fonts.rfcc some-program
+//! ```
+//!
+//! Exports the part of the libfontconfig API that font selection uses:
+//!
+//! - patterns: `FcPatternCreate`, `FcNameParse`, `FcNameUnparse`,
+//!   `FcPatternAdd*`, `FcPatternGet*`, `FcPatternDel`, `FcPatternEqual`,
+//!   `FcPatternHash`, `FcPatternDuplicate`, ... (char sets, matrices,
+//!   FreeType faces and language sets are never stored)
+//! - `FcFontMatch`, `FcFontSort`, `FcFontList`, `FcFontRenderPrepare`,
+//!   `FcConfigGetFonts`
+//! - font sets and object sets (`FcObjectSetBuild` and
+//!   `FcObjectSetVaBuild` are C-variadic, they are in src/variadic.c)
+//! - `FcInit*` / `FcConfig*`, which don't do anything - configuration
+//!   files are only read to find the font directories
+//!
+//! Every other function of the libfontconfig ABI is a stub that prints
+//! its name and aborts (src/unsupported.c), so that a preloaded shim never
+//! lets the real libfontconfig see its patterns. The library has the
+//! SONAME `libfontconfig.so.1`, so it can also replace libfontconfig
+//! through `LD_LIBRARY_PATH` (link it as `libfontconfig.so.1`).
+//!
+//! All calls use `FcFontCache::global()`, `FcInitReinitialize` and
+//! `FcInitBringUptoDate` refresh it. If `RUST_FONTCONFIG_CACHE` names a
+//! file, the cache is loaded from that `FcCompactCache` file, or built and
+//! written there if it doesn't exist yet or a font directory changed after
+//! it was written - so only the first process scans the fonts.
+//!
+//! Panics never unwind into C: a function that panics returns NULL,
+//! `FcFalse` or `FcResultNoMatch`, and a scan that panics leaves the
+//! cache empty.
+//!
+//! `FcFontList` filters like rust-fontconfig: `family`, `fullname`,
+//! `weight` (bold from 200 up), `slant` (italic / oblique) and `spacing`
+//! (mono from 100 up). `FcFontMatch` and `FcFontSort` work like
+//! libfontconfig: they try the `fullname`, then every `family` in order,
+//! and rank the faces of the first one that has any by spacing, slant,
+//! weight and width - the weight of a face is estimated from the style
+//! words of its name ("Light", "Black", ...). The generic families
+//! `sans-serif`, `serif` and `monospace` stand for the families that
+//! fontconfig's default configuration prefers, and `sans-serif` is tried
+//! after the families of every pattern. `FcFontMatch` always returns a
+//! font if there is one, the best ranked one of all fonts if no family
+//! matches. `FcDefaultSubstitute` sets regular weight, roman slant and
+//! normal width.
+
+#![allow(non_snake_case, non_camel_case_types)]
+
+use rust_fontconfig::{self as rfc, FcCompactCache, FcFontCache, FcFontPath, PatternMatch};
+use std::collections::{BTreeMap, BTreeSet};
+use std::collections::hash_map::DefaultHasher;
+use std::convert::TryFrom;
+use std::ffi::{CStr, CString};
+use std::fmt::Write;
+use std::hash::{Hash, Hasher};
+use std::os::raw::{c_char, c_double, c_int, c_uchar, c_uint, c_void};
+use std::panic::{self, AssertUnwindSafe};
+use std::ptr;
+use std::sync::{Arc, Mutex, Once};
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+pub type FcChar8 = c_uchar;
+pub type FcChar32 = c_uint;
+pub type FcBool = c_int;
+pub type FcResult = c_int;
+pub type FcMatchKind = c_int;
+pub type FcType = c_int;
+pub type FcSetName = c_int;
+pub type FT_Face = *mut c_void;
+
+const FC_FALSE: FcBool = 0;
+const FC_TRUE: FcBool = 1;
+
+const FC_RESULT_MATCH: FcResult = 0;
+const FC_RESULT_NO_MATCH: FcResult = 1;
+const FC_RESULT_TYPE_MISMATCH: FcResult = 2;
+const FC_RESULT_NO_ID: FcResult = 3;
+
+const FC_TYPE_INTEGER: FcType = 1;
+const FC_TYPE_DOUBLE: FcType = 2;
+const FC_TYPE_STRING: FcType = 3;
+const FC_TYPE_BOOL: FcType = 4;
+
+const FC_SET_SYSTEM: FcSetName = 0;
+
+// libfontconfig version this library is compatible with (2.13.1)
+const FC_VERSION: c_int = 21301;
+
+const FC_WEIGHT_REGULAR: i32 = 80;
+const FC_WEIGHT_BOLD: i32 = 200;
+const FC_SLANT_ROMAN: i32 = 0;
+const FC_SLANT_ITALIC: i32 = 100;
+const FC_SLANT_OBLIQUE: i32 = 110;
+const FC_PROPORTIONAL: i32 = 0;
+const FC_MONO: i32 = 100;
+const FC_WIDTH_CONDENSED: i32 = 75;
+const FC_WIDTH_NORMAL: i32 = 100;
+
+const FC_MATCH_PATTERN: FcMatchKind = 0;
+
+// preferred families for the generic names, in the order of fontconfig's
+// 60-latin.conf, with the metric-compatible Liberation and Noto families
+const SANS_SERIF: &[&str] = &["DejaVu Sans", "Noto Sans", "Liberation Sans", "Verdana", "Arial", "Nimbus Sans", "Helvetica"];
+const SERIF: &[&str] = &["DejaVu Serif", "Noto Serif", "Liberation Serif", "Times New Roman", "Nimbus Roman", "Times"];
+const MONOSPACE: &[&str] = &["DejaVu Sans Mono", "Noto Sans Mono", "Liberation Mono", "Inconsolata", "Courier New", "Nimbus Mono PS", "Courier"];
+
+// fontconfig weight of the style words in a face name, longest words first
+const STYLE_WEIGHTS: &[(&str, i32)] = &[
+    ("extralight", 40), ("ultralight", 40), ("demilight", 55), ("semilight", 55),
+    ("extrabold", 205), ("ultrabold", 205), ("demibold", 180), ("semibold", 180),
+    ("hairline", 0), ("thin", 0), ("light", 50), ("book", 75), ("medium", 100),
+    ("black", 210), ("heavy", 210), ("bold", 200),
+];
+
+/// Environment variable with the path of the frozen cache file
+const CACHE_FILE_VAR: &str = "RUST_FONTCONFIG_CACHE";
+
+/// Opaque, the configuration is not used
+pub struct FcConfig {
+    _private: u8,
+}
+
+/// Opaque, `FcFontSort` never computes coverage
+pub struct FcCharSet {
+    _private: u8,
+}
+
+/// Same layout as `FcMatrix` in fontconfig.h, never stored in a pattern
+#[repr(C)]
+pub struct FcMatrix {
+    pub xx: c_double,
+    pub xy: c_double,
+    pub yx: c_double,
+    pub yy: c_double,
+}
+
+/// Opaque, never stored in a pattern
+pub struct FcLangSet {
+    _private: u8,
+}
+
+/// Opaque pattern, a list of (object, value) pairs
+#[derive(Debug)]
+pub struct FcPattern {
+    values: Vec<(CString, FcValue)>,
+    refs: AtomicUsize,
+}
+
+#[derive(Debug, Clone, PartialEq, Eq, PartialOrd, Ord, Hash)]
+enum FcValue {
+    String(CString),
+    Integer(i32),
+    Bool(FcBool),
+    // f64 bits, so that values can be ordered for deduplication
+    Double(u64),
+}
+
+impl FcValue {
+
+    // strings point into the pattern
+    fn to_c(&self) -> FcValueC {
+        match self {
+            FcValue::String(s) => FcValueC { type_: FC_TYPE_STRING, u: FcValueUnion { s: s.as_ptr() as *const FcChar8 } },
+            FcValue::Integer(i) => FcValueC { type_: FC_TYPE_INTEGER, u: FcValueUnion { i: *i } },
+            FcValue::Bool(b) => FcValueC { type_: FC_TYPE_BOOL, u: FcValueUnion { b: *b } },
+            FcValue::Double(d) => FcValueC { type_: FC_TYPE_DOUBLE, u: FcValueUnion { d: f64::from_bits(*d) } },
+        }
+    }
+
+    // in the syntax of `FcNameParse`
+    fn unparse(&self, out: &mut String) {
+        let _ = match self {
+            FcValue::String(s) => {
+                FcEscape(&s.to_string_lossy(), out);
+                Ok(())
+            },
+            FcValue::Integer(i) => write!(out, "{}", i),
+            FcValue::Bool(b) => write!(out, "{}", if *b != FC_FALSE { "True" } else { "False" }),
+            FcValue::Double(d) => write!(out, "{}", f64::from_bits(*d)),
+        };
+    }
+}
+
+/// Same layout as `struct _FcValue` in fontconfig.h, see `FcPatternGet`
+#[repr(C)]
+#[derive(Copy, Clone)]
+pub struct FcValueC {
+    pub type_: FcType,
+    pub u: FcValueUnion,
+}
+
+#[repr(C)]
+#[derive(Copy, Clone)]
+pub union FcValueUnion {
+    pub s: *const FcChar8,
+    pub i: c_int,
+    pub b: FcBool,
+    pub d: c_double,
+    // matrix, char set, FreeType face, language set and range
+    pub p: *const c_void,
+}
+
+/// Same layout as `struct _FcFontSet` in fontconfig.h
+#[repr(C)]
+pub struct FcFontSet {
+    pub nfont: c_int,
+    pub sfont: c_int,
+    pub fonts: *mut *mut FcPattern,
+    // owns the patterns, `fonts` points into it
+    patterns: Vec<*mut FcPattern>,
+}
+
+/// Same layout as `struct _FcObjectSet` in fontconfig.h
+#[repr(C)]
+pub struct FcObjectSet {
+    pub nobject: c_int,
+    pub sobject: c_int,
+    pub objects: *mut *const c_char,
+    // `objects` points into `pointers`, which point into `names`
+    pointers: Vec<*const c_char>,
+    names: Vec<CString>,
+}
+
+static CONFIG: FcConfig = FcConfig { _private: 0 };
+
+fn FcShimConfig() -> *mut FcConfig {
+    &CONFIG as *const FcConfig as *mut FcConfig
+}
+
+// `FcFontCache::global()` (shared with Rust code in the same process),
+// fetched on every call so that refreshes reach all callers
+fn FcShimCache() -> Arc<FcFontCache> {
+    FcShimInstallBuilder();
+    FcFontCache::global()
+}
+
+fn FcShimRefresh() {
+    FcShimInstallBuilder();
+    FcFontCache::refresh_global();
+}
+
+// `FcShimBuild`, unless the process set its own builder
+fn FcShimInstallBuilder() {
+    static INSTALL: Once = Once::new();
+    INSTALL.call_once(|| {
+        FcFontCache::set_default_global_builder(FcShimBuild);
+    });
+}
+
+// Spellings of the families and full names in a cache by their
+// lowercase form - fontconfig compares them case-insensitively, the
+// indexes of rust-fontconfig don't
+struct FcFoldedNames {
+    generation: u64,
+    families: BTreeMap<String, Vec<String>>,
+    names: BTreeMap<String, Vec<String>>,
+}
+
+impl FcFoldedNames {
+
+    fn new(cache: &FcFontCache) -> Self {
+        let mut folded = FcFoldedNames { generation: cache.generation(), families: BTreeMap::new(), names: BTreeMap::new() };
+        for k in cache.list().keys() {
+            for (map, s) in [(&mut folded.families, &k.family), (&mut folded.names, &k.name)].iter_mut() {
+                if let Some(s) = s {
+                    let spellings = map.entry(s.to_lowercase()).or_insert_with(Vec::new);
+                    if !spellings.contains(s) {
+                        spellings.push(s.clone());
+                    }
+                }
+            }
+        }
+        folded
+    }
+
+    fn families(&self, family: &str) -> &[String] {
+        self.families.get(&family.to_lowercase()).map(|s| s.as_slice()).unwrap_or(&[])
+    }
+
+    fn names(&self, name: &str) -> &[String] {
+        self.names.get(&name.to_lowercase()).map(|s| s.as_slice()).unwrap_or(&[])
+    }
+}
+
+// built once per generation of the cache
+fn FcShimFoldedNames(cache: &FcFontCache) -> Arc<FcFoldedNames> {
+    static FOLDED: Mutex<Option<Arc<FcFoldedNames>>> = Mutex::new(None);
+    let mut folded = FOLDED.lock().unwrap_or_else(|e| e.into_inner());
+    match folded.as_ref() {
+        Some(f) if f.generation == cache.generation() => f.clone(),
+        _ => {
+            let f = Arc::new(FcFoldedNames::new(cache));
+            *folded = Some(f.clone());
+            f
+        },
+    }
+}
+
+// a panic while scanning the fonts leaves the process without fonts,
+// instead of unwinding into the global cache (and from there into C)
+fn FcShimBuild() -> FcFontCache {
+    FcCatch(FcFontCache::default(), FcShimBuildInner)
+}
+
+fn FcShimBuildInner() -> FcFontCache {
+    let file = match std::env::var_os(CACHE_FILE_VAR) {
+        Some(f) => f,
+        None => return FcFontCache::build(),
+    };
+    // rebuilt if a font directory changed after the file was written
+    let written = std::fs::metadata(&file).and_then(|m| m.modified()).ok();
+    if written.is_some() && written >= rfc::FcFontDirectoriesModified() {
+        if let Ok(compact) = FcCompactCache::open(&file) {
+            return compact.to_cache();
+        }
+    }
+    let cache = FcFontCache::build();
+    // replaced atomically, another process may be reading the file
+    let _ = FcCompactCache::write(&cache, &file);
+    cache
+}
+
+impl FcPattern {
+
+    fn new(values: Vec<(CString, FcValue)>) -> *mut FcPattern {
+        Box::into_raw(Box::new(FcPattern { values, refs: AtomicUsize::new(1) }))
+    }
+
+    // like libfontconfig: NoMatch if the object has no values, NoId if
+    // it has no `n`th value
+    fn get(&self, object: &CStr, n: c_int) -> Result<&FcValue, FcResult> {
+        let mut values = self.values.iter().filter(|(o, _)| o.as_c_str() == object).map(|(_, v)| v).peekable();
+        if values.peek().is_none() {
+            return Err(FC_RESULT_NO_MATCH);
+        }
+        usize::try_from(n).ok().and_then(|n| values.nth(n)).ok_or(FC_RESULT_NO_ID)
+    }
+
+    // values by object, in the order in which they were added - what
+    // FcPatternEqual compares
+    fn by_object(&self) -> BTreeMap<&CStr, Vec<&FcValue>> {
+        let mut objects = BTreeMap::new();
+        for (o, v) in self.values.iter() {
+            objects.entry(o.as_c_str()).or_insert_with(Vec::new).push(v);
+        }
+        objects
+    }
+
+    fn first_str(&self, object: &str) -> Option<&str> {
+        self.values.iter().find_map(|(o, v)| match v {
+            FcValue::String(s) if o.as_bytes() == object.as_bytes() => s.to_str().ok(),
+            _ => None,
+        })
+    }
+
+    fn first_number(&self, object: &str) -> Option<i32> {
+        self.values.iter().find_map(|(o, v)| match v {
+            _ if o.as_bytes() != object.as_bytes() => None,
+            FcValue::Integer(i) => Some(*i),
+            FcValue::Double(d) => Some(f64::from_bits(*d) as i32),
+            _ => None,
+        })
+    }
+
+    // the rust-fontconfig patterns that this pattern queries, one per
+    // spelling of its full name and family in the cache
+    fn to_queries(&self, folded: &FcFoldedNames) -> Vec<rfc::FcPattern> {
+        let require = |required| if required { PatternMatch::True } else { PatternMatch::DontCare };
+        let slant = self.first_number("slant");
+        let query = rfc::FcPattern {
+            bold: require(self.first_number("weight").map(|w| w >= FC_WEIGHT_BOLD).unwrap_or(false)),
+            italic: require(slant == Some(FC_SLANT_ITALIC)),
+            oblique: require(slant == Some(FC_SLANT_OBLIQUE)),
+            monospace: require(self.first_number("spacing").map(|s| s >= FC_MONO).unwrap_or(false)),
+            .. Default::default()
+        };
+        // [None] if the pattern doesn't have the object
+        let spellings = |spellings: Option<&[String]>| match spellings {
+            Some(s) => s.iter().map(|s| Some(s.clone())).collect::<Vec<_>>(),
+            None => vec![None],
+        };
+        let names = spellings(self.first_str("fullname").map(|n| folded.names(n)));
+        let families = spellings(self.first_str("family").map(|f| folded.families(f)));
+        names.iter().flat_map(|name| families.iter().map(move |family| (name, family)))
+            .map(|(name, family)| rfc::FcPattern { name: name.clone(), family: family.clone(), .. query.clone() })
+            .collect()
+    }
+
+    fn strings<'a>(&'a self, object: &'a str) -> impl Iterator<Item = &'a str> + 'a {
+        self.values.iter().filter_map(move |(o, v)| match v {
+            FcValue::String(s) if o.as_bytes() == object.as_bytes() => s.to_str().ok(),
+            _ => None,
+        })
+    }
+
+    // what FcFontMatch and FcFontSort look for, with the defaults of
+    // FcDefaultSubstitute for missing values
+    fn to_match_query(&self) -> FcMatchQuery<'_> {
+        FcMatchQuery {
+            fullname: self.first_str("fullname"),
+            families: FcFamilies(&self.strings("family").collect::<Vec<_>>()),
+            weight: self.first_number("weight").unwrap_or(FC_WEIGHT_REGULAR),
+            slant: self.first_number("slant").unwrap_or(FC_SLANT_ROMAN),
+            width: self.first_number("width").unwrap_or(FC_WIDTH_NORMAL),
+            monospace: self.first_number("spacing").map(|s| s >= FC_MONO).unwrap_or(false),
+        }
+    }
+
+    // result pattern of a font
+    fn from_font(pattern: &rfc::FcPattern, font: &FcFontPath) -> Vec<(CString, FcValue)> {
+
+        let mut values = Vec::new();
+        let mut push = |object: &str, value| values.push((FcCString(object), value));
+
+        let bold = pattern.bold == PatternMatch::True;
+        let italic = pattern.italic == PatternMatch::True;
+        let oblique = pattern.oblique == PatternMatch::True;
+
+        if let Some(family) = pattern.family.as_deref() {
+            push("family", FcValue::String(FcCString(family)));
+        }
+        let style = match (bold, italic, oblique) {
+            (true, true, _) => "Bold Italic",
+            (true, false, true) => "Bold Oblique",
+            (true, false, false) => "Bold",
+            (false, true, _) => "Italic",
+            (false, false, true) => "Oblique",
+            (false, false, false) => "Regular",
+        };
+        push("style", FcValue::String(FcCString(style)));
+        if let Some(name) = pattern.name.as_deref() {
+            push("fullname", FcValue::String(FcCString(name)));
+        }
+        push("file", FcValue::String(FcCString(&font.path)));
+        push("index", FcValue::Integer(font.font_index as i32));
+        push("weight", FcValue::Integer(if bold { FC_WEIGHT_BOLD } else { FC_WEIGHT_REGULAR }));
+        push("slant", FcValue::Integer(if italic { FC_SLANT_ITALIC } else if oblique { FC_SLANT_OBLIQUE } else { FC_SLANT_ROMAN }));
+        push("spacing", FcValue::Integer(if pattern.monospace == PatternMatch::True { FC_MONO } else { FC_PROPORTIONAL }));
+        push("width", FcValue::Integer(if pattern.condensed == PatternMatch::True { FC_WIDTH_CONDENSED } else { FC_WIDTH_NORMAL }));
+        push("scalable", FcValue::Bool(FC_TRUE));
+        values
+    }
+}
+
+impl FcFontSet {
+
+    fn new(patterns: Vec<*mut FcPattern>) -> *mut FcFontSet {
+        let mut set = Box::new(FcFontSet { nfont: 0, sfont: 0, fonts: ptr::null_mut(), patterns });
+        set.sync();
+        Box::into_raw(set)
+    }
+
+    fn sync(&mut self) {
+        self.nfont = self.patterns.len() as c_int;
+        self.sfont = self.patterns.capacity() as c_int;
+        self.fonts = self.patterns.as_mut_ptr();
+    }
+}
+
+// unwinding into C is undefined behaviour, so every entry point that
+// does more than return a constant returns `error` on a panic instead
+fn FcCatch<T>(error: T, f: impl FnOnce() -> T) -> T {
+    panic::catch_unwind(AssertUnwindSafe(f)).unwrap_or(error)
+}
+
+// backslash before the characters that separate families, objects and values
+fn FcEscape(s: &str, out: &mut String) {
+    for c in s.chars() {
+        if "\\-:,=".contains(c) {
+            out.push('\\');
+        }
+        out.push(c);
+    }
+}
+
+// object names never contain NUL
+fn FcCString(s: &str) -> CString {
+    CString::new(s).unwrap_or_else(|_| CString::new(s.replace('\0', "")).unwrap_or_default())
+}
+
+unsafe fn FcCStr<'a>(s: *const c_char) -> Option<&'a CStr> {
+    if s.is_null() { None } else { Some(CStr::from_ptr(s)) }
+}
+
+unsafe fn FcAdd(p: *mut FcPattern, object: *const c_char, value: FcValue) -> FcBool {
+    match (p.as_mut(), FcCStr(object)) {
+        (Some(p), Some(object)) => {
+            p.values.push((object.to_owned(), value));
+            FC_TRUE
+        },
+        _ => FC_FALSE,
+    }
+}
+
+unsafe fn FcGet<T>(p: *const FcPattern, object: *const c_char, n: c_int, out: *mut T, convert: impl FnOnce(&FcValue) -> Option<T>) -> FcResult {
+    let value = match (p.as_ref(), FcCStr(object)) {
+        (Some(p), Some(object)) => p.get(object, n),
+        _ => return FC_RESULT_NO_MATCH,
+    };
+    match value.map(convert) {
+        Err(e) => e,
+        Ok(None) => FC_RESULT_TYPE_MISMATCH,
+        Ok(Some(v)) => {
+            if !out.is_null() {
+                *out = v;
+            }
+            FC_RESULT_MATCH
+        },
+    }
+}
+
+type FcFontEntry<'a> = (&'a rfc::FcPattern, &'a FcFontPath);
+
+// see `FcPattern::to_match_query`
+struct FcMatchQuery<'a> {
+    fullname: Option<&'a str>,
+    families: Vec<&'a str>,
+    weight: i32,
+    slant: i32,
+    width: i32,
+    monospace: bool,
+}
+
+impl<'a> FcMatchQuery<'a> {
+
+    // how far a face is from the query, lower is better - in the order of
+    // importance of fontconfig: spacing, slant, weight, width
+    fn distance(&self, font: &rfc::FcPattern) -> (bool, u8, i32, i32) {
+        let slant = if font.italic == PatternMatch::True {
+            FC_SLANT_ITALIC
+        } else if font.oblique == PatternMatch::True {
+            FC_SLANT_OBLIQUE
+        } else {
+            FC_SLANT_ROMAN
+        };
+        let width = if font.condensed == PatternMatch::True { FC_WIDTH_CONDENSED } else { FC_WIDTH_NORMAL };
+        (
+            self.monospace != (font.monospace == PatternMatch::True),
+            // italic and oblique are closer to each other than to roman
+            if slant == self.slant { 0 } else if slant != FC_SLANT_ROMAN && self.slant != FC_SLANT_ROMAN { 1 } else { 2 },
+            (FcFontWeight(font) - self.weight).abs(),
+            (width - self.width).abs(),
+        )
+    }
+
+    // faces with the full name, then the faces of each family in order -
+    // lazily, so that FcFontMatch stops at the first one that has any
+    // (names and families are compared case-insensitively)
+    fn stages<'c>(&'c self, cache: &'c FcFontCache, folded: &'c FcFoldedNames) -> impl Iterator<Item = Vec<FcFontEntry<'c>>> + 'c {
+        let by_name = self.fullname.map(move |n| {
+            folded.names(n).iter().map(|n| rfc::FcPattern { name: Some(n.clone()), .. Default::default() }).collect::<Vec<_>>()
+        });
+        let by_family = self.families.iter().map(move |f| {
+            folded.families(f).iter().map(|f| rfc::FcPattern { family: Some(f.clone()), .. Default::default() }).collect::<Vec<_>>()
+        });
+        by_name.into_iter().chain(by_family).map(move |patterns| {
+            let mut fonts = patterns.iter().flat_map(|p| cache.query_all(p)).collect::<Vec<_>>();
+            // ties in cache order
+            fonts.sort_by_key(|(k, _)| (self.distance(k), *k));
+            fonts
+        })
+    }
+
+    fn best<'c>(&self, fonts: impl Iterator<Item = FcFontEntry<'c>>) -> Option<FcFontEntry<'c>> {
+        fonts.min_by_key(|(k, _)| self.distance(k))
+    }
+}
+
+// the families to try, in order: generic names are replaced by their
+// preferred families, and sans-serif is tried last (like fontconfig's
+// 49-sansserif.conf), without duplicates
+fn FcFamilies<'a>(families: &[&'a str]) -> Vec<&'a str> {
+    let mut out = Vec::new();
+    for family in families.iter().chain(Some(&"sans-serif")) {
+        let expanded = match family.to_ascii_lowercase().as_str() {
+            "sans-serif" | "sans" => SANS_SERIF,
+            "serif" => SERIF,
+            "monospace" | "mono" => MONOSPACE,
+            _ => core::slice::from_ref(family),
+        };
+        for f in expanded {
+            if !out.iter().any(|o: &&str| o.eq_ignore_ascii_case(f)) {
+                out.push(*f);
+            }
+        }
+    }
+    out
+}
+
+// fontconfig weight of a face: from the style words of its name, bold
+// or regular without any
+fn FcFontWeight(font: &rfc::FcPattern) -> i32 {
+    let name = font.name.as_deref().unwrap_or("");
+    // only the part after the family name, "Noto Sans Black" -> "black"
+    let style = match font.family.as_deref() {
+        Some(family) if name.starts_with(family) => &name[family.len()..],
+        _ => name,
+    };
+    let style = style.chars().filter(|c| c.is_ascii_alphabetic()).collect::<String>().to_ascii_lowercase();
+    STYLE_WEIGHTS.iter()
+        .find(|(word, _)| style.contains(word))
+        .map(|(_, weight)| *weight)
+        .unwrap_or(if font.bold == PatternMatch::True { FC_WEIGHT_BOLD } else { FC_WEIGHT_REGULAR })
+}
+
+// -- initialization and configuration (no-ops)
+
+#[no_mangle]
+pub extern "C" fn FcInit() -> FcBool {
+    FcCatch(FC_FALSE, || {
+        FcShimCache();
+        FC_TRUE
+    })
+}
+
+#[no_mangle]
+pub extern "C" fn FcFini() { }
+
+#[no_mangle]
+pub extern "C" fn FcGetVersion() -> c_int {
+    FC_VERSION
+}
+
+#[no_mangle]
+pub extern "C" fn FcInitLoadConfig() -> *mut FcConfig {
+    FcShimConfig()
+}
+
+#[no_mangle]
+pub extern "C" fn FcInitLoadConfigAndFonts() -> *mut FcConfig {
+    FcCatch(ptr::null_mut(), || {
+        FcShimCache();
+        FcShimConfig()
+    })
+}
+
+#[no_mangle]
+pub extern "C" fn FcInitReinitialize() -> FcBool {
+    FcCatch(FC_FALSE, || {
+        FcShimRefresh();
+        FC_TRUE
+    })
+}
+
+#[no_mangle]
+pub extern "C" fn FcInitBringUptoDate() -> FcBool {
+    FcCatch(FC_FALSE, || {
+        FcShimRefresh();
+        FC_TRUE
+    })
+}
+
+#[no_mangle]
+pub extern "C" fn FcConfigCreate() -> *mut FcConfig {
+    FcShimConfig()
+}
+
+#[no_mangle]
+pub extern "C" fn FcConfigGetCurrent() -> *mut FcConfig {
+    FcShimConfig()
+}
+
+#[no_mangle]
+pub extern "C" fn FcConfigReference(_config: *mut FcConfig) -> *mut FcConfig {
+    FcShimConfig()
+}
+
+#[no_mangle]
+pub extern "C" fn FcConfigSetCurrent(_config: *mut FcConfig) -> FcBool {
+    FC_TRUE
+}
+
+#[no_mangle]
+pub extern "C" fn FcConfigDestroy(_config: *mut FcConfig) { }
+
+#[no_mangle]
+pub extern "C" fn FcConfigUptoDate(_config: *mut FcConfig) -> FcBool {
+    FC_TRUE
+}
+
+#[no_mangle]
+pub extern "C" fn FcConfigBuildFonts(_config: *mut FcConfig) -> FcBool {
+    FcCatch(FC_FALSE, || {
+        FcShimCache();
+        FC_TRUE
+    })
+}
+
+// result of FcConfigGetFonts for a generation of the cache
+struct FcSystemFonts {
+    generation: u64,
+    set: *mut FcFontSet,
+}
+
+// only accessed through the mutex in FcConfigGetFonts
+unsafe impl Send for FcSystemFonts { }
+
+/// All fonts for `FcSetSystem`, NULL for `FcSetApplication` (fonts can't
+/// be added) - the set belongs to the library, don't destroy it. It stays
+/// valid until the fonts are refreshed (`FcInitReinitialize`,
+/// `FcInitBringUptoDate`).
+#[no_mangle]
+pub extern "C" fn FcConfigGetFonts(_config: *mut FcConfig, set: FcSetName) -> *mut FcFontSet {
+    FcCatch(ptr::null_mut(), || {
+
+        static FONTS: Mutex<Option<FcSystemFonts>> = Mutex::new(None);
+
+        if set != FC_SET_SYSTEM {
+            return ptr::null_mut();
+        }
+
+        let cache = FcShimCache();
+        let mut fonts = FONTS.lock().unwrap_or_else(|e| e.into_inner());
+        match fonts.as_ref() {
+            Some(f) if f.generation == cache.generation() => f.set,
+            _ => {
+                let patterns = cache.list().iter().map(|(k, v)| FcPattern::new(FcPattern::from_font(k, v))).collect();
+                let set = FcFontSet::new(patterns);
+                if let Some(old) = fonts.replace(FcSystemFonts { generation: cache.generation(), set }) {
+                    unsafe { FcFontSetDestroy(old.set) };
+                }
+                set
+            },
+        }
+    })
+}
+
+/// Replaces generic families with their preferred families and appends
+/// the sans-serif families, see `FcFamilies`
+#[no_mangle]
+pub unsafe extern "C" fn FcConfigSubstitute(_config: *mut FcConfig, p: *mut FcPattern, kind: FcMatchKind) -> FcBool {
+    FcCatch(FC_FALSE, || {
+        let p = match p.as_mut() {
+            Some(p) if kind == FC_MATCH_PATTERN => p,
+            _ => return FC_TRUE,
+        };
+        let families = FcFamilies(&p.strings("family").collect::<Vec<_>>())
+            .into_iter()
+            .map(|f| (FcCString("family"), FcValue::String(FcCString(f))))
+            .collect::<Vec<_>>();
+        p.values.retain(|(o, _)| o.as_bytes() != b"family");
+        p.values.extend(families);
+        FC_TRUE
+    })
+}
+
+/// Sets regular weight, roman slant and normal width if the pattern
+/// doesn't have them
+#[no_mangle]
+pub unsafe extern "C" fn FcDefaultSubstitute(p: *mut FcPattern) {
+    FcCatch((), || {
+        if let Some(p) = p.as_mut() {
+            for (object, value) in [("weight", FC_WEIGHT_REGULAR), ("slant", FC_SLANT_ROMAN), ("width", FC_WIDTH_NORMAL)].iter() {
+                if p.first_number(object).is_none() {
+                    p.values.push((FcCString(object), FcValue::Integer(*value)));
+                }
+            }
+        }
+    })
+}
+
+// -- patterns
+
+#[no_mangle]
+pub extern "C" fn FcPatternCreate() -> *mut FcPattern {
+    FcCatch(ptr::null_mut(), || {
+        FcPattern::new(Vec::new())
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternDuplicate(p: *const FcPattern) -> *mut FcPattern {
+    FcCatch(ptr::null_mut(), || {
+        match p.as_ref() {
+            Some(p) => FcPattern::new(p.values.clone()),
+            None => ptr::null_mut(),
+        }
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternReference(p: *mut FcPattern) {
+    FcCatch((), || {
+        if let Some(p) = p.as_ref() {
+            p.refs.fetch_add(1, Ordering::Relaxed);
+        }
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternDestroy(p: *mut FcPattern) {
+    FcCatch((), || {
+        if let Some(pattern) = p.as_ref() {
+            if pattern.refs.fetch_sub(1, Ordering::AcqRel) == 1 {
+                drop(Box::from_raw(p));
+            }
+        }
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternAddString(p: *mut FcPattern, object: *const c_char, s: *const FcChar8) -> FcBool {
+    FcCatch(FC_FALSE, || {
+        match FcCStr(s as *const c_char) {
+            Some(s) => FcAdd(p, object, FcValue::String(s.to_owned())),
+            None => FC_FALSE,
+        }
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternAddInteger(p: *mut FcPattern, object: *const c_char, i: c_int) -> FcBool {
+    FcCatch(FC_FALSE, || {
+        FcAdd(p, object, FcValue::Integer(i))
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternAddDouble(p: *mut FcPattern, object: *const c_char, d: c_double) -> FcBool {
+    FcCatch(FC_FALSE, || {
+        FcAdd(p, object, FcValue::Double(d.to_bits()))
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternAddBool(p: *mut FcPattern, object: *const c_char, b: FcBool) -> FcBool {
+    FcCatch(FC_FALSE, || {
+        FcAdd(p, object, FcValue::Bool(b))
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternDel(p: *mut FcPattern, object: *const c_char) -> FcBool {
+    FcCatch(FC_FALSE, || {
+        match (p.as_mut(), FcCStr(object)) {
+            (Some(p), Some(object)) => {
+                let len = p.values.len();
+                p.values.retain(|(o, _)| o.as_c_str() != object);
+                if p.values.len() != len { FC_TRUE } else { FC_FALSE }
+            },
+            _ => FC_FALSE,
+        }
+    })
+}
+
+/// The string stays valid until the pattern is destroyed
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternGetString(p: *const FcPattern, object: *const c_char, n: c_int, s: *mut *mut FcChar8) -> FcResult {
+    FcCatch(FC_RESULT_NO_MATCH, || {
+        FcGet(p, object, n, s, |v| match v {
+            FcValue::String(s) => Some(s.as_ptr() as *mut FcChar8),
+            _ => None,
+        })
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternGetInteger(p: *const FcPattern, object: *const c_char, n: c_int, i: *mut c_int) -> FcResult {
+    FcCatch(FC_RESULT_NO_MATCH, || {
+        FcGet(p, object, n, i, |v| match v {
+            FcValue::Integer(i) => Some(*i),
+            FcValue::Double(d) => Some(f64::from_bits(*d) as c_int),
+            _ => None,
+        })
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternGetDouble(p: *const FcPattern, object: *const c_char, n: c_int, d: *mut c_double) -> FcResult {
+    FcCatch(FC_RESULT_NO_MATCH, || {
+        FcGet(p, object, n, d, |v| match v {
+            FcValue::Double(d) => Some(f64::from_bits(*d)),
+            FcValue::Integer(i) => Some(*i as c_double),
+            _ => None,
+        })
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternGetBool(p: *const FcPattern, object: *const c_char, n: c_int, b: *mut FcBool) -> FcResult {
+    FcCatch(FC_RESULT_NO_MATCH, || {
+        FcGet(p, object, n, b, |v| match v {
+            FcValue::Bool(b) => Some(*b),
+            _ => None,
+        })
+    })
+}
+
+/// Strings point into the pattern, see `FcPatternGetString`
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternGet(p: *const FcPattern, object: *const c_char, n: c_int, v: *mut FcValueC) -> FcResult {
+    FcCatch(FC_RESULT_NO_MATCH, || {
+        FcGet(p, object, n, v, |v| Some(v.to_c()))
+    })
+}
+
+// The shim never stores char sets, matrices, FreeType faces or language
+// sets: these return FcResultNoMatch (FcResultTypeMismatch if the object
+// has values of another type)
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternGetCharSet(p: *const FcPattern, object: *const c_char, n: c_int, c: *mut *mut FcCharSet) -> FcResult {
+    FcCatch(FC_RESULT_NO_MATCH, || FcGet(p, object, n, c, |_| None))
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternGetMatrix(p: *const FcPattern, object: *const c_char, n: c_int, m: *mut *mut FcMatrix) -> FcResult {
+    FcCatch(FC_RESULT_NO_MATCH, || FcGet(p, object, n, m, |_| None))
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternGetFTFace(p: *const FcPattern, object: *const c_char, n: c_int, f: *mut FT_Face) -> FcResult {
+    FcCatch(FC_RESULT_NO_MATCH, || FcGet(p, object, n, f, |_| None))
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternGetLangSet(p: *const FcPattern, object: *const c_char, n: c_int, ls: *mut *mut FcLangSet) -> FcResult {
+    FcCatch(FC_RESULT_NO_MATCH, || FcGet(p, object, n, ls, |_| None))
+}
+
+/// Same objects with the same values, in the same order per object
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternEqual(pa: *const FcPattern, pb: *const FcPattern) -> FcBool {
+    FcCatch(FC_FALSE, || {
+        let equal = match (pa.as_ref(), pb.as_ref()) {
+            (Some(a), Some(b)) => a.by_object() == b.by_object(),
+            _ => pa == pb,
+        };
+        if equal { FC_TRUE } else { FC_FALSE }
+    })
+}
+
+/// Equal patterns (see `FcPatternEqual`) have equal hashes
+#[no_mangle]
+pub unsafe extern "C" fn FcPatternHash(p: *const FcPattern) -> FcChar32 {
+    FcCatch(0, || {
+        let mut hasher = DefaultHasher::new();
+        if let Some(p) = p.as_ref() {
+            p.by_object().hash(&mut hasher);
+        }
+        hasher.finish() as FcChar32
+    })
+}
+
+/// Parses a fontconfig pattern string, see `rust_fontconfig::parse`
+#[no_mangle]
+pub unsafe extern "C" fn FcNameParse(name: *const FcChar8) -> *mut FcPattern {
+    FcCatch(ptr::null_mut(), || {
+
+        let pattern = match FcCStr(name as *const c_char).map(|n| n.to_str()) {
+            Some(Ok(n)) => match rfc::FcPatternRef::parse(n) {
+                Ok(o) => o,
+                Err(_) => return ptr::null_mut(),
+            },
+            _ => return ptr::null_mut(),
+        };
+
+        let mut values = Vec::new();
+        if let Some(family) = pattern.family.as_deref() {
+            values.push((FcCString("family"), FcValue::String(FcCString(family))));
+        }
+        if let Some(name) = pattern.name.as_deref() {
+            values.push((FcCString("fullname"), FcValue::String(FcCString(name))));
+        }
+        if pattern.weight != 0 {
+            values.push((FcCString("weight"), FcValue::Integer(pattern.weight.min(i32::MAX as usize) as i32)));
+        } else if pattern.bold == PatternMatch::True {
+            values.push((FcCString("weight"), FcValue::Integer(FC_WEIGHT_BOLD)));
+        }
+        if pattern.italic == PatternMatch::True {
+            values.push((FcCString("slant"), FcValue::Integer(FC_SLANT_ITALIC)));
+        } else if pattern.oblique == PatternMatch::True {
+            values.push((FcCString("slant"), FcValue::Integer(FC_SLANT_OBLIQUE)));
+        }
+        if pattern.monospace == PatternMatch::True {
+            values.push((FcCString("spacing"), FcValue::Integer(FC_MONO)));
+        }
+        if pattern.condensed == PatternMatch::True {
+            values.push((FcCString("width"), FcValue::Integer(FC_WIDTH_CONDENSED)));
+        }
+        FcPattern::new(values)
+    })
+}
+
+/// Formats a pattern in the syntax of `FcNameParse`: the families, then
+/// `:object=value,value` for the other objects - free the result with
+/// `FcStrFree` or `free`
+#[no_mangle]
+pub unsafe extern "C" fn FcNameUnparse(p: *mut FcPattern) -> *mut FcChar8 {
+    FcCatch(ptr::null_mut(), || {
+
+        let p = match p.as_ref() {
+            Some(p) => p,
+            None => return ptr::null_mut(),
+        };
+
+        let mut name = String::new();
+        let objects = p.by_object();
+        let family = FcCString("family");
+        for (i, value) in objects.get(family.as_c_str()).into_iter().flatten().enumerate() {
+            if i > 0 {
+                name.push(',');
+            }
+            value.unparse(&mut name);
+        }
+        for (object, values) in objects.iter().filter(|(o, _)| **o != family.as_c_str()) {
+            name.push(':');
+            FcEscape(&object.to_string_lossy(), &mut name);
+            name.push('=');
+            for (i, value) in values.iter().enumerate() {
+                if i > 0 {
+                    name.push(',');
+                }
+                value.unparse(&mut name);
+            }
+        }
+
+        FcMallocStr(&FcCString(&name))
+    })
+}
+
+// -- strings
+
+extern "C" {
+    fn malloc(size: usize) -> *mut c_void;
+    fn free(p: *mut c_void);
+}
+
+// copy of `s` that C code can free(), like the strings of libfontconfig
+fn FcMallocStr(s: &CStr) -> *mut FcChar8 {
+    let bytes = s.to_bytes_with_nul();
+    unsafe {
+        let copy = malloc(bytes.len()) as *mut FcChar8;
+        if !copy.is_null() {
+            ptr::copy_nonoverlapping(bytes.as_ptr(), copy, bytes.len());
+        }
+        copy
+    }
+}
+
+/// Frees a string returned by the library, NULL is ignored
+#[no_mangle]
+pub unsafe extern "C" fn FcStrFree(s: *mut FcChar8) {
+    free(s as *mut c_void);
+}
+
+// -- matching
+
+#[no_mangle]
+pub unsafe extern "C" fn FcFontMatch(_config: *mut FcConfig, p: *mut FcPattern, result: *mut FcResult) -> *mut FcPattern {
+    FcCatch(ptr::null_mut(), || {
+
+        let empty = FcPattern { values: Vec::new(), refs: AtomicUsize::new(1) };
+        let query = p.as_ref().unwrap_or(&empty).to_match_query();
+
+        // the best face of the first stage that has any, else of all fonts
+        let cache = FcShimCache();
+        let folded = FcShimFoldedNames(&cache);
+        let font = query.stages(&cache, &folded)
+            .find_map(|fonts| fonts.into_iter().next())
+            .or_else(|| query.best(cache.list().iter()));
+
+        if let Some(result) = result.as_mut() {
+            *result = if font.is_some() { FC_RESULT_MATCH } else { FC_RESULT_NO_MATCH };
+        }
+
+        match font {
+            Some((k, v)) => FcPattern::new(FcPattern::from_font(k, v)),
+            None => ptr::null_mut(),
+        }
+    })
+}
+
+/// Fonts for the pattern, best first: the faces of the full name and of
+/// every family, each ranked - with `trim == FcFalse` followed by all
+/// other fonts, ranked. `csp` is set to NULL, coverage is not computed.
+/// Contains the result of `FcFontMatch` at least.
+#[no_mangle]
+pub unsafe extern "C" fn FcFontSort(_config: *mut FcConfig, p: *mut FcPattern, trim: FcBool, csp: *mut *mut FcCharSet, result: *mut FcResult) -> *mut FcFontSet {
+    FcCatch(ptr::null_mut(), || {
+
+        let empty = FcPattern { values: Vec::new(), refs: AtomicUsize::new(1) };
+        let query = p.as_ref().unwrap_or(&empty).to_match_query();
+
+        let cache = FcShimCache();
+        let folded = FcShimFoldedNames(&cache);
+        let mut seen = BTreeSet::new();
+        let mut fonts = Vec::new();
+        for stage in query.stages(&cache, &folded) {
+            fonts.extend(stage.into_iter().filter(|(k, _)| seen.insert(*k)));
+        }
+        if trim == FC_FALSE {
+            let start = fonts.len();
+            fonts.extend(cache.list().iter().filter(|(k, _)| !seen.contains(k)));
+            fonts[start..].sort_by_key(|(k, _)| query.distance(k));
+        } else if fonts.is_empty() {
+            fonts.extend(query.best(cache.list().iter()));
+        }
+
+        if let Some(csp) = csp.as_mut() {
+            *csp = ptr::null_mut();
+        }
+        if let Some(result) = result.as_mut() {
+            *result = if fonts.is_empty() { FC_RESULT_NO_MATCH } else { FC_RESULT_MATCH };
+        }
+
+        FcFontSet::new(fonts.into_iter().map(|(k, v)| FcPattern::new(FcPattern::from_font(k, v))).collect())
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcFontRenderPrepare(_config: *mut FcConfig, _pat: *mut FcPattern, font: *mut FcPattern) -> *mut FcPattern {
+    FcCatch(ptr::null_mut(), || {
+        FcPatternDuplicate(font)
+    })
+}
+
+/// Fonts that match the pattern, with only the objects in `os` (all
+/// objects if `os` is NULL), without duplicates
+#[no_mangle]
+pub unsafe extern "C" fn FcFontList(_config: *mut FcConfig, p: *mut FcPattern, os: *mut FcObjectSet) -> *mut FcFontSet {
+    FcCatch(ptr::null_mut(), || {
+
+        let cache = FcShimCache();
+        let queries = match p.as_ref() {
+            Some(p) => p.to_queries(&FcShimFoldedNames(&cache)),
+            None => vec![rfc::FcPattern::default()],
+        };
+        let objects = os.as_ref().map(|os| &os.names);
+
+        let mut seen = BTreeSet::new();
+        let mut patterns = Vec::new();
+
+        for (k, v) in queries.iter().flat_map(|q| cache.query_all(q)) {
+            let mut values = FcPattern::from_font(k, v);
+            if let Some(objects) = objects {
+                values.retain(|(o, _)| objects.contains(o));
+            }
+            if seen.insert(values.clone()) {
+                patterns.push(FcPattern::new(values));
+            }
+        }
+
+        FcFontSet::new(patterns)
+    })
+}
+
+// -- font sets
+
+#[no_mangle]
+pub extern "C" fn FcFontSetCreate() -> *mut FcFontSet {
+    FcCatch(ptr::null_mut(), || {
+        FcFontSet::new(Vec::new())
+    })
+}
+
+/// Takes ownership of `font`
+#[no_mangle]
+pub unsafe extern "C" fn FcFontSetAdd(s: *mut FcFontSet, font: *mut FcPattern) -> FcBool {
+    FcCatch(FC_FALSE, || {
+        match s.as_mut() {
+            Some(s) if !font.is_null() => {
+                s.patterns.push(font);
+                s.sync();
+                FC_TRUE
+            },
+            _ => FC_FALSE,
+        }
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcFontSetDestroy(s: *mut FcFontSet) {
+    FcCatch((), || {
+        if s.is_null() {
+            return;
+        }
+        let set = Box::from_raw(s);
+        for p in set.patterns.iter() {
+            FcPatternDestroy(*p);
+        }
+    })
+}
+
+// -- object sets
+
+#[no_mangle]
+pub extern "C" fn FcObjectSetCreate() -> *mut FcObjectSet {
+    FcCatch(ptr::null_mut(), || {
+        Box::into_raw(Box::new(FcObjectSet {
+            nobject: 0,
+            sobject: 0,
+            objects: ptr::null_mut(),
+            pointers: Vec::new(),
+            names: Vec::new(),
+        }))
+    })
+}
+
+/// Also called by `FcObjectSetBuild` (src/variadic.c)
+#[no_mangle]
+pub unsafe extern "C" fn FcObjectSetAdd(os: *mut FcObjectSet, object: *const c_char) -> FcBool {
+    FcCatch(FC_FALSE, || {
+        match (os.as_mut(), FcCStr(object)) {
+            (Some(os), Some(object)) => {
+                os.names.push(object.to_owned());
+                // moving a CString doesn't move its heap buffer
+                os.pointers = os.names.iter().map(|n| n.as_ptr()).collect();
+                os.nobject = os.pointers.len() as c_int;
+                os.sobject = os.pointers.capacity() as c_int;
+                os.objects = os.pointers.as_mut_ptr();
+                FC_TRUE
+            },
+            _ => FC_FALSE,
+        }
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn FcObjectSetDestroy(os: *mut FcObjectSet) {
+    FcCatch((), || {
+        if !os.is_null() {
+            drop(Box::from_raw(os));
+        }
+    })
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+
+    extern "C" {
+        // src/variadic.c, returns a `FcObjectSet`
+        fn FcObjectSetBuild(first: *const c_char, ...) -> *mut c_void;
+    }
+
+    fn face(family: &str, style: &str, bold: bool, italic: bool, monospace: bool) -> (rfc::FcPattern, FcFontPath) {
+        let b = |x| if x { PatternMatch::True } else { PatternMatch::False };
+        (rfc::FcPattern {
+            name: Some(format!("{} {}", family, style)),
+            family: Some(family.to_string()),
+            bold: b(bold),
+            italic: b(italic),
+            monospace: b(monospace),
+            .. Default::default()
+        }, FcFontPath { path: format!("/f/{}-{}.ttf", family.replace(' ', ""), style.replace(' ', "")), .. Default::default() })
+    }
+
+    // the global cache is shared by all tests, its builder has to be set
+    // before the first call installs the one of the shim
+    fn init() {
+        static INIT: Once = Once::new();
+        INIT.call_once(|| {
+            FcFontCache::set_global_builder(|| vec![
+                face("Noto Sans", "Black", true, false, false),
+                face("Noto Sans", "Bold", true, false, false),
+                face("Noto Sans", "Light", false, false, false),
+                face("Noto Sans", "Regular", false, false, false),
+                face("Noto Sans", "Italic", false, true, false),
+                face("Noto Sans", "Bold Italic", true, true, false),
+                face("Aardvark", "Regular", false, false, false),
+                face("DejaVu Sans Mono", "Book", false, false, true),
+                face("DejaVu Serif", "Book", false, false, false),
+                face("DejaVu Sans", "Book", false, false, false),
+            ].into_iter().collect());
+        });
+        assert_eq!(FcInit(), FC_TRUE);
+    }
+
+    fn c(s: &str) -> CString {
+        CString::new(s).unwrap()
+    }
+
+    unsafe fn get_string(p: *const FcPattern, object: &str, n: c_int) -> Result<String, FcResult> {
+        let mut s = ptr::null_mut();
+        match FcPatternGetString(p, c(object).as_ptr(), n, &mut s) {
+            FC_RESULT_MATCH => Ok(CStr::from_ptr(s as *const c_char).to_str().unwrap().to_string()),
+            e => Err(e),
+        }
+    }
+
+    unsafe fn files(set: *const FcFontSet) -> Vec<String> {
+        let set = &*set;
+        (0..set.nfont as usize).map(|i| get_string(*set.fonts.add(i), "file", 0).unwrap()).collect()
+    }
+
+    // FcFontMatch for a pattern string, optionally after the substitutions
+    unsafe fn match_file(name: &str, substitute: bool) -> String {
+        let p = FcNameParse(c(name).as_ptr() as *const FcChar8);
+        assert!(!p.is_null(), "{}", name);
+        if substitute {
+            FcConfigSubstitute(ptr::null_mut(), p, FC_MATCH_PATTERN);
+            FcDefaultSubstitute(p);
+        }
+        let mut result = FC_RESULT_NO_MATCH;
+        let font = FcFontMatch(ptr::null_mut(), p, &mut result);
+        assert_eq!(result, FC_RESULT_MATCH);
+        let file = get_string(font, "file", 0).unwrap();
+        FcPatternDestroy(font);
+        FcPatternDestroy(p);
+        file
+    }
+
+    #[test]
+    fn name_parse_and_match() {
+        init();
+        unsafe {
+            for substitute in [false, true].iter() {
+                assert_eq!(match_file("Noto Sans", *substitute), "/f/NotoSans-Regular.ttf");
+                assert_eq!(match_file("Noto Sans:bold", *substitute), "/f/NotoSans-Bold.ttf");
+                assert_eq!(match_file("Noto Sans:weight=210", *substitute), "/f/NotoSans-Black.ttf");
+                assert_eq!(match_file("Noto Sans:light", *substitute), "/f/NotoSans-Light.ttf");
+                assert_eq!(match_file("Noto Sans:bold:italic", *substitute), "/f/NotoSans-BoldItalic.ttf");
+                // case-insensitive, like fontconfig
+                assert_eq!(match_file("dejavu sans", *substitute), "/f/DejaVuSans-Book.ttf");
+                assert_eq!(match_file("NOTO SANS:bold", *substitute), "/f/NotoSans-Bold.ttf");
+                // generic families, and sans-serif for unknown families
+                assert_eq!(match_file("serif", *substitute), "/f/DejaVuSerif-Book.ttf");
+                assert_eq!(match_file("monospace", *substitute), "/f/DejaVuSansMono-Book.ttf");
+                assert_eq!(match_file("Missing Family", *substitute), "/f/DejaVuSans-Book.ttf");
+                assert_eq!(match_file("Aardvark:bold", *substitute), "/f/Aardvark-Regular.ttf");
+            }
+        }
+    }
+
+    #[test]
+    fn pattern_getters() {
+        unsafe {
+
+            let p = FcNameParse(c("Noto Sans:bold").as_ptr() as *const FcChar8);
+            assert_eq!(get_string(p, "family", 0), Ok(String::from("Noto Sans")));
+            assert_eq!(get_string(p, "family", 1), Err(FC_RESULT_NO_ID));
+            assert_eq!(get_string(p, "family", -1), Err(FC_RESULT_NO_ID));
+            assert_eq!(get_string(p, "file", 0), Err(FC_RESULT_NO_MATCH));
+            assert_eq!(get_string(p, "weight", 0), Err(FC_RESULT_TYPE_MISMATCH));
+
+            let mut i = 0;
+            assert_eq!(FcPatternGetInteger(p, c("weight").as_ptr(), 0, &mut i), FC_RESULT_MATCH);
+            assert_eq!(i, FC_WEIGHT_BOLD);
+            let mut d = 0.0;
+            assert_eq!(FcPatternGetDouble(p, c("weight").as_ptr(), 0, &mut d), FC_RESULT_MATCH);
+            assert_eq!(d, FC_WEIGHT_BOLD as f64);
+
+            FcPatternAddDouble(p, c("size").as_ptr(), 10.5);
+            FcPatternAddBool(p, c("antialias").as_ptr(), FC_TRUE);
+            let mut v = FcValueC { type_: 0, u: FcValueUnion { i: 0 } };
+            assert_eq!(FcPatternGet(p, c("size").as_ptr(), 0, &mut v), FC_RESULT_MATCH);
+            assert_eq!((v.type_, v.u.d), (FC_TYPE_DOUBLE, 10.5));
+            assert_eq!(FcPatternGet(p, c("family").as_ptr(), 0, &mut v), FC_RESULT_MATCH);
+            assert_eq!((v.type_, CStr::from_ptr(v.u.s as *const c_char).to_str()), (FC_TYPE_STRING, Ok("Noto Sans")));
+            assert_eq!(FcPatternGet(p, c("antialias").as_ptr(), 0, &mut v), FC_RESULT_MATCH);
+            assert_eq!((v.type_, v.u.b), (FC_TYPE_BOOL, FC_TRUE));
+            assert_eq!(FcPatternGet(p, c("size").as_ptr(), 1, &mut v), FC_RESULT_NO_ID);
+
+            // types the shim never stores
+            let mut charset = ptr::null_mut();
+            let mut matrix = ptr::null_mut();
+            let mut face = ptr::null_mut();
+            let mut langset = ptr::null_mut();
+            assert_eq!(FcPatternGetCharSet(p, c("charset").as_ptr(), 0, &mut charset), FC_RESULT_NO_MATCH);
+            assert_eq!(FcPatternGetMatrix(p, c("matrix").as_ptr(), 0, &mut matrix), FC_RESULT_NO_MATCH);
+            assert_eq!(FcPatternGetFTFace(p, c("ftface").as_ptr(), 0, &mut face), FC_RESULT_NO_MATCH);
+            assert_eq!(FcPatternGetLangSet(p, c("lang").as_ptr(), 0, &mut langset), FC_RESULT_NO_MATCH);
+            assert_eq!(FcPatternGetMatrix(p, c("family").as_ptr(), 0, &mut matrix), FC_RESULT_TYPE_MISMATCH);
+
+            FcPatternDestroy(p);
+        }
+    }
+
+    #[test]
+    fn equal_hash_and_unparse() {
+        unsafe {
+
+            let p = FcNameParse(c("Noto Sans:bold:italic").as_ptr() as *const FcChar8);
+            FcPatternAddDouble(p, c("size").as_ptr(), 12.0);
+            let duplicate = FcPatternDuplicate(p);
+            assert_eq!(FcPatternEqual(p, duplicate), FC_TRUE);
+            assert_eq!(FcPatternHash(p), FcPatternHash(duplicate));
+
+            // the order of different objects doesn't matter, of values does
+            let reordered = FcPatternCreate();
+            FcPatternAddDouble(reordered, c("size").as_ptr(), 12.0);
+            FcPatternAddInteger(reordered, c("slant").as_ptr(), FC_SLANT_ITALIC);
+            FcPatternAddInteger(reordered, c("weight").as_ptr(), FC_WEIGHT_BOLD);
+            FcPatternAddString(reordered, c("family").as_ptr(), c("Noto Sans").as_ptr() as *const FcChar8);
+            assert_eq!(FcPatternEqual(p, reordered), FC_TRUE);
+            assert_eq!(FcPatternHash(p), FcPatternHash(reordered));
+            FcPatternAddString(duplicate, c("family").as_ptr(), c("Serif").as_ptr() as *const FcChar8);
+            FcPatternAddString(reordered, c("family").as_ptr(), c("Serif").as_ptr() as *const FcChar8);
+            FcPatternAddString(p, c("family").as_ptr(), c("Sans").as_ptr() as *const FcChar8);
+            assert_eq!(FcPatternEqual(duplicate, reordered), FC_TRUE);
+            assert_eq!(FcPatternEqual(p, duplicate), FC_FALSE);
+            assert_eq!(FcPatternEqual(p, ptr::null()), FC_FALSE);
+            assert_eq!(FcPatternEqual(ptr::null(), ptr::null()), FC_TRUE);
+
+            let name = FcNameUnparse(duplicate);
+            assert_eq!(CStr::from_ptr(name as *const c_char).to_str(), Ok("Noto Sans,Serif:size=12:slant=100:weight=200"));
+            FcStrFree(name);
+            FcStrFree(ptr::null_mut());
+
+            // escapes, and the result parses to the same pattern
+            let escaped = FcPatternCreate();
+            FcPatternAddString(escaped, c("family").as_ptr(), c("A-B:C").as_ptr() as *const FcChar8);
+            FcPatternAddInteger(escaped, c("weight").as_ptr(), FC_WEIGHT_BOLD);
+            let name = FcNameUnparse(escaped);
+            assert_eq!(CStr::from_ptr(name as *const c_char).to_str(), Ok("A\\-B\\:C:weight=200"));
+            let parsed = FcNameParse(name);
+            assert_eq!(FcPatternEqual(escaped, parsed), FC_TRUE);
+            FcStrFree(name);
+
+            for p in [p, duplicate, reordered, escaped, parsed].iter() {
+                FcPatternDestroy(*p);
+            }
+        }
+    }
+
+    #[test]
+    fn font_sort() {
+        init();
+        unsafe {
+
+            let p = FcNameParse(c("Noto Sans:italic").as_ptr() as *const FcChar8);
+            let mut csp = 1 as *mut FcCharSet;
+            let mut result = FC_RESULT_NO_MATCH;
+
+            // the faces of the family, best first, then of sans-serif
+            let trimmed = FcFontSort(ptr::null_mut(), p, FC_TRUE, &mut csp, &mut result);
+            assert_eq!((result, csp), (FC_RESULT_MATCH, ptr::null_mut()));
+            let trimmed_files = files(trimmed);
+            assert_eq!(trimmed_files.len(), 7);
+            assert_eq!(trimmed_files[..2], ["/f/NotoSans-Italic.ttf", "/f/NotoSans-BoldItalic.ttf"]);
+            assert_eq!(trimmed_files[6], "/f/DejaVuSans-Book.ttf");
+
+            // followed by all other fonts, without duplicates
+            let all = FcFontSort(ptr::null_mut(), p, FC_FALSE, ptr::null_mut(), &mut result);
+            let all_files = files(all);
+            assert_eq!(all_files.len(), 10);
+            assert_eq!(all_files[..7], trimmed_files[..]);
+            assert_eq!(all_files.iter().collect::<BTreeSet<_>>().len(), 10);
+
+            // the first one is the result of FcFontMatch
+            let font = FcFontMatch(ptr::null_mut(), p, &mut result);
+            assert_eq!(get_string(font, "file", 0).unwrap(), all_files[0]);
+
+            FcPatternDestroy(font);
+            FcFontSetDestroy(trimmed);
+            FcFontSetDestroy(all);
+            FcPatternDestroy(p);
+        }
+    }
+
+    #[test]
+    fn font_list() {
+        init();
+        unsafe {
+
+            let os = FcObjectSetBuild(c("family").as_ptr(), c("style").as_ptr(), ptr::null::<c_char>()) as *mut FcObjectSet;
+            assert_eq!((*os).nobject, 2);
+
+            // one pattern per family and style, only with these objects
+            let all = FcPatternCreate();
+            let list = FcFontList(ptr::null_mut(), all, os);
+            assert_eq!((*list).nfont, 8);
+            let first = *(*list).fonts;
+            assert_eq!(get_string(first, "file", 0), Err(FC_RESULT_NO_MATCH));
+            assert!(get_string(first, "family", 0).is_ok() && get_string(first, "style", 0).is_ok());
+            FcFontSetDestroy(list);
+
+            // bold faces of the family, the family matches case-insensitively
+            let bold = FcNameParse(c("noto sans:bold").as_ptr() as *const FcChar8);
+            let list = FcFontList(ptr::null_mut(), bold, os);
+            let styles = (0..(*list).nfont as usize).map(|i| get_string(*(*list).fonts.add(i), "style", 0).unwrap()).collect::<BTreeSet<_>>();
+            assert_eq!(styles, ["Bold", "Bold Italic"].iter().map(|s| s.to_string()).collect());
+            FcFontSetDestroy(list);
+
+            // all objects without an object set
+            let list = FcFontList(ptr::null_mut(), bold, ptr::null_mut());
+            assert_eq!(files(list).len(), 3);
+            FcFontSetDestroy(list);
+
+            // owned by the library, the same set until the fonts change
+            let system = FcConfigGetFonts(ptr::null_mut(), FC_SET_SYSTEM);
+            assert_eq!((*system).nfont, 10);
+            assert_eq!(FcConfigGetFonts(ptr::null_mut(), FC_SET_SYSTEM), system);
+            assert!(FcConfigGetFonts(ptr::null_mut(), 1).is_null());
+
+            FcPatternDestroy(bold);
+            FcPatternDestroy(all);
+            FcObjectSetDestroy(os);
+        }
+    }
+
+    #[test]
+    fn reference_counting() {
+        unsafe {
+
+            let p = FcPatternCreate();
+            let refs = |p: *mut FcPattern| (*p).refs.load(Ordering::SeqCst);
+            FcPatternReference(p);
+            assert_eq!(refs(p), 2);
+            FcPatternDestroy(p);
+            assert_eq!(refs(p), 1);
+
+            // a font set owns its patterns, the reference keeps `p` alive
+            let set = FcFontSetCreate();
+            FcPatternReference(p);
+            assert_eq!(FcFontSetAdd(set, p), FC_TRUE);
+            assert_eq!(FcFontSetAdd(set, ptr::null_mut()), FC_FALSE);
+            assert_eq!(((*set).nfont, *(*set).fonts), (1, p));
+            FcFontSetDestroy(set);
+            assert_eq!(refs(p), 1);
+            assert_eq!(FcPatternAddInteger(p, c("weight").as_ptr(), 80), FC_TRUE);
+
+            // NULL is ignored
+            FcPatternReference(ptr::null_mut());
+            FcPatternDestroy(ptr::null_mut());
+            FcFontSetDestroy(ptr::null_mut());
+            FcObjectSetDestroy(ptr::null_mut());
+
+            FcPatternDestroy(p);
+        }
+    }
+}
@@ -0,0 +1,23 @@
+/*
+ * Stubs for the rest of the libfontconfig ABI (src/unsupported.h): they
+ * print the name of the function and abort.
+ *
+ * Without them, a program that preloads this library would resolve the
+ * missing functions in the real libfontconfig, which it still loads as a
+ * dependency, and pass it patterns with a different layout. Compiled and
+ * exported by build.rs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static void FcShimUnsupported(const char *name)
+{
+    fprintf(stderr, "fontconfig-shim: %s is not supported\n", name);
+    abort();
+}
+
+/* the real signatures don't matter, the stubs never return */
+#define FC_UNSUPPORTED(name) void name(void) { FcShimUnsupported(#name); }
+
+#include "unsupported.h"
@@ -0,0 +1,191 @@
+/*
+ * Functions of the libfontconfig.so.1 ABI (as of fontconfig 2.14) that this
+ * library doesn't implement, see src/unsupported.c - one FC_UNSUPPORTED
+ * line per function, build.rs reads the names from here.
+ */
+
+FC_UNSUPPORTED(FcAtomicCreate)
+FC_UNSUPPORTED(FcAtomicDeleteNew)
+FC_UNSUPPORTED(FcAtomicDestroy)
+FC_UNSUPPORTED(FcAtomicLock)
+FC_UNSUPPORTED(FcAtomicNewFile)
+FC_UNSUPPORTED(FcAtomicOrigFile)
+FC_UNSUPPORTED(FcAtomicReplaceOrig)
+FC_UNSUPPORTED(FcAtomicUnlock)
+FC_UNSUPPORTED(FcBlanksAdd)
+FC_UNSUPPORTED(FcBlanksCreate)
+FC_UNSUPPORTED(FcBlanksDestroy)
+FC_UNSUPPORTED(FcBlanksIsMember)
+FC_UNSUPPORTED(FcCacheCopySet)
+FC_UNSUPPORTED(FcCacheCreateTagFile)
+FC_UNSUPPORTED(FcCacheDir)
+FC_UNSUPPORTED(FcCacheNumFont)
+FC_UNSUPPORTED(FcCacheNumSubdir)
+FC_UNSUPPORTED(FcCacheSubdir)
+FC_UNSUPPORTED(FcCharSetAddChar)
+FC_UNSUPPORTED(FcCharSetCopy)
+FC_UNSUPPORTED(FcCharSetCount)
+FC_UNSUPPORTED(FcCharSetCoverage)
+FC_UNSUPPORTED(FcCharSetCreate)
+FC_UNSUPPORTED(FcCharSetDelChar)
+FC_UNSUPPORTED(FcCharSetDestroy)
+FC_UNSUPPORTED(FcCharSetEqual)
+FC_UNSUPPORTED(FcCharSetFirstPage)
+FC_UNSUPPORTED(FcCharSetHasChar)
+FC_UNSUPPORTED(FcCharSetIntersect)
+FC_UNSUPPORTED(FcCharSetIntersectCount)
+FC_UNSUPPORTED(FcCharSetIsSubset)
+FC_UNSUPPORTED(FcCharSetMerge)
+FC_UNSUPPORTED(FcCharSetNew)
+FC_UNSUPPORTED(FcCharSetNextPage)
+FC_UNSUPPORTED(FcCharSetSubtract)
+FC_UNSUPPORTED(FcCharSetSubtractCount)
+FC_UNSUPPORTED(FcCharSetUnion)
+FC_UNSUPPORTED(FcConfigAddRule)
+FC_UNSUPPORTED(FcConfigAppFontAddDir)
+FC_UNSUPPORTED(FcConfigAppFontAddFile)
+FC_UNSUPPORTED(FcConfigAppFontClear)
+FC_UNSUPPORTED(FcConfigEnableHome)
+FC_UNSUPPORTED(FcConfigFileInfoIterGet)
+FC_UNSUPPORTED(FcConfigFileInfoIterInit)
+FC_UNSUPPORTED(FcConfigFileInfoIterNext)
+FC_UNSUPPORTED(FcConfigFilename)
+FC_UNSUPPORTED(FcConfigGetBlanks)
+FC_UNSUPPORTED(FcConfigGetCache)
+FC_UNSUPPORTED(FcConfigGetCacheDirs)
+FC_UNSUPPORTED(FcConfigGetConfigDirs)
+FC_UNSUPPORTED(FcConfigGetConfigFiles)
+FC_UNSUPPORTED(FcConfigGetFilename)
+FC_UNSUPPORTED(FcConfigGetFontDirs)
+FC_UNSUPPORTED(FcConfigGetRescanInterval)
+FC_UNSUPPORTED(FcConfigGetRescanInverval)
+FC_UNSUPPORTED(FcConfigGetSysRoot)
+FC_UNSUPPORTED(FcConfigHome)
+FC_UNSUPPORTED(FcConfigParseAndLoad)
+FC_UNSUPPORTED(FcConfigParseAndLoadFromMemory)
+FC_UNSUPPORTED(FcConfigSetRescanInterval)
+FC_UNSUPPORTED(FcConfigSetRescanInverval)
+FC_UNSUPPORTED(FcConfigSetSysRoot)
+FC_UNSUPPORTED(FcConfigSubstituteWithPat)
+FC_UNSUPPORTED(FcDirCacheClean)
+FC_UNSUPPORTED(FcDirCacheCreateUUID)
+FC_UNSUPPORTED(FcDirCacheDeleteUUID)
+FC_UNSUPPORTED(FcDirCacheLoad)
+FC_UNSUPPORTED(FcDirCacheLoadFile)
+FC_UNSUPPORTED(FcDirCacheRead)
+FC_UNSUPPORTED(FcDirCacheRescan)
+FC_UNSUPPORTED(FcDirCacheUnlink)
+FC_UNSUPPORTED(FcDirCacheUnload)
+FC_UNSUPPORTED(FcDirCacheValid)
+FC_UNSUPPORTED(FcDirSave)
+FC_UNSUPPORTED(FcDirScan)
+FC_UNSUPPORTED(FcFileIsDir)
+FC_UNSUPPORTED(FcFileScan)
+FC_UNSUPPORTED(FcFontSetList)
+FC_UNSUPPORTED(FcFontSetMatch)
+FC_UNSUPPORTED(FcFontSetPrint)
+FC_UNSUPPORTED(FcFontSetSort)
+FC_UNSUPPORTED(FcFontSetSortDestroy)
+FC_UNSUPPORTED(FcFreeTypeCharIndex)
+FC_UNSUPPORTED(FcFreeTypeCharSet)
+FC_UNSUPPORTED(FcFreeTypeCharSetAndSpacing)
+FC_UNSUPPORTED(FcFreeTypeQuery)
+FC_UNSUPPORTED(FcFreeTypeQueryAll)
+FC_UNSUPPORTED(FcFreeTypeQueryFace)
+FC_UNSUPPORTED(FcGetDefaultLangs)
+FC_UNSUPPORTED(FcGetLangs)
+FC_UNSUPPORTED(FcLangGetCharSet)
+FC_UNSUPPORTED(FcLangNormalize)
+FC_UNSUPPORTED(FcLangSetAdd)
+FC_UNSUPPORTED(FcLangSetCompare)
+FC_UNSUPPORTED(FcLangSetContains)
+FC_UNSUPPORTED(FcLangSetCopy)
+FC_UNSUPPORTED(FcLangSetCreate)
+FC_UNSUPPORTED(FcLangSetDel)
+FC_UNSUPPORTED(FcLangSetDestroy)
+FC_UNSUPPORTED(FcLangSetEqual)
+FC_UNSUPPORTED(FcLangSetGetLangs)
+FC_UNSUPPORTED(FcLangSetHasLang)
+FC_UNSUPPORTED(FcLangSetHash)
+FC_UNSUPPORTED(FcLangSetSubtract)
+FC_UNSUPPORTED(FcLangSetUnion)
+FC_UNSUPPORTED(FcMatrixCopy)
+FC_UNSUPPORTED(FcMatrixEqual)
+FC_UNSUPPORTED(FcMatrixMultiply)
+FC_UNSUPPORTED(FcMatrixRotate)
+FC_UNSUPPORTED(FcMatrixScale)
+FC_UNSUPPORTED(FcMatrixShear)
+FC_UNSUPPORTED(FcNameConstant)
+FC_UNSUPPORTED(FcNameGetConstant)
+FC_UNSUPPORTED(FcNameGetObjectType)
+FC_UNSUPPORTED(FcNameRegisterConstants)
+FC_UNSUPPORTED(FcNameRegisterObjectTypes)
+FC_UNSUPPORTED(FcNameUnregisterConstants)
+FC_UNSUPPORTED(FcNameUnregisterObjectTypes)
+FC_UNSUPPORTED(FcPatternAdd)
+FC_UNSUPPORTED(FcPatternAddCharSet)
+FC_UNSUPPORTED(FcPatternAddFTFace)
+FC_UNSUPPORTED(FcPatternAddLangSet)
+FC_UNSUPPORTED(FcPatternAddMatrix)
+FC_UNSUPPORTED(FcPatternAddRange)
+FC_UNSUPPORTED(FcPatternAddWeak)
+FC_UNSUPPORTED(FcPatternBuild)
+FC_UNSUPPORTED(FcPatternEqualSubset)
+FC_UNSUPPORTED(FcPatternFilter)
+FC_UNSUPPORTED(FcPatternFindIter)
+FC_UNSUPPORTED(FcPatternFormat)
+FC_UNSUPPORTED(FcPatternGetRange)
+FC_UNSUPPORTED(FcPatternGetWithBinding)
+FC_UNSUPPORTED(FcPatternIterEqual)
+FC_UNSUPPORTED(FcPatternIterGetObject)
+FC_UNSUPPORTED(FcPatternIterGetValue)
+FC_UNSUPPORTED(FcPatternIterIsValid)
+FC_UNSUPPORTED(FcPatternIterNext)
+FC_UNSUPPORTED(FcPatternIterStart)
+FC_UNSUPPORTED(FcPatternIterValueCount)
+FC_UNSUPPORTED(FcPatternObjectCount)
+FC_UNSUPPORTED(FcPatternPrint)
+FC_UNSUPPORTED(FcPatternRemove)
+FC_UNSUPPORTED(FcPatternVaBuild)
+FC_UNSUPPORTED(FcRangeCopy)
+FC_UNSUPPORTED(FcRangeCreateDouble)
+FC_UNSUPPORTED(FcRangeCreateInteger)
+FC_UNSUPPORTED(FcRangeDestroy)
+FC_UNSUPPORTED(FcRangeGetDouble)
+FC_UNSUPPORTED(FcRuleDestroy)
+FC_UNSUPPORTED(FcScandir)
+FC_UNSUPPORTED(FcStrBasename)
+FC_UNSUPPORTED(FcStrBuildFilename)
+FC_UNSUPPORTED(FcStrCmp)
+FC_UNSUPPORTED(FcStrCmpIgnoreCase)
+FC_UNSUPPORTED(FcStrCopy)
+FC_UNSUPPORTED(FcStrCopyFilename)
+FC_UNSUPPORTED(FcStrDirname)
+FC_UNSUPPORTED(FcStrDowncase)
+FC_UNSUPPORTED(FcStrListCreate)
+FC_UNSUPPORTED(FcStrListDone)
+FC_UNSUPPORTED(FcStrListFirst)
+FC_UNSUPPORTED(FcStrListNext)
+FC_UNSUPPORTED(FcStrPlus)
+FC_UNSUPPORTED(FcStrSetAdd)
+FC_UNSUPPORTED(FcStrSetAddFilename)
+FC_UNSUPPORTED(FcStrSetCreate)
+FC_UNSUPPORTED(FcStrSetDel)
+FC_UNSUPPORTED(FcStrSetDestroy)
+FC_UNSUPPORTED(FcStrSetEqual)
+FC_UNSUPPORTED(FcStrSetMember)
+FC_UNSUPPORTED(FcStrStr)
+FC_UNSUPPORTED(FcStrStrIgnoreCase)
+FC_UNSUPPORTED(FcUcs4ToUtf8)
+FC_UNSUPPORTED(FcUtf16Len)
+FC_UNSUPPORTED(FcUtf16ToUcs4)
+FC_UNSUPPORTED(FcUtf8Len)
+FC_UNSUPPORTED(FcUtf8ToUcs4)
+FC_UNSUPPORTED(FcValueDestroy)
+FC_UNSUPPORTED(FcValueEqual)
+FC_UNSUPPORTED(FcValuePrint)
+FC_UNSUPPORTED(FcValueSave)
+FC_UNSUPPORTED(FcWeightFromOpenType)
+FC_UNSUPPORTED(FcWeightFromOpenTypeDouble)
+FC_UNSUPPORTED(FcWeightToOpenType)
+FC_UNSUPPORTED(FcWeightToOpenTypeDouble)
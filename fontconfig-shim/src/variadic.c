@@ -0,0 +1,35 @@
+/*
+ * The C-variadic part of the API, which stable Rust can't define - forwards
+ * to FcObjectSetCreate / FcObjectSetAdd of src/lib.rs. Compiled and exported
+ * by build.rs.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+
+typedef struct _FcObjectSet FcObjectSet;
+
+FcObjectSet *FcObjectSetCreate(void);
+int FcObjectSetAdd(FcObjectSet *os, const char *object);
+
+FcObjectSet *FcObjectSetVaBuild(const char *first, va_list va)
+{
+    FcObjectSet *os = FcObjectSetCreate();
+    const char *object;
+
+    for (object = first; object != NULL; object = va_arg(va, const char *)) {
+        FcObjectSetAdd(os, object);
+    }
+    return os;
+}
+
+FcObjectSet *FcObjectSetBuild(const char *first, ...)
+{
+    FcObjectSet *os;
+    va_list va;
+
+    va_start(va, first);
+    os = FcObjectSetVaBuild(first, va);
+    va_end(va);
+    return os;
+}
@@ -0,0 +1,88 @@
+/*
+ * C ABI of rust-fontconfig, see src/ffi.rs
+ *
+ * Build with:
+ *
+ *     cargo rustc --release --features ffi --crate-type staticlib   (or cdylib)
+ *
+ * Keep this header in sync with src/ffi.rs.
+ *
+ * All strings are UTF-8 views (pointer + length, not NUL-terminated).
+ * Strings returned in RfcFont point into the cache and stay valid until
+ * rfc_cache_free() - lookups don't copy or allocate. A cache can be
+ * queried from multiple threads at the same time.
+ */
+
+#ifndef RUST_FONTCONFIG_H
+#define RUST_FONTCONFIG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* values of the RfcPattern style fields */
+#define RFC_DONT_CARE 0
+#define RFC_TRUE 1
+#define RFC_FALSE 2
+
+/* opaque cache handle */
+typedef struct RfcCache RfcCache;
+
+/* borrowed UTF-8 string, ptr == NULL means "not set" / "not found" */
+typedef struct RfcStr {
+    const char *ptr;
+    size_t len;
+} RfcStr;
+
+typedef struct RfcPattern {
+    RfcStr name;
+    RfcStr family;
+    /* RFC_DONT_CARE, RFC_TRUE or RFC_FALSE */
+    uint8_t italic;
+    uint8_t oblique;
+    uint8_t bold;
+    uint8_t monospace;
+} RfcPattern;
+
+typedef struct RfcFont {
+    /* path.ptr == NULL if no font was found */
+    RfcStr path;
+    size_t font_index;
+    RfcStr family;
+    RfcStr name;
+} RfcFont;
+
+/* builds a cache from the system fonts (slow, do it once), NULL on failure */
+RfcCache *rfc_cache_build(void);
+
+/* builds a cache from the fonts in dirs[0..count], NULL on failure */
+RfcCache *rfc_cache_build_from_dirs(const RfcStr *dirs, size_t count);
+
+/* frees the cache and invalidates all strings returned for it, NULL is ignored */
+void rfc_cache_free(RfcCache *cache);
+
+/* number of fonts in the cache */
+size_t rfc_cache_len(const RfcCache *cache);
+
+/* changes whenever the fonts of a cache change */
+uint64_t rfc_cache_generation(const RfcCache *cache);
+
+/* 1 = found, 0 = not found, -1 = invalid arguments */
+int32_t rfc_query(const RfcCache *cache, const RfcPattern *pattern, RfcFont *out);
+
+/* fontconfig pattern string, e.g. "DejaVu Sans:bold"
+ * 1 = found, 0 = not found, -1 = invalid arguments or pattern */
+int32_t rfc_query_str(const RfcCache *cache, RfcStr pattern, RfcFont *out);
+
+/* out[i] = result for patterns[i], returns the number of fonts found */
+size_t rfc_query_batch(const RfcCache *cache, const RfcPattern *patterns, size_t count, RfcFont *out);
+size_t rfc_query_str_batch(const RfcCache *cache, const RfcStr *patterns, size_t count, RfcFont *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RUST_FONTCONFIG_H */
@@ -0,0 +1,399 @@
+//! Lists and matches fonts from the command line, with `fc-list` /
+//! `fc-match` style output and built-in timing
+//!
+//! ```text
+//! fcquery [options] list [pattern]             all fonts (matching the pattern)
+//! fcquery [options] match <pattern>            best font for the pattern
+//! fcquery [options] sort <pattern>             all fonts for the pattern, best first
+//! fcquery [options] fallback <pattern>...      first pattern that has a font
+//! fcquery [options] explain <pattern>          candidates, rejection reasons and timing per stage
+//! fcquery [options] stats                      build timings, memory usage, query latency
+//!
+//! options:
+//!   --json            machine-readable output
+//!   --repeat <n>      run match / sort / fallback n times, print latency percentiles
+//!   --threads <n>     number of threads used to build the cache
+//!   --cache <file>    query the compact cache in <file> (see `FcCompactCache`), or
+//!                     build it and write it there if the file does not exist -
+//!                     match and fallback query the file directly, the other
+//!                     commands read it back into a regular cache
+//!   --dir <dir>       scan <dir> instead of the system font directories (repeatable)
+//! ```
+//!
+//! Patterns are fontconfig pattern strings, e.g. `DejaVu Sans:bold` or
+//! `Noto Sans Mono:weight=200:slant=italic`, see `rust_fontconfig::parse`.
+
+use rust_fontconfig::{FcBuildReport, FcCompactCache, FcFontCache, FcFontPath, FcPattern, FcQueryExplanation, PatternMatch};
+use std::collections::BTreeSet;
+use std::path::PathBuf;
+use std::process;
+use std::time::{Duration, Instant};
+
+const USAGE: &str = "usage: fcquery [--json] [--repeat <n>] [--threads <n>] [--cache <file>] [--dir <dir>]... \
+                     <list [pattern] | match <pattern> | sort <pattern> | fallback <pattern>... | explain <pattern> | stats>";
+
+const SLOWEST_FILES: usize = 10;
+
+#[derive(Debug, Default)]
+struct Options {
+    json: bool,
+    repeat: usize,
+    threads: Option<usize>,
+    cache_file: Option<PathBuf>,
+    dirs: Vec<PathBuf>,
+    command: String,
+    args: Vec<String>,
+}
+
+fn parse_args() -> Result<Options, String> {
+
+    let mut options = Options { repeat: 1, .. Default::default() };
+    let mut args = std::env::args().skip(1);
+    let mut positional = Vec::new();
+
+    while let Some(arg) = args.next() {
+        let mut value = |name: &str| args.next().ok_or_else(|| format!("missing value for {}", name));
+        match arg.as_str() {
+            "--json" => options.json = true,
+            "--repeat" => options.repeat = value(&arg)?.parse().map_err(|_| "--repeat expects a number")?,
+            "--threads" => options.threads = Some(value(&arg)?.parse().map_err(|_| "--threads expects a number")?),
+            "--cache" => options.cache_file = Some(PathBuf::from(value(&arg)?)),
+            "--dir" => options.dirs.push(PathBuf::from(value(&arg)?)),
+            "-h" | "--help" => return Err(String::new()),
+            _ if arg.starts_with("--") => return Err(format!("unknown option {}", arg)),
+            _ => positional.push(arg),
+        }
+    }
+
+    if positional.is_empty() {
+        return Err(String::from("missing command"));
+    }
+
+    options.command = positional.remove(0);
+    options.args = positional;
+    options.repeat = options.repeat.max(1);
+    Ok(options)
+}
+
+fn parse_pattern(s: &str) -> Result<FcPattern, String> {
+    s.parse().map_err(|e| format!("invalid pattern {:?}: {}", s, e))
+}
+
+// fonts of an existing `--cache` file, None without one
+fn open_compact(options: &Options) -> Result<Option<FcCompactCache>, String> {
+    match options.cache_file.as_ref().filter(|f| f.exists()) {
+        Some(file) => FcCompactCache::open(file).map(Some).map_err(|e| format!("could not read {}: {}", file.display(), e)),
+        None => Ok(None),
+    }
+}
+
+fn load_cache(options: &Options, with_report: bool) -> Result<(FcFontCache, Duration, Option<FcBuildReport>), String> {
+
+    let start = Instant::now();
+
+    if let Some(compact) = open_compact(options)? {
+        return Ok((compact.to_cache(), start.elapsed(), None));
+    }
+
+    let (cache, report) = if !options.dirs.is_empty() {
+        (FcFontCache::build_from_directories(&options.dirs), None)
+    } else if with_report {
+        let (cache, report) = FcFontCache::build_with_report(SLOWEST_FILES);
+        (cache, Some(report))
+    } else {
+        (FcFontCache::build(), None)
+    };
+    let build_time = start.elapsed();
+
+    if let Some(file) = options.cache_file.as_ref() {
+        FcCompactCache::write(&cache, file).map_err(|e| format!("could not write {}: {}", file.display(), e))?;
+    }
+
+    Ok((cache, build_time, report))
+}
+
+// runs `f` `repeat` times, returns the last result and the sorted latencies
+fn timed<T, F: FnMut() -> T>(repeat: usize, mut f: F) -> (T, Vec<Duration>) {
+    let mut latencies = Vec::with_capacity(repeat);
+    let mut result = None;
+    for _ in 0..repeat {
+        let start = Instant::now();
+        result = Some(f());
+        latencies.push(start.elapsed());
+    }
+    latencies.sort();
+    (result.unwrap(), latencies)
+}
+
+fn percentile(sorted: &[Duration], p: f64) -> Duration {
+    if sorted.is_empty() {
+        return Duration::from_nanos(0);
+    }
+    let i = ((sorted.len() as f64 * p).ceil() as usize).max(1) - 1;
+    sorted[i.min(sorted.len() - 1)]
+}
+
+fn style_name(pattern: &FcPattern) -> String {
+    let mut parts = Vec::new();
+    if pattern.bold == PatternMatch::True { parts.push("Bold"); }
+    if pattern.italic == PatternMatch::True { parts.push("Italic"); }
+    if pattern.oblique == PatternMatch::True { parts.push("Oblique"); }
+    if parts.is_empty() { parts.push("Regular"); }
+    parts.join(" ")
+}
+
+fn json_string(s: &str) -> String {
+    let mut out = String::with_capacity(s.len() + 2);
+    out.push('"');
+    for c in s.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            '\n' => out.push_str("\\n"),
+            '\t' => out.push_str("\\t"),
+            c if (c as u32) < 0x20 => out.push_str(&format!("\\u{:04x}", c as u32)),
+            c => out.push(c),
+        }
+    }
+    out.push('"');
+    out
+}
+
+fn json_option(s: Option<&str>) -> String {
+    s.map(json_string).unwrap_or_else(|| String::from("null"))
+}
+
+fn json_font(pattern: &FcPattern, font: &FcFontPath) -> String {
+    format!(
+        "{{\"path\":{},\"index\":{},\"family\":{},\"name\":{},\"style\":{},\"monospace\":{}}}",
+        json_string(&font.path),
+        font.font_index,
+        json_option(pattern.family.as_deref()),
+        json_option(pattern.name.as_deref()),
+        json_string(&style_name(pattern)),
+        pattern.monospace == PatternMatch::True,
+    )
+}
+
+fn json_latencies(latencies: &[Duration]) -> String {
+    format!(
+        "{{\"queries\":{},\"p50_ns\":{},\"p90_ns\":{},\"p99_ns\":{},\"max_ns\":{}}}",
+        latencies.len(),
+        percentile(latencies, 0.50).as_nanos(),
+        percentile(latencies, 0.90).as_nanos(),
+        percentile(latencies, 0.99).as_nanos(),
+        latencies.last().copied().unwrap_or_default().as_nanos(),
+    )
+}
+
+fn print_latencies(latencies: &[Duration]) {
+    println!(
+        "{} queries: p50 {:?}  p90 {:?}  p99 {:?}  max {:?}",
+        latencies.len(),
+        percentile(latencies, 0.50),
+        percentile(latencies, 0.90),
+        percentile(latencies, 0.99),
+        latencies.last().copied().unwrap_or_default(),
+    );
+}
+
+// fc-list style: "path: family:style=Bold"
+fn list_line(pattern: &FcPattern, font: &FcFontPath) -> String {
+    let index = if font.font_index == 0 { String::new() } else { format!(":{}", font.font_index) };
+    let name = pattern.name.as_deref().map(|n| format!(":fullname={}", n)).unwrap_or_default();
+    format!("{}{}: {}{}:style={}", font.path, index, pattern.family.as_deref().unwrap_or(""), name, style_name(pattern))
+}
+
+// fc-match style: "path: "family" "style""
+fn match_line(pattern: &FcPattern, font: &FcFontPath) -> String {
+    format!("{}: \"{}\" \"{}\"", font.path, pattern.family.as_deref().unwrap_or(""), style_name(pattern))
+}
+
+fn print_fonts(options: &Options, fonts: &[(&FcPattern, &FcFontPath)], line: fn(&FcPattern, &FcFontPath) -> String, latencies: Option<&[Duration]>) {
+    if options.json {
+        let fonts = fonts.iter().map(|(p, f)| json_font(p, f)).collect::<Vec<_>>();
+        let latency = latencies.map(|l| format!(",\"latency\":{}", json_latencies(l))).unwrap_or_default();
+        println!("{{\"fonts\":[{}]{}}}", fonts.join(","), latency);
+    } else {
+        for (pattern, font) in fonts {
+            println!("{}", line(pattern, font));
+        }
+        if let Some(latencies) = latencies {
+            print_latencies(latencies);
+        }
+    }
+}
+
+fn run(options: &Options) -> Result<(), String> {
+
+    let patterns = options.args.iter().map(|s| parse_pattern(s)).collect::<Result<Vec<_>, _>>()?;
+    let latencies_wanted = options.repeat > 1;
+
+    match options.command.as_str() {
+        "list" => {
+            let (cache, _, _) = load_cache(options, false)?;
+            let fonts = match patterns.first() {
+                Some(pattern) => cache.query_all(pattern),
+                None => cache.list().iter().collect(),
+            };
+            print_fonts(options, &fonts, list_line, None);
+        },
+        "match" | "sort" | "fallback" => {
+
+            if patterns.is_empty() || (options.command != "fallback" && patterns.len() > 1) {
+                return Err(format!("{} expects {} pattern", options.command, if options.command == "fallback" { "at least one" } else { "one" }));
+            }
+
+            // "match" is a fallback list with a single pattern
+            if options.command != "sort" {
+                if let Some(compact) = open_compact(options)? {
+                    let (found, latencies) = timed(options.repeat, || patterns.iter().position(|p| compact.query(p).is_some()));
+                    // the pattern of the font is only read back for the output
+                    let font = found.and_then(|i| compact.query_entry(&patterns[i]));
+                    let fonts = font.iter().map(|(p, f)| (p, f)).collect::<Vec<_>>();
+                    print_fonts(options, &fonts, match_line, if latencies_wanted { Some(&latencies) } else { None });
+                    return Ok(());
+                }
+            }
+
+            let (cache, _, _) = load_cache(options, false)?;
+
+            let (fonts, latencies) = if options.command == "sort" {
+                timed(options.repeat, || cache.query_all(&patterns[0]))
+            } else {
+                let (font, latencies) = timed(options.repeat, || patterns.iter().find_map(|p| cache.query_entry(p)));
+                (font.into_iter().collect(), latencies)
+            };
+
+            print_fonts(options, &fonts, match_line, if latencies_wanted { Some(&latencies) } else { None });
+        },
+        "explain" => {
+            let pattern = match patterns.as_slice() {
+                [pattern] => pattern,
+                _ => return Err(String::from("explain expects one pattern")),
+            };
+            let (cache, _, _) = load_cache(options, false)?;
+            print_explanation(options, &cache.explain(pattern));
+        },
+        "stats" => {
+            let (cache, build_time, report) = load_cache(options, true)?;
+            print_stats(options, &cache, build_time, report.as_ref());
+        },
+        other => return Err(format!("unknown command {:?}", other)),
+    }
+
+    Ok(())
+}
+
+fn print_explanation(options: &Options, explanation: &FcQueryExplanation) {
+
+    if !options.json {
+        print!("{}", explanation);
+        return;
+    }
+
+    let stages = explanation.stages.iter().map(|s| format!(
+        "{{\"stage\":\"{:?}\",\"candidates\":{},\"ns\":{}}}", s.stage, s.candidates, s.time.as_nanos()
+    )).collect::<Vec<_>>();
+
+    let candidates = explanation.candidates.iter().map(|c| format!(
+        "{{\"font\":{},\"rejected\":{}}}",
+        json_font(c.pattern, c.font),
+        c.rejected.map(|r| format!("\"{:?}\"", r)).unwrap_or_else(|| String::from("null")),
+    )).collect::<Vec<_>>();
+
+    println!(
+        "{{\"stages\":[{}],\"candidates\":[{}],\"result\":{}}}",
+        stages.join(","),
+        candidates.join(","),
+        explanation.result.map(|f| format!("{{\"path\":{},\"index\":{}}}", json_string(&f.path), f.font_index)).unwrap_or_else(|| String::from("null")),
+    );
+}
+
+fn print_stats(options: &Options, cache: &FcFontCache, build_time: Duration, report: Option<&FcBuildReport>) {
+
+    let families = cache.list().keys().filter_map(|p| p.family.clone()).collect::<BTreeSet<_>>();
+    let memory = cache.memory_usage();
+
+    // one regular lookup per family
+    let mut latencies = families.iter().map(|family| {
+        let pattern = FcPattern { family: Some(family.clone()), .. Default::default() };
+        let start = Instant::now();
+        let _ = cache.query(&pattern);
+        start.elapsed()
+    }).collect::<Vec<_>>();
+    latencies.sort();
+
+    if options.json {
+        let build = match report {
+            Some(r) => format!(
+                ",\"config_parsing_ns\":{},\"directory_walking_ns\":{},\"file_parsing_ns\":{},\"merging_ns\":{},\"indexing_ns\":{},\
+                 \"directories\":{},\"files\":{},\"rejected_files\":{},\"parse_failures\":{},\"bytes_mapped\":{},\"slowest_files\":[{}]",
+                r.config_parsing.as_nanos(), r.directory_walking.as_nanos(), r.file_parsing.as_nanos(),
+                r.merging.as_nanos(), r.indexing.as_nanos(),
+                r.directories, r.files, r.rejected_files, r.parse_failures, r.bytes_mapped,
+                r.slowest_files.iter().map(|(p, d)| format!(
+                    "{{\"path\":{},\"ns\":{}}}", json_string(&p.to_string_lossy()), d.as_nanos()
+                )).collect::<Vec<_>>().join(","),
+            ),
+            None => String::new(),
+        };
+        println!(
+            "{{\"fonts\":{},\"families\":{},\"threads\":{},\"build\":{{\"total_ns\":{}{}}},\
+             \"memory\":{{\"total\":{},\"strings\":{},\"faces\":{},\"map_nodes\":{},\"name_index\":{},\"family_index\":{}}},\
+             \"latency\":{}}}",
+            cache.list().len(), families.len(), rayon::current_num_threads(), build_time.as_nanos(), build,
+            memory.total(), memory.strings, memory.faces, memory.map_nodes, memory.name_index, memory.family_index,
+            json_latencies(&latencies),
+        );
+        return;
+    }
+
+    println!("fonts:     {}", cache.list().len());
+    println!("families:  {}", families.len());
+    println!("threads:   {}", rayon::current_num_threads());
+    println!("build:     {:?}{}", build_time, if report.is_none() && options.cache_file.is_some() { " (loaded from cache file)" } else { "" });
+
+    if let Some(r) = report {
+        println!("  config parsing:    {:?}", r.config_parsing);
+        println!("  directory walking: {:?} ({} directories, {} files)", r.directory_walking, r.directories, r.files);
+        println!("  file parsing:      {:?} ({} not fonts, {} failed, {} bytes mapped)", r.file_parsing, r.rejected_files, r.parse_failures, r.bytes_mapped);
+        println!("  merging:           {:?}", r.merging);
+        println!("  indexing:          {:?}", r.indexing);
+        for (path, time) in r.slowest_files.iter() {
+            println!("    {:>12?}  {}", time, path.display());
+        }
+    }
+
+    println!("memory:    {} bytes", memory.total());
+    println!("  strings: {}, faces: {}, map nodes: {}, name index: {}, family index: {}",
+        memory.strings, memory.faces, memory.map_nodes, memory.name_index, memory.family_index);
+    print!("family lookups, ");
+    print_latencies(&latencies);
+}
+
+fn main() {
+
+    let options = match parse_args() {
+        Ok(o) => o,
+        Err(e) => {
+            if !e.is_empty() {
+                eprintln!("{}", e);
+            }
+            eprintln!("{}", USAGE);
+            process::exit(2);
+        },
+    };
+
+    if let Some(threads) = options.threads {
+        if let Err(e) = rayon::ThreadPoolBuilder::new().num_threads(threads).build_global() {
+            eprintln!("could not set up {} threads: {}", threads, e);
+            process::exit(2);
+        }
+    }
+
+    if let Err(e) = run(&options) {
+        eprintln!("{}", e);
+        process::exit(1);
+    }
+}
@@ -0,0 +1,230 @@
+//! Changes between two caches, for invalidating caches that are keyed by
+//! font (glyph atlases, shaping caches, ...)
+//!
+//! Every face gets a fingerprint (`FcFaceFingerprint`) that only depends
+//! on its properties, file, index and file stamp, so it is the same in
+//! every cache, process and run - and changes when a font file is
+//! replaced in place. `FcFontCache::diff()` returns the faces that were
+//! added or removed between two caches, `FcFontCache::subscribe_global()`
+//! reports them for every rebuild of the process-wide cache.
+//!
+//! ```rust,no_run
+//! use rust_fontconfig::FcFontCache;
+//!
+//! let old = FcFontCache::build();
+//! let new = FcFontCache::build();
+//! for face in old.diff(&new).removed {
+//!     println!("evict {:016x} ({})", face.fingerprint, face.font.path);
+//! }
+//! ```
+
+use alloc::vec::Vec;
+use core::cmp::Ordering;
+use crate::{FcFontCache, FcFontPath, FcPattern, FcHashBytes, FNV_OFFSET};
+
+/// Stable fingerprint of a face, derived from all properties of the
+/// pattern, the file path, the font index and the size and modification
+/// time of the file (64-bit FNV-1a)
+pub fn FcFaceFingerprint(pattern: &FcPattern, font: &FcFontPath) -> u64 {
+    let mut hash = FNV_OFFSET;
+    // strings are prefixed with their length, so that fields can't run
+    // into each other, None and Some("") differ
+    for s in [&pattern.name, &pattern.family].iter() {
+        hash = match s.as_deref() {
+            Some(s) => FcHashBytes(FcHashBytes(hash, &(s.len() as u64).to_le_bytes()), s.as_bytes()),
+            None => FcHashBytes(hash, &u64::MAX.to_le_bytes()),
+        };
+    }
+    hash = FcHashBytes(hash, &(font.path.len() as u64).to_le_bytes());
+    hash = FcHashBytes(hash, font.path.as_bytes());
+    for n in [font.font_index, pattern.weight, pattern.unicode_range[0], pattern.unicode_range[1]].iter() {
+        hash = FcHashBytes(hash, &(*n as u64).to_le_bytes());
+    }
+    hash = FcHashBytes(hash, &font.stamp.size.to_le_bytes());
+    hash = FcHashBytes(hash, &font.stamp.modified.to_le_bytes());
+    FcHashBytes(hash, &pattern.style_bits().to_le_bytes())
+}
+
+/// Face that was added or removed, see `FcCacheDiff`
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct FcFace {
+    /// `FcFaceFingerprint(&pattern, &font)`
+    pub fingerprint: u64,
+    pub pattern: FcPattern,
+    pub font: FcFontPath,
+}
+
+impl FcFace {
+    fn new(pattern: &FcPattern, font: &FcFontPath) -> Self {
+        FcFace {
+            fingerprint: FcFaceFingerprint(pattern, font),
+            pattern: pattern.clone(),
+            font: font.clone(),
+        }
+    }
+}
+
+/// Result of `FcFontCache::diff()`
+#[derive(Debug, Default, Clone, PartialEq, Eq)]
+pub struct FcCacheDiff {
+    /// `generation()` of the old cache
+    pub from_generation: u64,
+    /// `generation()` of the new cache
+    pub to_generation: u64,
+    /// Faces of the new cache that aren't in the old one, in cache order
+    pub added: Vec<FcFace>,
+    /// Faces of the old cache that aren't in the new one, in cache order
+    pub removed: Vec<FcFace>,
+}
+
+impl FcCacheDiff {
+    /// Whether both caches contain the same faces
+    pub fn is_empty(&self) -> bool {
+        self.added.is_empty() && self.removed.is_empty()
+    }
+}
+
+impl FcFontCache {
+
+    /// Returns the faces that were added and removed from this cache to
+    /// `newer`
+    ///
+    /// A face whose file changed (path, index, size or modification time)
+    /// counts as removed and added. Takes O(n + m), both caches are already
+    /// sorted.
+    pub fn diff(&self, newer: &FcFontCache) -> FcCacheDiff {
+
+        let mut diff = FcCacheDiff {
+            from_generation: self.generation(),
+            to_generation: newer.generation(),
+            added: Vec::new(),
+            removed: Vec::new(),
+        };
+
+        // same generation = clones of the same cache
+        if diff.from_generation == diff.to_generation {
+            return diff;
+        }
+
+        let mut old = self.map.iter().peekable();
+        let mut new = newer.map.iter().peekable();
+
+        loop {
+            let order = match (old.peek(), new.peek()) {
+                (Some(o), Some(n)) => o.0.cmp(n.0),
+                (Some(_), None) => Ordering::Less,
+                (None, Some(_)) => Ordering::Greater,
+                (None, None) => break,
+            };
+            match order {
+                Ordering::Less => {
+                    let (pattern, font) = old.next().unwrap();
+                    diff.removed.push(FcFace::new(pattern, font));
+                },
+                Ordering::Greater => {
+                    let (pattern, font) = new.next().unwrap();
+                    diff.added.push(FcFace::new(pattern, font));
+                },
+                Ordering::Equal => {
+                    let (old_pattern, old_font) = old.next().unwrap();
+                    let (new_pattern, new_font) = new.next().unwrap();
+                    if old_font != new_font {
+                        diff.removed.push(FcFace::new(old_pattern, old_font));
+                        diff.added.push(FcFace::new(new_pattern, new_font));
+                    }
+                },
+            }
+        }
+
+        diff
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::{FcFileStamp, PatternMatch};
+    use alloc::{format, vec};
+    use alloc::string::String;
+
+    fn font(i: usize, modified: u64) -> (FcPattern, FcFontPath) {
+        (FcPattern {
+            name: Some(format!("Font {}", i)),
+            family: Some(String::from("Family")),
+            italic: if i % 2 == 0 { PatternMatch::True } else { PatternMatch::False },
+            .. Default::default()
+        }, FcFontPath {
+            path: format!("/fonts/{}.ttf", i),
+            font_index: 0,
+            stamp: FcFileStamp { size: 1000, modified },
+        })
+    }
+
+    fn cache(fonts: &[(usize, u64)]) -> FcFontCache {
+        fonts.iter().map(|(i, modified)| font(*i, *modified)).collect()
+    }
+
+    fn fingerprints(faces: &[FcFace]) -> Vec<u64> {
+        faces.iter().map(|f| f.fingerprint).collect()
+    }
+
+    fn fingerprint(i: usize, modified: u64) -> u64 {
+        let (pattern, font) = font(i, modified);
+        FcFaceFingerprint(&pattern, &font)
+    }
+
+    #[test]
+    fn added_and_removed() {
+
+        let old = cache(&[(1, 1), (2, 1), (3, 1), (5, 1)]);
+        let new = cache(&[(0, 1), (2, 1), (3, 1), (4, 1), (6, 1)]);
+
+        let diff = old.diff(&new);
+        assert_eq!(diff.from_generation, old.generation());
+        assert_eq!(diff.to_generation, new.generation());
+        assert_eq!(fingerprints(&diff.added), vec![fingerprint(0, 1), fingerprint(4, 1), fingerprint(6, 1)]);
+        assert_eq!(fingerprints(&diff.removed), vec![fingerprint(1, 1), fingerprint(5, 1)]);
+        assert_eq!(diff.added[0].pattern, font(0, 1).0);
+        assert_eq!(diff.removed[1].font, font(5, 1).1);
+
+        // the other way round
+        let back = new.diff(&old);
+        assert_eq!(back.added, diff.removed);
+        assert_eq!(back.removed, diff.added);
+    }
+
+    #[test]
+    fn unchanged_caches() {
+        let old = cache(&[(1, 1), (2, 1)]);
+        assert!(old.diff(&old.clone()).is_empty());
+        assert!(old.diff(&cache(&[(1, 1), (2, 1)])).is_empty());
+        assert!(FcFontCache::default().diff(&FcFontCache::default()).is_empty());
+    }
+
+    #[test]
+    fn files_replaced_in_place() {
+
+        // same pattern and path, newer file
+        let old = cache(&[(1, 1), (2, 1)]);
+        let new = cache(&[(1, 1), (2, 2)]);
+        assert_ne!(fingerprint(2, 1), fingerprint(2, 2));
+
+        let diff = old.diff(&new);
+        assert_eq!(fingerprints(&diff.removed), vec![fingerprint(2, 1)]);
+        assert_eq!(fingerprints(&diff.added), vec![fingerprint(2, 2)]);
+    }
+
+    #[test]
+    fn fingerprints_are_stable() {
+        let (pattern, font) = font(7, 1);
+        assert_eq!(FcFaceFingerprint(&pattern, &font), FcFaceFingerprint(&pattern.clone(), &font.clone()));
+        // fields can't run into each other
+        let a = FcPattern { name: Some(String::from("ab")), family: Some(String::from("c")), .. Default::default() };
+        let b = FcPattern { name: Some(String::from("a")), family: Some(String::from("bc")), .. Default::default() };
+        let c = FcPattern { name: None, family: Some(String::from("")), .. Default::default() };
+        let d = FcPattern { name: Some(String::from("")), family: None, .. Default::default() };
+        assert_ne!(FcFaceFingerprint(&a, &font), FcFaceFingerprint(&b, &font));
+        assert_ne!(FcFaceFingerprint(&c, &font), FcFaceFingerprint(&d, &font));
+    }
+}
@@ -0,0 +1,553 @@
+//! Compact, memory-budgeted font cache for constrained devices
+//!
+//! `FcCompactCache` only keeps 24 bytes per font in memory (hashes of the
+//! name and family, the style bits and a file offset) plus two 4-byte
+//! lookup tables. Names, families and paths stay in a memory-mapped side
+//! file, written by `FcCompactCache::write()`, and are only read to confirm
+//! a hash match - so the OS can page them out at any time.
+//!
+//! ```rust,no_run
+//! use rust_fontconfig::{FcCompactCache, FcFontCache, FcPattern};
+//!
+//! FcCompactCache::write(&FcFontCache::build(), "fonts.rfcc").unwrap();
+//!
+//! let cache = FcCompactCache::open("fonts.rfcc").unwrap();
+//! let font = cache.query(&FcPattern {
+//!     name: Some(String::from("Arial")),
+//!     .. Default::default()
+//! });
+//! ```
+//!
+//! File format (all integers little-endian): the magic bytes `RFCC`, a `u32`
+//! version, a `u64` font count, then one record per font, sorted in the same
+//! order as `FcFontCache::list()`. A record is: `u16` style bits, `u32`
+//! weight, `u32` unicode range start and end, `u32` font index, `u64` file
+//! size and modification time (see `FcFileStamp`), then name,
+//! family and path as `u32` length (+ 1 for name and family, `0` = `None`)
+//! followed by UTF-8 bytes. The file ends with a trailer: the `u64` font
+//! count again, a `u64` FNV-1a hash of all records and the bytes `CCFR`.
+//!
+//! The trailer is written last, files without it (or with a different
+//! count or hash) are rejected, so a partially written file never opens as
+//! a valid, smaller cache. Files are also written to a temporary file next
+//! to the target and renamed when complete, so readers never see one.
+
+use crate::{FcFileStamp, FcFontCache, FcFontPath, FcHashBytes, FcHashStr, FcPattern, FNV_OFFSET};
+use mmapio::{Mmap, MmapOptions};
+use std::ffi::OsString;
+use std::fs::File;
+use std::io::{self, BufWriter, Write};
+use std::mem;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+const MAGIC: &[u8;4] = b"RFCC";
+const END_MAGIC: &[u8;4] = b"CCFR";
+const VERSION: u32 = 3;
+pub(crate) const HEADER_LEN: usize = 16;
+pub(crate) const TRAILER_LEN: usize = 20;
+// of a record, before name, family and path
+pub(crate) const FIXED_RECORD_LEN: usize = 34;
+
+/// Borrowed `FcFontPath`, pointing into the side file of a `FcCompactCache`
+#[derive(Debug, Copy, Clone, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub struct FcFontPathRef<'a> {
+    pub path: &'a str,
+    pub font_index: usize,
+    pub stamp: FcFileStamp,
+}
+
+impl<'a> FcFontPathRef<'a> {
+    pub fn to_owned(&self) -> FcFontPath {
+        FcFontPath { path: self.path.to_string(), font_index: self.font_index, stamp: self.stamp }
+    }
+}
+
+// resident part of a font: 24 bytes
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+struct FcCompactFace {
+    name_hash: u64,
+    family_hash: u64,
+    record_offset: u32,
+    style_bits: u16,
+}
+
+/// Font cache that keeps only hashes in memory, see the module documentation
+#[derive(Debug)]
+pub struct FcCompactCache {
+    file: Mmap,
+    // in the order of the records
+    faces: Vec<FcCompactFace>,
+    // indices into `faces`, sorted by (hash, index)
+    by_name: Vec<u32>,
+    by_family: Vec<u32>,
+}
+
+// hash of a missing name / family
+const NONE_HASH: u64 = 0;
+
+fn FcHashOption(s: Option<&str>) -> u64 {
+    s.map(FcHashStr).unwrap_or(NONE_HASH)
+}
+
+impl FcCompactCache {
+
+    /// Writes the side file for the fonts of `cache` to `path`
+    ///
+    /// The file is written to a temporary file next to `path` first and
+    /// renamed when complete, so it can replace a file that other processes
+    /// are reading.
+    pub fn write<P: AsRef<Path>>(cache: &FcFontCache, path: P) -> io::Result<()> {
+        let mut w = FcCompactWriter::create(path.as_ref())?;
+        for (pattern, font) in cache.list().iter() {
+            w.push(pattern, font)?;
+        }
+        w.finish()
+    }
+
+    /// Memory-maps a side file written by `write()` and builds the in-memory tables
+    pub fn open<P: AsRef<Path>>(path: P) -> io::Result<Self> {
+
+        let file = File::open(path)?;
+        let file = unsafe { MmapOptions::new().map(&file)? };
+
+        let count = FcReadHeader(&file)?;
+
+        if file.len() > u32::MAX as usize {
+            return Err(InvalidData("compact cache files are limited to 4 GB"));
+        }
+
+        // rejects files that were not written completely
+        let records_end = file.len().checked_sub(TRAILER_LEN).filter(|e| *e >= HEADER_LEN).ok_or_else(|| InvalidData("incomplete compact cache"))?;
+        FcCheckTrailer(&file[records_end..], count, FcHashBytes(FNV_OFFSET, &file[HEADER_LEN..records_end]))?;
+        let records = &file[..records_end];
+
+        let mut faces = Vec::with_capacity((count as usize).min(records.len() / 4));
+        let mut offset = HEADER_LEN;
+
+        for _ in 0..count {
+            let record = FcCompactRecord::read(records, offset).ok_or_else(|| InvalidData("truncated compact cache"))?;
+            faces.push(FcCompactFace {
+                name_hash: FcHashOption(record.name),
+                family_hash: FcHashOption(record.family),
+                record_offset: offset as u32,
+                style_bits: record.style_bits,
+            });
+            offset = record.end;
+        }
+
+        if offset != records.len() {
+            return Err(InvalidData("compact cache has data after the last record"));
+        }
+
+        let sorted_by = |key: fn(&FcCompactFace) -> u64| {
+            let mut v = (0..faces.len() as u32).collect::<Vec<_>>();
+            v.sort_by_key(|i| (key(&faces[*i as usize]), *i));
+            v
+        };
+
+        let by_name = sorted_by(|f| f.name_hash);
+        let by_family = sorted_by(|f| f.family_hash);
+
+        Ok(FcCompactCache { file, faces, by_name, by_family })
+    }
+
+    /// Number of fonts in the cache
+    pub fn len(&self) -> usize {
+        self.faces.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.faces.is_empty()
+    }
+
+    /// Bytes kept in memory (not counting the memory-mapped side file)
+    pub fn resident_bytes(&self) -> usize {
+        self.faces.capacity() * mem::size_of::<FcCompactFace>() +
+        (self.by_name.capacity() + self.by_family.capacity()) * mem::size_of::<u32>()
+    }
+
+    /// Same as `FcFontCache::query`, returns the same font
+    ///
+    /// Names and families are compared by hash first and only read from the
+    /// side file to confirm a match. Does not allocate.
+    pub fn query(&self, pattern: &FcPattern) -> Option<FcFontPathRef<'_>> {
+        self.query_record(pattern).map(|r| FcFontPathRef { path: r.path, font_index: r.font_index as usize, stamp: r.stamp })
+    }
+
+    /// Same as `FcFontCache::query_entry`: `query()` plus the pattern of the
+    /// font, read back from the side file (allocates)
+    pub fn query_entry(&self, pattern: &FcPattern) -> Option<(FcPattern, FcFontPath)> {
+        self.query_record(pattern).map(|r| r.to_owned())
+    }
+
+    fn query_record(&self, pattern: &FcPattern) -> Option<FcCompactRecord<'_>> {
+
+        let name_hash = pattern.name.as_deref().map(FcHashStr);
+        let family_hash = pattern.family.as_deref().map(FcHashStr);
+        let style_bits_ok = |face: &FcCompactFace| pattern.style_matches(face.style_bits);
+
+        let matches = |face: &FcCompactFace| {
+            if name_hash.map(|h| h != face.name_hash).unwrap_or(false) ||
+               family_hash.map(|h| h != face.family_hash).unwrap_or(false) ||
+               !style_bits_ok(face) {
+                return None;
+            }
+            // confirm the hash match
+            let record = FcCompactRecord::read(&self.file, face.record_offset as usize)?;
+            if pattern.name.is_some() && record.name != pattern.name.as_deref() {
+                return None;
+            }
+            if pattern.family.is_some() && record.family != pattern.family.as_deref() {
+                return None;
+            }
+            Some(record)
+        };
+
+        match (name_hash, family_hash) {
+            (Some(h), _) => self.probe(&self.by_name, h, |f| f.name_hash).find_map(|f| matches(f)),
+            (None, Some(h)) => self.probe(&self.by_family, h, |f| f.family_hash).find_map(|f| matches(f)),
+            (None, None) => self.faces.iter().find_map(|f| matches(f)),
+        }
+    }
+
+    // all faces with the given hash, in cache order
+    fn probe<'a>(&'a self, table: &'a [u32], hash: u64, key: fn(&FcCompactFace) -> u64) -> impl Iterator<Item = &'a FcCompactFace> + 'a {
+        let start = table.partition_point(|i| key(&self.faces[*i as usize]) < hash);
+        table[start..]
+            .iter()
+            .map(move |i| &self.faces[*i as usize])
+            .take_while(move |f| key(f) == hash)
+    }
+
+    /// Reads all fonts back into a regular `FcFontCache`
+    pub fn to_cache(&self) -> FcFontCache {
+        self.faces.iter().filter_map(|face| {
+            FcCompactRecord::read(&self.file, face.record_offset as usize).map(|r| r.to_owned())
+        }).collect()
+    }
+}
+
+// Writes a side file record by record - also used by the streaming build
+//
+// Writes to a temporary file that `finish()` renames to the target path,
+// and that is deleted if the writer is dropped before.
+pub(crate) struct FcCompactWriter {
+    // None after `finish()`
+    out: Option<BufWriter<File>>,
+    path: PathBuf,
+    tmp: PathBuf,
+    count: u64,
+    bytes: u64,
+    // of all records
+    hash: u64,
+}
+
+impl FcCompactWriter {
+
+    pub(crate) fn create(path: &Path) -> io::Result<Self> {
+        // unique per process and writer, several may write the same target
+        static NEXT_TMP: AtomicUsize = AtomicUsize::new(0);
+        let mut tmp = OsString::from(path.as_os_str());
+        tmp.push(format!(".{}-{}.tmp", std::process::id(), NEXT_TMP.fetch_add(1, Ordering::Relaxed)));
+        let tmp = PathBuf::from(tmp);
+
+        let mut out = BufWriter::new(File::create(&tmp)?);
+        let mut writer = FcCompactWriter { out: None, path: path.to_path_buf(), tmp, count: 0, bytes: HEADER_LEN as u64, hash: FNV_OFFSET };
+        out.write_all(MAGIC)?;
+        out.write_all(&VERSION.to_le_bytes())?;
+        out.write_all(&0_u64.to_le_bytes())?; // font count, see finish()
+        writer.out = Some(out);
+        Ok(writer)
+    }
+
+    /// Appends a font - fonts have to be pushed in `FcPattern` order
+    pub(crate) fn push(&mut self, pattern: &FcPattern, font: &FcFontPath) -> io::Result<()> {
+
+        let mut record = Vec::with_capacity(64);
+        record.extend_from_slice(&pattern.style_bits().to_le_bytes());
+        record.extend_from_slice(&(pattern.weight.min(u32::MAX as usize) as u32).to_le_bytes());
+        record.extend_from_slice(&(pattern.unicode_range[0].min(u32::MAX as usize) as u32).to_le_bytes());
+        record.extend_from_slice(&(pattern.unicode_range[1].min(u32::MAX as usize) as u32).to_le_bytes());
+        record.extend_from_slice(&(font.font_index.min(u32::MAX as usize) as u32).to_le_bytes());
+        record.extend_from_slice(&font.stamp.size.to_le_bytes());
+        record.extend_from_slice(&font.stamp.modified.to_le_bytes());
+        WriteOptionalString(&mut record, pattern.name.as_deref());
+        WriteOptionalString(&mut record, pattern.family.as_deref());
+        record.extend_from_slice(&(font.path.len() as u32).to_le_bytes());
+        record.extend_from_slice(font.path.as_bytes());
+
+        self.bytes += record.len() as u64;
+        if self.bytes > u32::MAX as u64 {
+            return Err(InvalidData("compact cache files are limited to 4 GB"));
+        }
+
+        self.count += 1;
+        self.hash = FcHashBytes(self.hash, &record);
+        self.out.as_mut().ok_or_else(|| InvalidData("compact cache already finished"))?.write_all(&record)
+    }
+
+    /// Writes the trailer and renames the file to its target path
+    pub(crate) fn finish(mut self) -> io::Result<()> {
+        use std::io::{Seek, SeekFrom};
+        let mut out = self.out.take().ok_or_else(|| InvalidData("compact cache already finished"))?;
+        out.write_all(&self.count.to_le_bytes())?;
+        out.write_all(&self.hash.to_le_bytes())?;
+        out.write_all(END_MAGIC)?;
+        let mut file = out.into_inner().map_err(|e| e.into_error())?;
+        file.seek(SeekFrom::Start(8))?;
+        file.write_all(&self.count.to_le_bytes())?;
+        file.sync_all()?;
+        std::fs::rename(&self.tmp, &self.path)?;
+        // nothing left to delete
+        self.tmp = PathBuf::new();
+        Ok(())
+    }
+}
+
+impl Drop for FcCompactWriter {
+    fn drop(&mut self) {
+        if !self.tmp.as_os_str().is_empty() {
+            self.out = None;
+            let _ = std::fs::remove_file(&self.tmp);
+        }
+    }
+}
+
+// Record in the side file, borrowing its strings
+pub(crate) struct FcCompactRecord<'a> {
+    pub(crate) style_bits: u16,
+    pub(crate) weight: u32,
+    pub(crate) unicode_range: [u32;2],
+    pub(crate) font_index: u32,
+    pub(crate) stamp: FcFileStamp,
+    pub(crate) name: Option<&'a str>,
+    pub(crate) family: Option<&'a str>,
+    pub(crate) path: &'a str,
+    // offset of the next record
+    pub(crate) end: usize,
+}
+
+impl<'a> FcCompactRecord<'a> {
+
+    pub(crate) fn read(file: &'a [u8], offset: usize) -> Option<Self> {
+        let style_bits = u16::from_le_bytes([*file.get(offset)?, *file.get(offset + 1)?]);
+        let weight = ReadU32(file, offset + 2)?;
+        let range_start = ReadU32(file, offset + 6)?;
+        let range_end = ReadU32(file, offset + 10)?;
+        let font_index = ReadU32(file, offset + 14)?;
+        let stamp = FcFileStamp { size: ReadU64(file, offset + 18)?, modified: ReadU64(file, offset + 26)? };
+        let (name, offset) = ReadOptionalString(file, offset + FIXED_RECORD_LEN)?;
+        let (family, offset) = ReadOptionalString(file, offset)?;
+        let path_len = ReadU32(file, offset)? as usize;
+        let path = core::str::from_utf8(file.get(offset + 4..offset + 4 + path_len)?).ok()?;
+        Some(FcCompactRecord {
+            style_bits,
+            weight,
+            unicode_range: [range_start, range_end],
+            font_index,
+            stamp,
+            name,
+            family,
+            path,
+            end: offset + 4 + path_len,
+        })
+    }
+
+    pub(crate) fn to_owned(&self) -> (FcPattern, FcFontPath) {
+        let mut pattern = FcPattern {
+            name: self.name.map(|s| s.to_string()),
+            family: self.family.map(|s| s.to_string()),
+            weight: self.weight as usize,
+            unicode_range: [self.unicode_range[0] as usize, self.unicode_range[1] as usize],
+            .. Default::default()
+        };
+        pattern.set_style_bits(self.style_bits);
+        (pattern, FcFontPath { path: self.path.to_string(), font_index: self.font_index as usize, stamp: self.stamp })
+    }
+}
+
+/// Checks the magic bytes and version, returns the number of fonts
+pub(crate) fn FcReadHeader(file: &[u8]) -> io::Result<u64> {
+    if file.len() < HEADER_LEN || &file[..4] != MAGIC || ReadU32(file, 4) != Some(VERSION) {
+        return Err(InvalidData("not a rust-fontconfig compact cache"));
+    }
+    Ok(ReadU64(file, 8).unwrap_or(0))
+}
+
+/// Checks the trailer against the font count of the header and the hash
+/// of all records
+pub(crate) fn FcCheckTrailer(trailer: &[u8], count: u64, hash: u64) -> io::Result<()> {
+    if trailer.len() != TRAILER_LEN || &trailer[16..] != END_MAGIC {
+        return Err(InvalidData("incomplete compact cache"));
+    }
+    if ReadU64(trailer, 0) != Some(count) || ReadU64(trailer, 8) != Some(hash) {
+        return Err(InvalidData("corrupt compact cache"));
+    }
+    Ok(())
+}
+
+fn WriteOptionalString(out: &mut Vec<u8>, s: Option<&str>) {
+    match s {
+        None => out.extend_from_slice(&0_u32.to_le_bytes()),
+        Some(s) => {
+            out.extend_from_slice(&(s.len() as u32 + 1).to_le_bytes());
+            out.extend_from_slice(s.as_bytes());
+        },
+    }
+}
+
+fn ReadOptionalString(file: &[u8], offset: usize) -> Option<(Option<&str>, usize)> {
+    let len = ReadU32(file, offset)? as usize;
+    if len == 0 {
+        return Some((None, offset + 4));
+    }
+    let s = core::str::from_utf8(file.get(offset + 4..offset + 3 + len)?).ok()?;
+    Some((Some(s), offset + 3 + len))
+}
+
+pub(crate) fn ReadU32(file: &[u8], offset: usize) -> Option<u32> {
+    let b = file.get(offset..offset + 4)?;
+    Some(u32::from_le_bytes([b[0], b[1], b[2], b[3]]))
+}
+
+fn ReadU64(file: &[u8], offset: usize) -> Option<u64> {
+    let b = file.get(offset..offset + 8)?;
+    let mut bytes = [0;8];
+    bytes.copy_from_slice(b);
+    Some(u64::from_le_bytes(bytes))
+}
+
+pub(crate) fn InvalidData(msg: &'static str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::PatternMatch;
+
+    fn cache() -> FcFontCache {
+        (0..50).map(|i| (FcPattern {
+            name: if i % 10 == 9 { None } else { Some(format!("Font {}", i)) },
+            family: Some(format!("Family {}", i % 7)),
+            bold: if i % 2 == 0 { PatternMatch::True } else { PatternMatch::False },
+            italic: if i % 3 == 0 { PatternMatch::True } else { PatternMatch::DontCare },
+            weight: i * 10,
+            unicode_range: [i, i * 100],
+            .. Default::default()
+        }, FcFontPath { path: format!("/fonts/{}.ttc", i / 2), font_index: i % 2, stamp: FcFileStamp { size: i as u64, modified: 1 << 40 } })).collect()
+    }
+
+    // empty directory, unique per test
+    fn test_dir(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("rust-fontconfig-compact-{}-{}", std::process::id(), name));
+        let _ = std::fs::remove_dir_all(&dir);
+        std::fs::create_dir_all(&dir).unwrap();
+        dir
+    }
+
+    fn files(dir: &Path) -> Vec<PathBuf> {
+        let mut files = std::fs::read_dir(dir).unwrap().map(|e| e.unwrap().path()).collect::<Vec<_>>();
+        files.sort();
+        files
+    }
+
+    #[test]
+    fn round_trip() {
+
+        let dir = test_dir("round_trip");
+        let path = dir.join("fonts.rfcc");
+        let cache = cache();
+
+        FcCompactCache::write(&cache, &path).unwrap();
+        // no temporary file is left behind
+        assert_eq!(files(&dir), vec![path.clone()]);
+
+        let compact = FcCompactCache::open(&path).unwrap();
+        assert_eq!(compact.len(), cache.list().len());
+        assert_eq!(compact.to_cache().list(), cache.list());
+
+        for pattern in [
+            FcPattern { name: Some(String::from("Font 12")), .. Default::default() },
+            FcPattern { family: Some(String::from("Family 3")), bold: PatternMatch::True, .. Default::default() },
+            FcPattern { family: Some(String::from("Family 3")), italic: PatternMatch::True, bold: PatternMatch::False, .. Default::default() },
+            FcPattern { italic: PatternMatch::True, .. Default::default() },
+            FcPattern { name: Some(String::from("Missing")), .. Default::default() },
+        ].iter() {
+            assert_eq!(compact.query(pattern).map(|f| f.to_owned()).as_ref(), cache.query(pattern), "{:?}", pattern);
+            let entry = compact.query_entry(pattern);
+            assert_eq!(entry.as_ref().map(|(p, f)| (p, f)), cache.query_entry(pattern), "{:?}", pattern);
+        }
+
+        // an empty cache is valid, too
+        FcCompactCache::write(&FcFontCache::default(), &path).unwrap();
+        assert!(FcCompactCache::open(&path).unwrap().is_empty());
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn partial_files_are_rejected() {
+
+        let dir = test_dir("partial");
+        let path = dir.join("fonts.rfcc");
+        FcCompactCache::write(&cache(), &path).unwrap();
+        let complete = std::fs::read(&path).unwrap();
+        let broken = dir.join("broken.rfcc");
+
+        // cut off anywhere, including right before and inside the trailer
+        let mut lengths = vec![0, 4, HEADER_LEN, HEADER_LEN + 1, complete.len() / 2];
+        lengths.extend((1..=TRAILER_LEN + 1).map(|n| complete.len() - n));
+        for len in lengths {
+            std::fs::write(&broken, &complete[..len]).unwrap();
+            assert!(FcCompactCache::open(&broken).is_err(), "{} of {} bytes", len, complete.len());
+        }
+
+        // a writer that stopped before patching the font count in the header
+        let mut no_count = complete.clone();
+        no_count[8..16].copy_from_slice(&0_u64.to_le_bytes());
+        std::fs::write(&broken, &no_count).unwrap();
+        assert!(FcCompactCache::open(&broken).is_err());
+
+        // a damaged record
+        let mut damaged = complete.clone();
+        damaged[HEADER_LEN + 20] ^= 0x20;
+        std::fs::write(&broken, &damaged).unwrap();
+        assert!(FcCompactCache::open(&broken).is_err());
+
+        // data after the trailer
+        let mut appended = complete.clone();
+        appended.extend_from_slice(&complete[HEADER_LEN..]);
+        std::fs::write(&broken, &appended).unwrap();
+        assert!(FcCompactCache::open(&broken).is_err());
+
+        std::fs::write(&broken, &complete).unwrap();
+        assert!(FcCompactCache::open(&broken).is_ok());
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn unfinished_writers_leave_nothing_behind() {
+
+        let dir = test_dir("unfinished");
+        let path = dir.join("fonts.rfcc");
+        FcCompactCache::write(&cache(), &path).unwrap();
+        let before = std::fs::read(&path).unwrap();
+
+        let mut writer = FcCompactWriter::create(&path).unwrap();
+        for (pattern, font) in cache().list().iter().take(10) {
+            writer.push(pattern, font).unwrap();
+        }
+        assert_eq!(files(&dir).len(), 2);
+        drop(writer);
+
+        // the previous file is untouched
+        assert_eq!(files(&dir), vec![path.clone()]);
+        assert_eq!(std::fs::read(&path).unwrap(), before);
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,293 @@
+//! Precompiled queries, see `FcFontCache::compile()`
+//!
+//! ```rust,no_run
+//! use rust_fontconfig::{FcFontCache, FcPattern};
+//!
+//! let cache = FcFontCache::build();
+//! let query = cache.compile(&FcPattern {
+//!     family: Some(String::from("DejaVu Sans")),
+//!     .. Default::default()
+//! });
+//!
+//! for _ in 0..1_000_000 {
+//!     let font = cache.query_compiled(&query);
+//! }
+//! ```
+
+use alloc::string::String;
+use crate::index::{FcCandidates, FcStringIndex};
+use crate::{FcFontCache, FcFontPath, FcPattern};
+
+/// Query plan for a single `FcPattern`, created by `FcFontCache::compile()`
+///
+/// Stores the ids of the name and family, the candidate list to probe and
+/// the bit mask for the style properties, so that running it does not
+/// compare strings or re-evaluate the pattern.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct FcCompiledQuery {
+    pattern: FcPattern,
+    generation: u64,
+    plan: FcQueryPlan,
+    // font matches if `style_bits & mask == value`, see `FcPattern::style_mask`
+    mask: u16,
+    value: u16,
+}
+
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+enum FcQueryPlan {
+    // no usable index, same as `query()`
+    Pattern,
+    // name or family does not exist in the cache
+    Empty,
+    // probe a candidate list of the name / family index, optionally also
+    // checking the id of the other string
+    ByName { list: u32, other_id: Option<u32> },
+    ByFamily { list: u32, other_id: Option<u32> },
+    // neither name nor family, probe the style bits of all fonts
+    Scan,
+}
+
+// how a name / family of the pattern can be resolved
+enum FcLookup {
+    NotNeeded,
+    Unavailable,
+    Missing,
+    Found(u32),
+}
+
+fn FcResolve(index: Option<&FcStringIndex>, s: Option<&String>) -> FcLookup {
+    match (s, index) {
+        (None, _) => FcLookup::NotNeeded,
+        (Some(_), None) => FcLookup::Unavailable,
+        (Some(s), Some(index)) => index.id(s).map(FcLookup::Found).unwrap_or(FcLookup::Missing),
+    }
+}
+
+impl FcCompiledQuery {
+
+    /// Pattern this query was compiled from
+    pub fn pattern(&self) -> &FcPattern {
+        &self.pattern
+    }
+
+    /// Generation of the cache this query was compiled for - on a cache with
+    /// a different generation, `query_compiled()` falls back to `query()`
+    pub fn generation(&self) -> u64 {
+        self.generation
+    }
+}
+
+impl FcFontCache {
+
+    /// Compiles the pattern into a plan that can be run many times with
+    /// `query_compiled()`, returning the same results as `query()`
+    ///
+    /// The plan stays valid for this cache and its clones as long as
+    /// `generation()` doesn't change.
+    pub fn compile(&self, pattern: &FcPattern) -> FcCompiledQuery {
+
+        let (mask, value) = pattern.style_mask();
+
+        let plan = match self.index.as_ref() {
+            None => FcQueryPlan::Pattern,
+            Some(index) => {
+                let by_name = index.by_name.as_ref();
+                let by_family = index.by_family.as_ref();
+                match (FcResolve(by_name, pattern.name.as_ref()), FcResolve(by_family, pattern.family.as_ref())) {
+                    (FcLookup::Unavailable, _) | (_, FcLookup::Unavailable) => FcQueryPlan::Pattern,
+                    (FcLookup::Missing, _) | (_, FcLookup::Missing) => FcQueryPlan::Empty,
+                    (FcLookup::NotNeeded, FcLookup::NotNeeded) => FcQueryPlan::Scan,
+                    (FcLookup::Found(name), FcLookup::NotNeeded) => FcQueryPlan::ByName { list: name, other_id: None },
+                    (FcLookup::NotNeeded, FcLookup::Found(family)) => FcQueryPlan::ByFamily { list: family, other_id: None },
+                    (FcLookup::Found(name), FcLookup::Found(family)) => {
+                        // probe the shorter list
+                        let names = by_name.map(|i| i.lists[name as usize].style_bits.len()).unwrap_or(0);
+                        let families = by_family.map(|i| i.lists[family as usize].style_bits.len()).unwrap_or(0);
+                        if names <= families {
+                            FcQueryPlan::ByName { list: name, other_id: Some(family) }
+                        } else {
+                            FcQueryPlan::ByFamily { list: family, other_id: Some(name) }
+                        }
+                    },
+                }
+            },
+        };
+
+        FcCompiledQuery {
+            pattern: pattern.clone(),
+            generation: self.generation,
+            plan,
+            mask,
+            value,
+        }
+    }
+
+    /// Runs a query created by `compile()`
+    ///
+    /// NOTE: Does not allocate, same as `query()`
+    pub fn query_compiled(&self, query: &FcCompiledQuery) -> Option<&FcFontPath> {
+
+        #[cfg(feature = "instrumentation")]
+        let start = std::time::Instant::now();
+
+        if query.generation != self.generation {
+            return self.query(&query.pattern);
+        }
+
+        let index = match (query.plan, self.index.as_ref()) {
+            (FcQueryPlan::Pattern, _) | (_, None) => return self.query(&query.pattern),
+            (FcQueryPlan::Empty, _) => return None,
+            (_, Some(index)) => index,
+        };
+
+        let (mask, value) = (query.mask, query.value);
+
+        let (result, candidates) = match query.plan {
+            FcQueryPlan::ByName { list, other_id } => {
+                let list = &index.by_name.as_ref()?.lists[list as usize];
+                (FcProbe(list, other_id, mask, value).map(|i| self.entries.get(list.positions[i] as usize).1), list.style_bits.len())
+            },
+            FcQueryPlan::ByFamily { list, other_id } => {
+                let list = &index.by_family.as_ref()?.lists[list as usize];
+                (FcProbe(list, other_id, mask, value).map(|i| self.entries.get(list.positions[i] as usize).1), list.style_bits.len())
+            },
+            // parallel for large caches, see `scan`
+            _ => {
+                let (position, visited) = self.scan_positions(|i| index.style_bits[i] & mask == value);
+                (position.map(|i| self.entries.get(i).1), visited)
+            },
+        };
+
+        #[cfg(feature = "instrumentation")] {
+            use crate::instrumentation::{FcQueryApi, FcQueryPath};
+            let path = if let FcQueryPlan::Scan = query.plan { FcQueryPath::Scan } else { FcQueryPath::Index };
+            crate::instrumentation::record(FcQueryApi::QueryCompiled, start, candidates, path, result.is_some());
+        }
+        #[cfg(not(feature = "instrumentation"))]
+        let _ = candidates;
+
+        result
+    }
+}
+
+// position of the first matching candidate
+#[inline]
+fn FcProbe(list: &FcCandidates, other_id: Option<u32>, mask: u16, value: u16) -> Option<usize> {
+    match other_id {
+        None => list.style_bits.iter().position(|b| b & mask == value),
+        Some(id) => {
+            list.style_bits
+            .iter()
+            .zip(list.other_ids.iter())
+            .position(|(b, other)| (b & mask == value) & (*other == id))
+        },
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::PatternMatch;
+    use alloc::format;
+    use alloc::vec::Vec;
+
+    // xorshift64, so that failures can be reproduced
+    struct Random(u64);
+
+    impl Random {
+        fn next(&mut self, n: usize) -> usize {
+            self.0 ^= self.0 << 13;
+            self.0 ^= self.0 >> 7;
+            self.0 ^= self.0 << 17;
+            (self.0 % n as u64) as usize
+        }
+
+        fn style(&mut self) -> PatternMatch {
+            [PatternMatch::True, PatternMatch::False, PatternMatch::DontCare][self.next(3)].clone()
+        }
+    }
+
+    fn cache(random: &mut Random) -> FcFontCache {
+        (0..400).map(|i| (FcPattern {
+            // some fonts without a name, names and families shared by several fonts
+            name: if i % 13 == 0 { None } else { Some(format!("Font {}", random.next(150))) },
+            family: Some(format!("Family {}", random.next(12))),
+            italic: random.style(),
+            oblique: random.style(),
+            bold: random.style(),
+            monospace: random.style(),
+            .. Default::default()
+        }, FcFontPath { path: format!("/fonts/{}.ttf", i), .. Default::default() })).collect()
+    }
+
+    // name + family, name only, family only, style only - names and
+    // families out of range don't exist in the cache
+    fn pattern(random: &mut Random) -> FcPattern {
+        let kind = random.next(4);
+        FcPattern {
+            name: if kind <= 1 { Some(format!("Font {}", random.next(170))) } else { None },
+            family: if kind == 0 || kind == 2 { Some(format!("Family {}", random.next(14))) } else { None },
+            italic: random.style(),
+            oblique: random.style(),
+            bold: random.style(),
+            monospace: random.style(),
+            .. Default::default()
+        }
+    }
+
+    // the original linear search of `query()`: for True the font has to
+    // be True, for False it must not be False
+    fn style_matches(pattern: &PatternMatch, font: &PatternMatch) -> bool {
+        match pattern {
+            PatternMatch::DontCare => true,
+            PatternMatch::True => font == pattern,
+            PatternMatch::False => font != pattern,
+        }
+    }
+
+    fn linear_query<'a>(cache: &'a FcFontCache, pattern: &FcPattern) -> Option<&'a FcFontPath> {
+        cache.list().iter().find(|(k, _)| {
+            (pattern.name.is_none() || k.name == pattern.name) &&
+            (pattern.family.is_none() || k.family == pattern.family) &&
+            style_matches(&pattern.italic, &k.italic) &&
+            style_matches(&pattern.oblique, &k.oblique) &&
+            style_matches(&pattern.bold, &k.bold) &&
+            style_matches(&pattern.monospace, &k.monospace)
+        }).map(|(_, v)| v)
+    }
+
+    #[test]
+    fn results_match_linear_search() {
+
+        let mut random = Random(0x2545_f491_4f6c_dd1d);
+        let mut cache = cache(&mut random);
+        let patterns = (0..3000).map(|_| pattern(&mut random)).collect::<Vec<_>>();
+        assert!(cache.has_index());
+
+        // with both indexes, only the name index, and without any index
+        let budgets = [None, Some(cache.memory_usage().total() - 1), Some(0)];
+        let compiled_with_index = patterns.iter().map(|p| cache.compile(p)).collect::<Vec<_>>();
+
+        for budget in budgets.iter() {
+
+            cache.set_memory_budget(*budget);
+            if *budget == Some(0) {
+                assert!(!cache.has_index());
+            }
+
+            let mut found = 0;
+            for (pattern, stale) in patterns.iter().zip(compiled_with_index.iter()) {
+                let expected = linear_query(&cache, pattern);
+                assert_eq!(cache.query(pattern), expected, "{:?}, budget {:?}", pattern, budget);
+                assert_eq!(cache.query_compiled(&cache.compile(pattern)), expected, "{:?}, budget {:?}", pattern, budget);
+                // compiled for another generation of the cache
+                assert_eq!(cache.query_compiled(stale), expected, "{:?}, budget {:?}", pattern, budget);
+                found += expected.is_some() as usize;
+            }
+
+            // the patterns cover hits and misses
+            assert!(found > patterns.len() / 10 && found < patterns.len() * 9 / 10, "{} of {} found", found, patterns.len());
+        }
+    }
+}
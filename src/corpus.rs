@@ -0,0 +1,653 @@
+//! Synthetic font corpus generator (only available with the `corpus` feature)
+//!
+//! Writes minimal, but structurally valid TrueType (`.ttf`) and TrueType
+//! collection (`.ttc`) files, so that scanning and querying can be
+//! benchmarked with 100k+ fonts on any machine, without network access.
+//! The fonts contain no outlines, only the tables needed to identify them
+//! (`head`, `name`, `OS/2`, `cmap`, ...). The same config and seed always
+//! produce the same files.
+//!
+//! See `examples/gencorpus.rs` for a command-line frontend.
+
+use std::fs;
+use std::io;
+use std::path::{Path, PathBuf};
+
+/// Settings for `FcGenerateCorpus()`
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct FcCorpusConfig {
+    /// Seed for all random choices
+    pub seed: u64,
+    /// Number of font families to generate
+    pub families: usize,
+    /// Maximum number of styles (weight / italic variants) per family
+    pub max_styles_per_family: usize,
+    /// Every n-th family is written as a single `.ttc` collection
+    /// instead of one `.ttf` per style (0 = never)
+    pub collection_every: usize,
+    /// Number of directory levels below the root directory
+    pub directory_depth: usize,
+    /// Number of subdirectories per directory level
+    pub directories_per_level: usize,
+    /// Maximum number of codepoints mapped in the `cmap`
+    pub max_coverage: usize,
+    /// Maximum number of padding bytes added to each font, to vary file sizes
+    pub max_padding: usize,
+}
+
+impl Default for FcCorpusConfig {
+    fn default() -> Self {
+        FcCorpusConfig {
+            seed: 0x5eed,
+            families: 1000,
+            max_styles_per_family: 4,
+            collection_every: 10,
+            directory_depth: 2,
+            directories_per_level: 8,
+            max_coverage: 512,
+            max_padding: 16 * 1024,
+        }
+    }
+}
+
+/// Description of a single synthetic font face
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct FcSyntheticFace {
+    pub family: String,
+    pub subfamily: String,
+    /// `OS/2.usWeightClass` (100 - 900)
+    pub weight: u16,
+    /// `OS/2.usWidthClass` (1 - 9, 5 = normal)
+    pub width: u16,
+    pub bold: bool,
+    pub italic: bool,
+    pub monospace: bool,
+    /// Inclusive codepoint ranges (BMP only) mapped in the `cmap`
+    pub coverage: Vec<(u16, u16)>,
+    /// Number of padding bytes in a private table
+    pub padding: usize,
+}
+
+impl FcSyntheticFace {
+    /// Full font name, as stored in name ID 4
+    pub fn full_name(&self) -> String {
+        format!("{} {}", self.family, self.subfamily)
+    }
+}
+
+/// Summary of the files written by `FcGenerateCorpus()`
+#[derive(Debug, Default, Clone, PartialEq, Eq)]
+pub struct FcCorpusSummary {
+    /// Directories in the corpus including the root, the same that
+    /// `FcFontCache::build_with_report()` walks
+    pub directories: usize,
+    pub files: usize,
+    /// Faces that `FcFontCache::build()` indexes - it only reads the
+    /// first face of a `.ttc`
+    pub faces: usize,
+    /// Faces after the first one of each `.ttc`, which are written but
+    /// not indexed
+    pub unindexed_faces: usize,
+    pub bytes: u64,
+}
+
+/// Writes a synthetic font corpus into `root`
+pub fn FcGenerateCorpus(root: &Path, config: &FcCorpusConfig) -> io::Result<FcCorpusSummary> {
+
+    let mut rng = FcRng::new(config.seed);
+    let mut summary = FcCorpusSummary::default();
+
+    fs::create_dir_all(root)?;
+    summary.directories = 1;
+
+    for family_id in 0..config.families {
+
+        let faces = FcSyntheticFamily(&mut rng, family_id, config);
+        let dir = FcCorpusDirectory(root, family_id, config);
+
+        if !dir.exists() {
+            // the leaf and all intermediate directories that are new
+            summary.directories += dir.ancestors().take_while(|d| *d != root && !d.exists()).count();
+            fs::create_dir_all(&dir)?;
+        }
+
+        let is_collection = config.collection_every != 0 && family_id % config.collection_every == 0;
+
+        if is_collection {
+            let bytes = FcSynthesizeCollection(&faces);
+            let file_name = format!("{}.ttc", faces[0].family.replace(' ', ""));
+            summary.bytes += bytes.len() as u64;
+            summary.files += 1;
+            fs::write(dir.join(file_name), bytes)?;
+        } else {
+            for face in faces.iter() {
+                let bytes = FcSynthesizeFont(face);
+                let file_name = format!("{}-{}.ttf", face.family.replace(' ', ""), face.subfamily.replace(' ', ""));
+                summary.bytes += bytes.len() as u64;
+                summary.files += 1;
+                fs::write(dir.join(file_name), bytes)?;
+            }
+        }
+
+        if is_collection {
+            summary.faces += 1;
+            summary.unindexed_faces += faces.len() - 1;
+        } else {
+            summary.faces += faces.len();
+        }
+    }
+
+    Ok(summary)
+}
+
+/// Returns the bytes of a single-face `.ttf` file
+pub fn FcSynthesizeFont(face: &FcSyntheticFace) -> Vec<u8> {
+    let mut font = FcWriteFonts(&[face], false);
+    let adjustment = 0xB1B0_AFBA_u32.wrapping_sub(FcTableChecksum(&font));
+    FcSetChecksumAdjustment(&mut font, 0, adjustment);
+    font
+}
+
+/// Returns the bytes of a `.ttc` collection containing all `faces`
+pub fn FcSynthesizeCollection(faces: &[FcSyntheticFace]) -> Vec<u8> {
+    let mut font = FcWriteFonts(&faces.iter().collect::<Vec<_>>(), true);
+    // each face gets the whole-font checksum it would have as a single
+    // font: its table directory plus the checksums of its tables
+    for i in 0..faces.len() {
+        let directory = FcReadU32(&font, 12 + 4 * i) as usize;
+        let num_tables = u16::from_be_bytes([font[directory + 4], font[directory + 5]]) as usize;
+        let directory_len = 12 + 16 * num_tables;
+        let checksum = (0..num_tables)
+            .map(|t| FcReadU32(&font, directory + 12 + 16 * t + 4))
+            .fold(FcTableChecksum(&font[directory..directory + directory_len]), u32::wrapping_add);
+        FcSetChecksumAdjustment(&mut font, directory, 0xB1B0_AFBA_u32.wrapping_sub(checksum));
+    }
+    font
+}
+
+// writes head.checkSumAdjustment of the font whose table directory
+// starts at `font_offset`
+fn FcSetChecksumAdjustment(font: &mut [u8], font_offset: usize, adjustment: u32) {
+    if let Some(head_offset) = FcFindTable(font, font_offset, *b"head") {
+        font[head_offset + 8..head_offset + 12].copy_from_slice(&adjustment.to_be_bytes());
+    }
+}
+
+fn FcReadU32(bytes: &[u8], offset: usize) -> u32 {
+    u32::from_be_bytes([bytes[offset], bytes[offset + 1], bytes[offset + 2], bytes[offset + 3]])
+}
+
+// --- face generation
+
+const SYLLABLES: [&str;16] = [
+    "ka", "lo", "mi", "ra", "sen", "tu", "vel", "no",
+    "dra", "phi", "qua", "zo", "bri", "ell", "on", "gar",
+];
+
+const CLASSIFICATIONS: [&str;6] = ["Sans", "Serif", "Mono", "Display", "Slab", "Script"];
+
+const STYLES: [(&str, u16, bool, bool);8] = [
+    ("Regular", 400, false, false),
+    ("Bold", 700, true, false),
+    ("Italic", 400, false, true),
+    ("Bold Italic", 700, true, true),
+    ("Light", 300, false, false),
+    ("Medium", 500, false, false),
+    ("Black", 900, true, false),
+    ("Thin", 100, false, false),
+];
+
+// Unicode blocks the coverage is picked from
+const BLOCKS: [(u16, u16);8] = [
+    (0x0020, 0x007E), // Basic Latin
+    (0x00A0, 0x00FF), // Latin-1 Supplement
+    (0x0100, 0x017F), // Latin Extended-A
+    (0x0370, 0x03FF), // Greek
+    (0x0400, 0x04FF), // Cyrillic
+    (0x0590, 0x05FF), // Hebrew
+    (0x3040, 0x309F), // Hiragana
+    (0x4E00, 0x9FFF), // CJK Unified Ideographs
+];
+
+fn FcSyntheticFamily(rng: &mut FcRng, family_id: usize, config: &FcCorpusConfig) -> Vec<FcSyntheticFace> {
+
+    let syllables = 2 + rng.below(2);
+    let mut base = (0..syllables).map(|_| SYLLABLES[rng.below(SYLLABLES.len())]).collect::<String>();
+    base[..1].make_ascii_uppercase();
+    let classification = CLASSIFICATIONS[rng.below(CLASSIFICATIONS.len())];
+    // the id keeps family names unique, even if the syllables repeat
+    let family = format!("{} {} {}", base, classification, family_id);
+
+    let monospace = classification == "Mono";
+    let width = if rng.below(8) == 0 { 3 + rng.below(5) as u16 } else { 5 };
+    let styles = 1 + rng.below(config.max_styles_per_family.max(1).min(STYLES.len()));
+
+    // all styles of a family share the coverage
+    let mut coverage = vec![BLOCKS[0]];
+    let mut remaining = config.max_coverage.saturating_sub(95);
+    for (start, end) in BLOCKS[1..].iter() {
+        if remaining == 0 || rng.below(3) != 0 {
+            continue;
+        }
+        let len = (rng.below(remaining) + 1).min((*end - *start) as usize + 1);
+        coverage.push((*start, *start + len as u16 - 1));
+        remaining -= len;
+    }
+
+    (0..styles).map(|s| {
+        let (subfamily, weight, bold, italic) = STYLES[s];
+        FcSyntheticFace {
+            family: family.clone(),
+            subfamily: subfamily.to_string(),
+            weight,
+            width,
+            bold,
+            italic,
+            monospace,
+            coverage: coverage.clone(),
+            padding: if config.max_padding == 0 { 0 } else { rng.below(config.max_padding) },
+        }
+    }).collect()
+}
+
+fn FcCorpusDirectory(root: &Path, family_id: usize, config: &FcCorpusConfig) -> PathBuf {
+    let mut dir = root.to_path_buf();
+    let fanout = config.directories_per_level.max(1);
+    let mut id = family_id;
+    for _ in 0..config.directory_depth {
+        dir.push(format!("d{}", id % fanout));
+        id /= fanout;
+    }
+    dir
+}
+
+// splitmix64 - deterministic across platforms and Rust versions
+struct FcRng(u64);
+
+impl FcRng {
+    fn new(seed: u64) -> Self {
+        FcRng(seed)
+    }
+
+    fn next(&mut self) -> u64 {
+        self.0 = self.0.wrapping_add(0x9E37_79B9_7F4A_7C15);
+        let mut z = self.0;
+        z = (z ^ (z >> 30)).wrapping_mul(0xBF58_476D_1CE4_E5B9);
+        z = (z ^ (z >> 27)).wrapping_mul(0x94D0_49BB_1331_11EB);
+        z ^ (z >> 31)
+    }
+
+    fn below(&mut self, n: usize) -> usize {
+        if n == 0 { 0 } else { (self.next() % n as u64) as usize }
+    }
+}
+
+// --- sfnt writing
+
+const TTC_TAG: [u8;4] = *b"ttcf";
+const SFNT_VERSION_TRUETYPE: u32 = 0x0001_0000;
+
+// Writes a single font or a collection of fonts
+fn FcWriteFonts(faces: &[&FcSyntheticFace], is_collection: bool) -> Vec<u8> {
+
+    let mut out = Vec::new();
+
+    let header_len = if is_collection { 12 + 4 * faces.len() } else { 0 };
+    let tables = faces.iter().map(|f| FcBuildTables(f)).collect::<Vec<_>>();
+
+    // all table directories first, then the table data
+    let mut directory_offsets = Vec::new();
+    let mut offset = header_len;
+    for t in tables.iter() {
+        directory_offsets.push(offset);
+        offset += 12 + 16 * t.len();
+    }
+
+    if is_collection {
+        out.extend_from_slice(&TTC_TAG);
+        out.extend_from_slice(&0x0001_0000_u32.to_be_bytes());
+        out.extend_from_slice(&(faces.len() as u32).to_be_bytes());
+        for o in directory_offsets.iter() {
+            out.extend_from_slice(&(*o as u32).to_be_bytes());
+        }
+    }
+
+    let mut data_offset = offset;
+    let mut data = Vec::new();
+
+    for t in tables.iter() {
+
+        let num_tables = t.len() as u16;
+        let entry_selector = 15 - num_tables.leading_zeros() as u16;
+        let search_range = (1_u16 << entry_selector) * 16;
+
+        out.extend_from_slice(&SFNT_VERSION_TRUETYPE.to_be_bytes());
+        out.extend_from_slice(&num_tables.to_be_bytes());
+        out.extend_from_slice(&search_range.to_be_bytes());
+        out.extend_from_slice(&entry_selector.to_be_bytes());
+        out.extend_from_slice(&(num_tables * 16 - search_range).to_be_bytes());
+
+        for (tag, bytes) in t.iter() {
+            out.extend_from_slice(tag);
+            out.extend_from_slice(&FcTableChecksum(bytes).to_be_bytes());
+            out.extend_from_slice(&(data_offset as u32).to_be_bytes());
+            out.extend_from_slice(&(bytes.len() as u32).to_be_bytes());
+            data.extend_from_slice(bytes);
+            while data.len() % 4 != 0 {
+                data.push(0);
+            }
+            data_offset = offset + data.len();
+        }
+    }
+
+    out.extend_from_slice(&data);
+    out
+}
+
+// Returns the (tag, data) of all tables, sorted by tag
+fn FcBuildTables(face: &FcSyntheticFace) -> Vec<([u8;4], Vec<u8>)> {
+
+    let num_glyphs = 1 + face.coverage.iter().map(|(s, e)| (*e - *s) as usize + 1).sum::<usize>();
+    let num_glyphs = num_glyphs.min(u16::MAX as usize) as u16;
+
+    let mut tables = vec![
+        (*b"OS/2", FcBuildOs2(face)),
+        (*b"cmap", FcBuildCmap(face)),
+        (*b"glyf", Vec::new()),
+        (*b"head", FcBuildHead(face)),
+        (*b"hhea", FcBuildHhea()),
+        (*b"hmtx", FcBuildHmtx(num_glyphs)),
+        (*b"loca", vec![0; 2 * (num_glyphs as usize + 1)]),
+        (*b"maxp", FcBuildMaxp(num_glyphs)),
+        (*b"name", FcBuildName(face)),
+        (*b"post", FcBuildPost(face)),
+    ];
+
+    if face.padding != 0 {
+        // private table, ignored by font parsers
+        tables.push((*b"zpad", vec![0; face.padding]));
+    }
+
+    tables.sort_by_key(|(tag, _)| *tag);
+    tables
+}
+
+struct FcTableWriter(Vec<u8>);
+
+impl FcTableWriter {
+    fn new() -> Self { FcTableWriter(Vec::new()) }
+    fn u16(&mut self, v: u16) -> &mut Self { self.0.extend_from_slice(&v.to_be_bytes()); self }
+    fn i16(&mut self, v: i16) -> &mut Self { self.0.extend_from_slice(&v.to_be_bytes()); self }
+    fn u32(&mut self, v: u32) -> &mut Self { self.0.extend_from_slice(&v.to_be_bytes()); self }
+    fn u64(&mut self, v: u64) -> &mut Self { self.0.extend_from_slice(&v.to_be_bytes()); self }
+    fn bytes(&mut self, v: &[u8]) -> &mut Self { self.0.extend_from_slice(v); self }
+}
+
+fn FcBuildHead(face: &FcSyntheticFace) -> Vec<u8> {
+    let mac_style = (face.bold as u16) | ((face.italic as u16) << 1);
+    let mut w = FcTableWriter::new();
+    w.u32(0x0001_0000)  // version
+     .u32(0x0001_0000)  // fontRevision
+     .u32(0)            // checkSumAdjustment, see FcSynthesizeFont
+     .u32(0x5F0F_3CF5)  // magicNumber
+     .u16(0b1011)       // flags
+     .u16(1000)         // unitsPerEm
+     .u64(0)            // created
+     .u64(0)            // modified
+     .i16(0).i16(-200).i16(1000).i16(800) // xMin, yMin, xMax, yMax
+     .u16(mac_style)
+     .u16(8)            // lowestRecPPEM
+     .i16(2)            // fontDirectionHint
+     .i16(0)            // indexToLocFormat (short)
+     .i16(0);           // glyphDataFormat
+    w.0
+}
+
+fn FcBuildHhea() -> Vec<u8> {
+    let mut w = FcTableWriter::new();
+    w.u32(0x0001_0000)  // version
+     .i16(800).i16(-200).i16(0) // ascender, descender, lineGap
+     .u16(1000)         // advanceWidthMax
+     .i16(0).i16(0).i16(1000) // minLeftSideBearing, minRightSideBearing, xMaxExtent
+     .i16(1).i16(0).i16(0) // caretSlopeRise, caretSlopeRun, caretOffset
+     .i16(0).i16(0).i16(0).i16(0) // reserved
+     .i16(0)            // metricDataFormat
+     .u16(1);           // numberOfHMetrics
+    w.0
+}
+
+fn FcBuildHmtx(num_glyphs: u16) -> Vec<u8> {
+    let mut w = FcTableWriter::new();
+    w.u16(600).i16(0); // one full metric, then only left side bearings
+    for _ in 1..num_glyphs {
+        w.i16(0);
+    }
+    w.0
+}
+
+fn FcBuildMaxp(num_glyphs: u16) -> Vec<u8> {
+    let mut w = FcTableWriter::new();
+    w.u32(0x0001_0000).u16(num_glyphs);
+    for _ in 0..13 {
+        w.u16(0); // maxPoints .. maxComponentDepth
+    }
+    w.0
+}
+
+fn FcBuildPost(face: &FcSyntheticFace) -> Vec<u8> {
+    let mut w = FcTableWriter::new();
+    w.u32(0x0003_0000)  // version 3.0: no glyph names
+     .u32(if face.italic { 0xFFF4_0000 } else { 0 }) // italicAngle (-12.0)
+     .i16(-100).i16(50) // underlinePosition, underlineThickness
+     .u32(face.monospace as u32) // isFixedPitch
+     .u32(0).u32(0).u32(0).u32(0); // min/maxMemType42, min/maxMemType1
+    w.0
+}
+
+fn FcBuildOs2(face: &FcSyntheticFace) -> Vec<u8> {
+
+    // fsSelection: ITALIC = bit 0, BOLD = bit 5, REGULAR = bit 6
+    let fs_selection = if face.bold || face.italic {
+        (face.italic as u16) | ((face.bold as u16) << 5)
+    } else {
+        1 << 6
+    };
+
+    let mut panose = [0_u8;10];
+    panose[0] = 2; // Latin text
+    panose[3] = if face.monospace { 9 } else { 3 }; // proportion
+
+    let first_char = face.coverage.iter().map(|(s, _)| *s).min().unwrap_or(0);
+    let last_char = face.coverage.iter().map(|(_, e)| *e).max().unwrap_or(0);
+
+    let mut w = FcTableWriter::new();
+    w.u16(4)                // version
+     .i16(if face.monospace { 600 } else { 500 }) // xAvgCharWidth
+     .u16(face.weight)
+     .u16(face.width)
+     .u16(0)                // fsType: installable
+     .i16(650).i16(600).i16(0).i16(75) // subscript x/y size, x/y offset
+     .i16(650).i16(600).i16(0).i16(350) // superscript x/y size, x/y offset
+     .i16(50).i16(250)      // strikeout size, position
+     .i16(0)                // sFamilyClass
+     .bytes(&panose)
+     .u32(1).u32(0).u32(0).u32(0) // ulUnicodeRange1-4: Basic Latin
+     .bytes(b"SYNT")        // achVendID
+     .u16(fs_selection)
+     .u16(first_char)
+     .u16(last_char)
+     .i16(800).i16(-200).i16(0) // sTypoAscender, sTypoDescender, sTypoLineGap
+     .u16(1000).u16(200)    // usWinAscent, usWinDescent
+     .u32(1).u32(0)         // ulCodePageRange1-2: Latin 1
+     .i16(500).i16(700)     // sxHeight, sCapHeight
+     .u16(0).u16(0x20)      // usDefaultChar, usBreakChar
+     .u16(1);               // usMaxContext
+    w.0
+}
+
+// format 4 (BMP) subtable for the Windows Unicode encoding
+fn FcBuildCmap(face: &FcSyntheticFace) -> Vec<u8> {
+
+    let mut segments = face.coverage.clone();
+    segments.sort();
+    segments.push((0xFFFF, 0xFFFF));
+
+    let seg_count = segments.len() as u16;
+    let entry_selector = 15 - seg_count.leading_zeros() as u16;
+    let search_range = 2 * (1_u16 << entry_selector);
+
+    let mut w = FcTableWriter::new();
+
+    // cmap header + one encoding record
+    w.u16(0).u16(1).u16(3).u16(1).u32(12);
+
+    let length = 16 + 8 * seg_count;
+    w.u16(4)
+     .u16(length)
+     .u16(0)                // language
+     .u16(seg_count * 2)
+     .u16(search_range)
+     .u16(entry_selector)
+     .u16(seg_count * 2 - search_range);
+
+    for (_, end) in segments.iter() {
+        w.u16(*end);
+    }
+    w.u16(0); // reservedPad
+    for (start, _) in segments.iter() {
+        w.u16(*start);
+    }
+
+    // glyph ids are assigned consecutively, starting at 1
+    let mut next_glyph = 1_u16;
+    for (start, end) in segments.iter() {
+        if *start == 0xFFFF {
+            w.u16(1); // maps 0xFFFF to .notdef
+        } else {
+            w.u16(next_glyph.wrapping_sub(*start));
+            next_glyph = next_glyph.wrapping_add(*end - *start + 1);
+        }
+    }
+    for _ in segments.iter() {
+        w.u16(0); // idRangeOffset
+    }
+
+    w.0
+}
+
+const PLATFORM_WINDOWS: u16 = 3;
+const ENCODING_UNICODE_BMP: u16 = 1;
+const LANGUAGE_EN_US: u16 = 0x0409;
+
+fn FcBuildName(face: &FcSyntheticFace) -> Vec<u8> {
+
+    let postscript_name = face.full_name().replace(' ', "");
+    let records = [
+        (1, face.family.clone()),
+        (2, face.subfamily.clone()),
+        (4, face.full_name()),
+        (6, postscript_name),
+    ];
+
+    let mut strings = Vec::new();
+    let mut w = FcTableWriter::new();
+    w.u16(0)                        // format
+     .u16(records.len() as u16)
+     .u16(6 + 12 * records.len() as u16); // stringOffset
+
+    for (name_id, value) in records.iter() {
+        let offset = strings.len() as u16;
+        for unit in value.encode_utf16() {
+            strings.extend_from_slice(&unit.to_be_bytes());
+        }
+        w.u16(PLATFORM_WINDOWS)
+         .u16(ENCODING_UNICODE_BMP)
+         .u16(LANGUAGE_EN_US)
+         .u16(*name_id)
+         .u16(strings.len() as u16 - offset)
+         .u16(offset);
+    }
+
+    w.bytes(&strings);
+    w.0
+}
+
+fn FcTableChecksum(bytes: &[u8]) -> u32 {
+    bytes.chunks(4).fold(0_u32, |sum, chunk| {
+        let mut word = [0_u8;4];
+        word[..chunk.len()].copy_from_slice(chunk);
+        sum.wrapping_add(u32::from_be_bytes(word))
+    })
+}
+
+// Returns the offset of a table in the font starting at `font_offset`
+fn FcFindTable(font: &[u8], font_offset: usize, tag: [u8;4]) -> Option<usize> {
+    let num_tables = u16::from_be_bytes([font[font_offset + 4], font[font_offset + 5]]) as usize;
+    (0..num_tables).find_map(|i| {
+        let record = font_offset + 12 + 16 * i;
+        if font[record..record + 4] == tag {
+            Some(FcReadU32(font, record + 8) as usize)
+        } else {
+            None
+        }
+    })
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::{FcBuildHooks, FcBuildReportCollector, FcFontCache, FcParseFontFile, FcScanDirectoriesInner};
+
+    // all files below `dir`
+    fn files(dir: &Path, out: &mut Vec<PathBuf>) {
+        for path in fs::read_dir(dir).unwrap().map(|e| e.unwrap().path()) {
+            if path.is_dir() {
+                files(&path, out);
+            } else {
+                out.push(path);
+            }
+        }
+    }
+
+    #[test]
+    fn summary_matches_indexed_fonts() {
+
+        let root = std::env::temp_dir().join(format!("rust-fontconfig-corpus-{}", std::process::id()));
+        let _ = fs::remove_dir_all(&root);
+
+        let config = FcCorpusConfig {
+            families: 40,
+            collection_every: 4,
+            directories_per_level: 3,
+            max_padding: 64,
+            .. Default::default()
+        };
+        let summary = FcGenerateCorpus(&root, &config).unwrap();
+
+        // every generated file is a font, a .ttc contributes its first face
+        let mut generated = Vec::new();
+        files(&root, &mut generated);
+        assert_eq!(generated.len(), summary.files);
+        let mut faces = 0;
+        for file in generated.iter() {
+            let fonts = FcParseFontFile(file).unwrap_or_else(|| panic!("{:?} was not parsed", file));
+            assert_eq!(fonts.len(), 1, "{:?}", file);
+            faces += fonts.len();
+        }
+        assert_eq!(faces, summary.faces);
+
+        let cache = FcFontCache::build_from_directories(&[root.clone()]);
+        assert_eq!(cache.list().len(), summary.faces);
+
+        let collector = FcBuildReportCollector::new(0);
+        let hooks = FcBuildHooks { report: Some(&collector), .. Default::default() };
+        FcScanDirectoriesInner(&[root.clone()], &hooks);
+        let report = collector.into_report();
+        assert_eq!(report.directories, summary.directories);
+        assert_eq!(report.files, summary.files);
+        assert_eq!(report.faces, summary.faces);
+
+        fs::remove_dir_all(&root).unwrap();
+    }
+}
@@ -0,0 +1,129 @@
+//! Step-by-step explanation of a query, see `FcFontCache::explain()`
+//!
+//! ```rust,no_run
+//! use rust_fontconfig::{FcFontCache, FcPattern};
+//!
+//! let cache = FcFontCache::build();
+//! let explanation = cache.explain(&FcPattern {
+//!     family: Some(String::from("DejaVu Sans")),
+//!     .. Default::default()
+//! });
+//! println!("{}", explanation);
+//! ```
+
+use crate::{FcFontCache, FcFontPath, FcPattern, FcPatternFields, FcRejectReason};
+use core::fmt;
+use std::time::{Duration, Instant};
+
+/// Stage of a query
+#[derive(Debug, Copy, Clone, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub enum FcQueryStage {
+    /// Candidates were looked up by name or family in the index
+    Index,
+    /// No index lookup was possible, all fonts are candidates
+    Scan,
+    /// Candidates whose properties match the pattern
+    Attributes,
+    /// The first matching candidate (in cache order) is the result
+    Selection,
+}
+
+/// Number of candidates left after a stage and the time spent in it
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub struct FcStageReport {
+    pub stage: FcQueryStage,
+    pub candidates: usize,
+    pub time: Duration,
+}
+
+/// Candidate font of a query and why it was rejected (`None` = it matches)
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub struct FcExplainedCandidate<'a> {
+    pub pattern: &'a FcPattern,
+    pub font: &'a FcFontPath,
+    pub rejected: Option<FcRejectReason>,
+}
+
+/// Result of `FcFontCache::explain()`
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct FcQueryExplanation<'a> {
+    /// Stages in the order they ran
+    pub stages: Vec<FcStageReport>,
+    /// All candidates of the first stage, in the order they were checked
+    pub candidates: Vec<FcExplainedCandidate<'a>>,
+    /// Same as the result of `query()`
+    pub result: Option<&'a FcFontPath>,
+}
+
+impl FcFontCache {
+
+    /// Runs a query like `query()`, but records the candidates, the reason
+    /// why each candidate was rejected and the time spent in each stage
+    ///
+    /// Unlike `query()`, all candidates are checked instead of stopping at
+    /// the first match, so the time of the `Attributes` stage is an upper bound.
+    pub fn explain(&self, pattern: &FcPattern) -> FcQueryExplanation<'_> {
+
+        let lookup_start = Instant::now();
+        let index_candidates = self.index.as_ref().and_then(|index| index.candidates(pattern));
+        let lookup_stage = if index_candidates.is_some() { FcQueryStage::Index } else { FcQueryStage::Scan };
+        let fonts = match index_candidates {
+            Some(index_candidates) => index_candidates.iter().map(|p| self.entries.get(*p as usize)).collect::<Vec<_>>(),
+            None => self.map.iter().collect(),
+        };
+
+        let filter_start = Instant::now();
+        let candidates = fonts.into_iter().map(|(k, font)| FcExplainedCandidate {
+            pattern: k,
+            font,
+            rejected: pattern.reject_reason(k),
+        }).collect::<Vec<_>>();
+
+        let select_start = Instant::now();
+        let result = candidates.iter().find(|c| c.rejected.is_none()).map(|c| c.font);
+        let select_end = Instant::now();
+
+        let stages = vec![
+            FcStageReport { stage: lookup_stage, candidates: candidates.len(), time: filter_start - lookup_start },
+            FcStageReport {
+                stage: FcQueryStage::Attributes,
+                candidates: candidates.iter().filter(|c| c.rejected.is_none()).count(),
+                time: select_start - filter_start,
+            },
+            FcStageReport { stage: FcQueryStage::Selection, candidates: result.iter().count(), time: select_end - select_start },
+        ];
+
+        FcQueryExplanation { stages, candidates, result }
+    }
+}
+
+impl<'a> fmt::Display for FcQueryExplanation<'a> {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+
+        for stage in self.stages.iter() {
+            writeln!(f, "{:<12} {:>8} candidates  {:?}", format!("{:?}", stage.stage), stage.candidates, stage.time)?;
+        }
+
+        for c in self.candidates.iter() {
+            let verdict = match c.rejected {
+                Some(reason) => format!("rejected ({:?})", reason),
+                None if Some(c.font) == self.result => String::from("selected"),
+                None => String::from("matches"),
+            };
+            writeln!(
+                f,
+                "  {:<20} {:?} / {:?} - {}:{}",
+                verdict,
+                c.pattern.family.as_deref().unwrap_or(""),
+                c.pattern.name.as_deref().unwrap_or(""),
+                c.font.path,
+                c.font.font_index,
+            )?;
+        }
+
+        match self.result {
+            Some(font) => writeln!(f, "result: {}:{}", font.path, font.font_index),
+            None => writeln!(f, "result: none"),
+        }
+    }
+}
@@ -0,0 +1,453 @@
+//! C ABI, enabled with the `ffi` feature and declared in
+//! `include/rust_fontconfig.h`
+//!
+//! ```sh
+//! cargo rustc --release --features ffi --crate-type staticlib   # or cdylib
+//! ```
+//!
+//! The cache is an opaque `RfcCache` handle. Results are string views
+//! into the cache itself, valid until the handle is freed - lookups don't
+//! copy or allocate (except for patterns with backslash escapes, see
+//! `FcPatternRef::parse`). Strings passed in are UTF-8 views and don't
+//! have to be NUL-terminated. Symbols are prefixed with `rfc_` so that they
+//! don't clash with libfontconfig.
+
+use core::ptr;
+use core::slice;
+use std::borrow::Cow;
+use std::panic::{self, AssertUnwindSafe};
+use std::path::PathBuf;
+use crate::{FcFontCache, FcFontPath, FcPattern, FcPatternRef, PatternMatch};
+
+/// `PatternMatch::DontCare`
+pub const RFC_DONT_CARE: u8 = 0;
+/// `PatternMatch::True`
+pub const RFC_TRUE: u8 = 1;
+/// `PatternMatch::False`
+pub const RFC_FALSE: u8 = 2;
+
+/// Opaque cache handle
+pub struct RfcCache(FcFontCache);
+
+/// Borrowed UTF-8 string, `ptr == NULL` means "not set" / "not found"
+#[derive(Debug, Copy, Clone)]
+#[repr(C)]
+pub struct RfcStr {
+    pub ptr: *const u8,
+    pub len: usize,
+}
+
+/// Query pattern, see `FcPattern`
+#[derive(Debug, Copy, Clone)]
+#[repr(C)]
+pub struct RfcPattern {
+    pub name: RfcStr,
+    pub family: RfcStr,
+    /// `RFC_DONT_CARE`, `RFC_TRUE` or `RFC_FALSE`
+    pub italic: u8,
+    pub oblique: u8,
+    pub bold: u8,
+    pub monospace: u8,
+}
+
+/// Query result, all strings point into the cache
+#[derive(Debug, Copy, Clone)]
+#[repr(C)]
+pub struct RfcFont {
+    /// NULL if no font was found
+    pub path: RfcStr,
+    pub font_index: usize,
+    pub family: RfcStr,
+    pub name: RfcStr,
+}
+
+const NULL_STR: RfcStr = RfcStr { ptr: ptr::null(), len: 0 };
+const NOT_FOUND: RfcFont = RfcFont { path: NULL_STR, font_index: 0, family: NULL_STR, name: NULL_STR };
+
+impl RfcStr {
+
+    fn new(s: Option<&str>) -> Self {
+        match s {
+            Some(s) => RfcStr { ptr: s.as_ptr(), len: s.len() },
+            None => NULL_STR,
+        }
+    }
+
+    // Err(()) = not UTF-8
+    unsafe fn as_str<'a>(&self) -> Result<Option<&'a str>, ()> {
+        if self.ptr.is_null() {
+            return Ok(None);
+        }
+        core::str::from_utf8(slice::from_raw_parts(self.ptr, self.len)).map(Some).map_err(|_| ())
+    }
+}
+
+impl RfcFont {
+    fn new(pattern: &FcPattern, font: &FcFontPath) -> Self {
+        RfcFont {
+            path: RfcStr::new(Some(&font.path)),
+            font_index: font.font_index,
+            family: RfcStr::new(pattern.family.as_deref()),
+            name: RfcStr::new(pattern.name.as_deref()),
+        }
+    }
+}
+
+fn RfcMatch(m: u8) -> Option<PatternMatch> {
+    match m {
+        RFC_DONT_CARE => Some(PatternMatch::DontCare),
+        RFC_TRUE => Some(PatternMatch::True),
+        RFC_FALSE => Some(PatternMatch::False),
+        _ => None,
+    }
+}
+
+// None = invalid UTF-8 or match value
+unsafe fn RfcToPatternRef(pattern: &RfcPattern) -> Option<FcPatternRef<'_>> {
+    Some(FcPatternRef {
+        name: pattern.name.as_str().ok()?.map(Cow::Borrowed),
+        family: pattern.family.as_str().ok()?.map(Cow::Borrowed),
+        italic: RfcMatch(pattern.italic)?,
+        oblique: RfcMatch(pattern.oblique)?,
+        bold: RfcMatch(pattern.bold)?,
+        monospace: RfcMatch(pattern.monospace)?,
+        .. Default::default()
+    })
+}
+
+fn RfcBox(build: impl FnOnce() -> FcFontCache) -> *mut RfcCache {
+    // unwinding into C is undefined behaviour
+    match panic::catch_unwind(AssertUnwindSafe(build)) {
+        Ok(cache) => Box::into_raw(Box::new(RfcCache(cache))),
+        Err(_) => ptr::null_mut(),
+    }
+}
+
+/// Builds a cache from the system fonts, NULL on failure
+///
+/// NOTE: Performance-intensive, see `FcFontCache::build()`
+#[no_mangle]
+pub extern "C" fn rfc_cache_build() -> *mut RfcCache {
+    RfcBox(FcFontCache::build)
+}
+
+/// Builds a cache from the fonts in `dirs`, NULL on failure
+///
+/// # Safety
+///
+/// `dirs` must point to `count` valid `RfcStr`
+#[no_mangle]
+pub unsafe extern "C" fn rfc_cache_build_from_dirs(dirs: *const RfcStr, count: usize) -> *mut RfcCache {
+    let dirs = match (dirs.is_null(), count) {
+        (_, 0) => &[],
+        (true, _) => return ptr::null_mut(),
+        (false, _) => slice::from_raw_parts(dirs, count),
+    };
+    let mut paths = Vec::with_capacity(count);
+    for dir in dirs {
+        match dir.as_str() {
+            Ok(Some(d)) => paths.push(PathBuf::from(d)),
+            _ => return ptr::null_mut(),
+        }
+    }
+    RfcBox(|| FcFontCache::build_from_directories(&paths))
+}
+
+/// Frees a cache, invalidating all strings returned for it
+///
+/// # Safety
+///
+/// `cache` must be NULL or a handle returned by `rfc_cache_build*` that
+/// wasn't freed yet
+#[no_mangle]
+pub unsafe extern "C" fn rfc_cache_free(cache: *mut RfcCache) {
+    if !cache.is_null() {
+        drop(Box::from_raw(cache));
+    }
+}
+
+/// Number of fonts in the cache
+///
+/// # Safety
+///
+/// `cache` must be a valid handle
+#[no_mangle]
+pub unsafe extern "C" fn rfc_cache_len(cache: *const RfcCache) -> usize {
+    cache.as_ref().map(|c| c.0.list().len()).unwrap_or(0)
+}
+
+/// See `FcFontCache::generation()`
+///
+/// # Safety
+///
+/// `cache` must be a valid handle
+#[no_mangle]
+pub unsafe extern "C" fn rfc_cache_generation(cache: *const RfcCache) -> u64 {
+    cache.as_ref().map(|c| c.0.generation()).unwrap_or(0)
+}
+
+/// Queries a font, see `FcFontCache::query()`
+///
+/// Returns 1 if a font was found, 0 if not (`out->path.ptr` is NULL) and
+/// -1 for invalid arguments.
+///
+/// # Safety
+///
+/// `cache` must be a valid handle, `pattern` and `out` valid pointers
+#[no_mangle]
+pub unsafe extern "C" fn rfc_query(cache: *const RfcCache, pattern: *const RfcPattern, out: *mut RfcFont) -> i32 {
+    let (cache, pattern, out) = match (cache.as_ref(), pattern.as_ref(), out.as_mut()) {
+        (Some(c), Some(p), Some(o)) => (c, p, o),
+        _ => return -1,
+    };
+    RfcStore(out, RfcToPatternRef(pattern).map(|p| cache.0.query_ref_entry(&p)))
+}
+
+/// Parses a fontconfig pattern string and queries it, see `FcFontCache::query_str()`
+///
+/// Returns 1 if a font was found, 0 if not and -1 for invalid arguments
+/// or patterns.
+///
+/// # Safety
+///
+/// `cache` must be a valid handle, `pattern` a valid string, `out` a valid pointer
+#[no_mangle]
+pub unsafe extern "C" fn rfc_query_str(cache: *const RfcCache, pattern: RfcStr, out: *mut RfcFont) -> i32 {
+    let (cache, out) = match (cache.as_ref(), out.as_mut()) {
+        (Some(c), Some(o)) => (c, o),
+        _ => return -1,
+    };
+    let result = match pattern.as_str() {
+        Ok(Some(s)) => FcPatternRef::parse(s).ok().map(|p| cache.0.query_ref_entry(&p)),
+        _ => None,
+    };
+    RfcStore(out, result)
+}
+
+/// Runs `rfc_query()` for `count` patterns, writing `count` results to
+/// `out` - returns the number of fonts found
+///
+/// # Safety
+///
+/// `cache` must be a valid handle, `patterns` and `out` must point to
+/// `count` elements
+#[no_mangle]
+pub unsafe extern "C" fn rfc_query_batch(cache: *const RfcCache, patterns: *const RfcPattern, count: usize, out: *mut RfcFont) -> usize {
+    match (cache.as_ref(), patterns.is_null() || out.is_null()) {
+        (Some(cache), false) => {
+            let patterns = slice::from_raw_parts(patterns, count);
+            let out = slice::from_raw_parts_mut(out, count);
+            let mut found = 0;
+            for (pattern, out) in patterns.iter().zip(out.iter_mut()) {
+                if RfcStore(out, RfcToPatternRef(pattern).map(|p| cache.0.query_ref_entry(&p))) == 1 {
+                    found += 1;
+                }
+            }
+            found
+        },
+        _ => 0,
+    }
+}
+
+/// Runs `rfc_query_str()` for `count` pattern strings, writing `count`
+/// results to `out` - returns the number of fonts found
+///
+/// # Safety
+///
+/// `cache` must be a valid handle, `patterns` and `out` must point to
+/// `count` elements
+#[no_mangle]
+pub unsafe extern "C" fn rfc_query_str_batch(cache: *const RfcCache, patterns: *const RfcStr, count: usize, out: *mut RfcFont) -> usize {
+    if patterns.is_null() || out.is_null() {
+        return 0;
+    }
+    let patterns = slice::from_raw_parts(patterns, count);
+    let out = slice::from_raw_parts_mut(out, count);
+    let mut found = 0;
+    for (pattern, out) in patterns.iter().zip(out.iter_mut()) {
+        if rfc_query_str(cache, *pattern, out) == 1 {
+            found += 1;
+        }
+    }
+    found
+}
+
+// None = invalid argument
+fn RfcStore(out: &mut RfcFont, result: Option<Option<(&FcPattern, &FcFontPath)>>) -> i32 {
+    match result {
+        Some(Some((pattern, font))) => {
+            *out = RfcFont::new(pattern, font);
+            1
+        },
+        Some(None) => {
+            *out = NOT_FOUND;
+            0
+        },
+        None => {
+            *out = NOT_FOUND;
+            -1
+        },
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use core::mem::{align_of, size_of};
+
+    const WORD: usize = size_of::<usize>();
+
+    fn str(s: &str) -> RfcStr {
+        RfcStr::new(Some(s))
+    }
+
+    unsafe fn string<'a>(s: RfcStr) -> Option<&'a str> {
+        s.as_str().unwrap()
+    }
+
+    fn cache() -> *mut RfcCache {
+        RfcBox(|| (0..10).map(|i| (FcPattern {
+            name: Some(format!("Font {}", i)),
+            family: Some(format!("Family {}", i % 2)),
+            bold: if i % 2 == 0 { PatternMatch::True } else { PatternMatch::False },
+            .. Default::default()
+        }, FcFontPath { path: format!("/fonts/{}.ttf", i), font_index: i, .. Default::default() })).collect())
+    }
+
+    fn pattern(name: RfcStr, family: RfcStr, bold: u8) -> RfcPattern {
+        RfcPattern { name, family, italic: RFC_DONT_CARE, oblique: RFC_DONT_CARE, bold, monospace: RFC_DONT_CARE }
+    }
+
+    // offset of a field in `base`
+    fn offset<T, F>(base: &T, field: &F) -> usize {
+        field as *const F as usize - base as *const T as usize
+    }
+
+    // same layout as the structs in include/rust_fontconfig.h
+    #[test]
+    fn layout() {
+
+        assert_eq!((size_of::<RfcStr>(), align_of::<RfcStr>()), (2 * WORD, WORD));
+        let s = NULL_STR;
+        assert_eq!((offset(&s, &s.ptr), offset(&s, &s.len)), (0, WORD));
+
+        // 4 bytes of style fields, padded to the alignment of RfcStr
+        assert_eq!((size_of::<RfcPattern>(), align_of::<RfcPattern>()), (5 * WORD, WORD));
+        let p = pattern(NULL_STR, NULL_STR, RFC_DONT_CARE);
+        assert_eq!(offset(&p, &p.name), 0);
+        assert_eq!(offset(&p, &p.family), 2 * WORD);
+        assert_eq!(offset(&p, &p.italic), 4 * WORD);
+        assert_eq!(offset(&p, &p.oblique), 4 * WORD + 1);
+        assert_eq!(offset(&p, &p.bold), 4 * WORD + 2);
+        assert_eq!(offset(&p, &p.monospace), 4 * WORD + 3);
+
+        assert_eq!((size_of::<RfcFont>(), align_of::<RfcFont>()), (7 * WORD, WORD));
+        let f = NOT_FOUND;
+        assert_eq!(offset(&f, &f.path), 0);
+        assert_eq!(offset(&f, &f.font_index), 2 * WORD);
+        assert_eq!(offset(&f, &f.family), 3 * WORD);
+        assert_eq!(offset(&f, &f.name), 5 * WORD);
+    }
+
+    #[test]
+    fn queries() {
+        unsafe {
+
+            let cache = cache();
+            assert!(!cache.is_null());
+            assert_eq!(rfc_cache_len(cache), 10);
+            assert_ne!(rfc_cache_generation(cache), 0);
+
+            let mut out = NOT_FOUND;
+            // False: the font must not be False
+            assert_eq!(rfc_query(cache, &pattern(NULL_STR, str("Family 1"), RFC_FALSE), &mut out), 0);
+            assert_eq!(rfc_query(cache, &pattern(NULL_STR, str("Family 0"), RFC_TRUE), &mut out), 1);
+            assert_eq!(string(out.path), Some("/fonts/0.ttf"));
+            assert_eq!((string(out.name), string(out.family), out.font_index), (Some("Font 0"), Some("Family 0"), 0));
+            // strings point into the cache
+            assert_eq!(out.path.ptr, (*cache).0.query(&FcPattern { name: Some(String::from("Font 0")), .. Default::default() }).unwrap().path.as_ptr());
+
+            assert_eq!(rfc_query(cache, &pattern(str("Font 3"), NULL_STR, RFC_DONT_CARE), &mut out), 1);
+            assert_eq!(string(out.path), Some("/fonts/3.ttf"));
+            assert_eq!(rfc_query(cache, &pattern(str("Font 3"), NULL_STR, RFC_TRUE), &mut out), 0);
+            assert!(out.path.ptr.is_null());
+
+            assert_eq!(rfc_query_str(cache, str("Family 1:italic=false"), &mut out), 1);
+            assert_eq!(string(out.path), Some("/fonts/1.ttf"));
+            assert_eq!(rfc_query_str(cache, str("Does Not Exist"), &mut out), 0);
+
+            let patterns = [
+                pattern(str("Font 4"), NULL_STR, RFC_DONT_CARE),
+                pattern(str("Font 42"), NULL_STR, RFC_DONT_CARE),
+                pattern(NULL_STR, str("Family 0"), RFC_TRUE),
+            ];
+            let mut results = [NOT_FOUND;3];
+            assert_eq!(rfc_query_batch(cache, patterns.as_ptr(), 3, results.as_mut_ptr()), 2);
+            assert_eq!(string(results[0].path), Some("/fonts/4.ttf"));
+            assert!(results[1].path.ptr.is_null());
+
+            let strings = [str(":name=Font 5"), str("Family 0:bold")];
+            assert_eq!(rfc_query_str_batch(cache, strings.as_ptr(), 2, results.as_mut_ptr()), 2);
+            assert_eq!(string(results[1].path), Some("/fonts/0.ttf"));
+
+            rfc_cache_free(cache);
+        }
+    }
+
+    #[test]
+    fn invalid_arguments() {
+        unsafe {
+
+            let cache = cache();
+            let valid = pattern(str("Font 1"), NULL_STR, RFC_DONT_CARE);
+            let mut out = RfcFont::new(&FcPattern::default(), &FcFontPath::default());
+
+            // NULL pointers
+            assert_eq!(rfc_query(ptr::null(), &valid, &mut out), -1);
+            assert_eq!(rfc_query(cache, ptr::null(), &mut out), -1);
+            assert_eq!(rfc_query(cache, &valid, ptr::null_mut()), -1);
+            assert_eq!(rfc_query_str(ptr::null(), str("Font 1"), &mut out), -1);
+            assert_eq!(rfc_query_str(cache, NULL_STR, &mut out), -1);
+            assert_eq!(rfc_query_batch(cache, ptr::null(), 1, &mut out), 0);
+            assert_eq!(rfc_query_batch(ptr::null(), &valid, 1, &mut out), 0);
+            assert_eq!(rfc_query_str_batch(cache, ptr::null(), 1, &mut out), 0);
+            assert_eq!(rfc_cache_len(ptr::null()), 0);
+            assert_eq!(rfc_cache_generation(ptr::null()), 0);
+            assert!(rfc_cache_build_from_dirs(ptr::null(), 1).is_null());
+            rfc_cache_free(ptr::null_mut());
+
+            // invalid UTF-8
+            let invalid = [b'F', 0xff, 0xfe];
+            let invalid = RfcStr { ptr: invalid.as_ptr(), len: invalid.len() };
+            out = RfcFont::new(&FcPattern::default(), &FcFontPath::default());
+            assert_eq!(rfc_query(cache, &pattern(invalid, NULL_STR, RFC_DONT_CARE), &mut out), -1);
+            assert!(out.path.ptr.is_null());
+            assert_eq!(rfc_query(cache, &pattern(NULL_STR, invalid, RFC_DONT_CARE), &mut out), -1);
+            assert_eq!(rfc_query_str(cache, invalid, &mut out), -1);
+            assert!(rfc_cache_build_from_dirs(&invalid, 1).is_null());
+
+            // invalid pattern strings and match values
+            assert_eq!(rfc_query_str(cache, str("Font 1:bold:nonsense"), &mut out), -1);
+            for bad in [3, 4, 255].iter() {
+                assert_eq!(rfc_query(cache, &pattern(str("Font 1"), NULL_STR, *bad), &mut out), -1);
+                let mut italic = valid;
+                italic.italic = *bad;
+                assert_eq!(rfc_query(cache, &italic, &mut out), -1);
+            }
+
+            // the invalid pattern doesn't affect the others of a batch
+            let patterns = [pattern(invalid, NULL_STR, RFC_DONT_CARE), valid, pattern(NULL_STR, NULL_STR, 7)];
+            let mut results = [NOT_FOUND;3];
+            assert_eq!(rfc_query_batch(cache, patterns.as_ptr(), 3, results.as_mut_ptr()), 1);
+            assert_eq!(string(results[1].path), Some("/fonts/1.ttf"));
+
+            // no directories
+            let empty = rfc_cache_build_from_dirs(ptr::null(), 0);
+            assert_eq!(rfc_cache_len(empty), 0);
+            rfc_cache_free(empty);
+
+            rfc_cache_free(cache);
+        }
+    }
+}
@@ -0,0 +1,360 @@
+//! Process-wide shared cache, see `FcFontCache::global()`
+//!
+//! Builds are single-flight: while a build is running, other callers of
+//! `global()` wait for it instead of scanning the fonts themselves, and
+//! `refresh_global()` calls that arrive during a build are coalesced into
+//! one follow-up build. Every build gets a new `generation()`.
+//!
+//! Subscribers (`FcFontCache::subscribe_global()`) are called with the
+//! faces that changed after every build, in build order.
+
+use alloc::sync::Arc;
+use std::sync::{Condvar, Mutex, MutexGuard};
+use crate::{FcCacheDiff, FcFontCache};
+
+type FcBuilder = Arc<dyn Fn() -> FcFontCache + Send + Sync>;
+type FcSubscriber = Arc<dyn Fn(&FcCacheDiff) + Send + Sync>;
+
+struct FcGlobalState {
+    cache: Option<Arc<FcFontCache>>,
+    // None = `FcFontCache::build`
+    builder: Option<FcBuilder>,
+    building: bool,
+    // number of builds that were started, number of the build of `cache`
+    started: u64,
+    built: u64,
+}
+
+static STATE: Mutex<FcGlobalState> = Mutex::new(FcGlobalState {
+    cache: None,
+    builder: None,
+    building: false,
+    started: 0,
+    built: 0,
+});
+
+static BUILD_DONE: Condvar = Condvar::new();
+
+struct FcSubscribers {
+    next_id: u64,
+    list: Vec<(u64, FcSubscriber)>,
+}
+
+static SUBSCRIBERS: Mutex<FcSubscribers> = Mutex::new(FcSubscribers {
+    next_id: 0,
+    list: Vec::new(),
+});
+
+fn FcLockSubscribers() -> MutexGuard<'static, FcSubscribers> {
+    SUBSCRIBERS.lock().unwrap_or_else(|e| e.into_inner())
+}
+
+/// Subscription to changes of the process-wide cache, see
+/// `FcFontCache::subscribe_global()` - unsubscribes when dropped
+#[derive(Debug)]
+#[must_use = "dropping the subscription unsubscribes immediately"]
+pub struct FcSubscription {
+    id: u64,
+}
+
+impl Drop for FcSubscription {
+    fn drop(&mut self) {
+        let id = self.id;
+        FcLockSubscribers().list.retain(|(i, _)| *i != id);
+    }
+}
+
+// calls the subscribers outside of the lock, so that they can unsubscribe
+fn FcNotify(old: Option<&FcFontCache>, new: &FcFontCache) {
+    let subscribers = FcLockSubscribers().list.iter().map(|(_, s)| s.clone()).collect::<Vec<_>>();
+    if subscribers.is_empty() {
+        return;
+    }
+    let diff = match old {
+        Some(old) => old.diff(new),
+        None => FcFontCache::default().diff(new),
+    };
+    for subscriber in subscribers {
+        subscriber(&diff);
+    }
+}
+
+// a panicking builder must not poison the state for everyone else
+fn FcLockState() -> MutexGuard<'static, FcGlobalState> {
+    STATE.lock().unwrap_or_else(|e| e.into_inner())
+}
+
+// marks the build as done on drop, also if the builder panics
+struct FcBuildGuard;
+
+impl Drop for FcBuildGuard {
+    fn drop(&mut self) {
+        let mut state = FcLockState();
+        state.building = false;
+        BUILD_DONE.notify_all();
+    }
+}
+
+// runs a build on the calling thread, the lock is released while building
+fn FcRunBuild(mut state: MutexGuard<'static, FcGlobalState>) -> MutexGuard<'static, FcGlobalState> {
+
+    state.building = true;
+    state.started += 1;
+    let number = state.started;
+    let builder = state.builder.clone();
+    drop(state);
+
+    let guard = FcBuildGuard;
+    let cache = Arc::new(match builder {
+        Some(b) => b(),
+        None => FcFontCache::build(),
+    });
+
+    let mut state = FcLockState();
+    let old = state.cache.replace(cache.clone());
+    state.built = number;
+    drop(state);
+    // still `building`, so the next build can't notify before this one
+    FcNotify(old.as_deref(), &cache);
+    drop(guard);
+    FcLockState()
+}
+
+impl FcFontCache {
+
+    /// Returns the process-wide cache, building it on the first call
+    ///
+    /// Concurrent first callers wait for a single build. Use this instead
+    /// of `build()` in libraries, so that a process only scans its fonts
+    /// once.
+    pub fn global() -> Arc<FcFontCache> {
+        let mut state = FcLockState();
+        loop {
+            if let Some(cache) = state.cache.as_ref() {
+                return cache.clone();
+            }
+            state = if state.building {
+                BUILD_DONE.wait(state).unwrap_or_else(|e| e.into_inner())
+            } else {
+                FcRunBuild(state)
+            };
+        }
+    }
+
+    /// Rescans the fonts and replaces the process-wide cache, returning
+    /// the new one
+    ///
+    /// The returned cache was built after this call started. If a build is
+    /// already running, this waits for it and then runs one more build,
+    /// shared with all other `refresh_global()` calls that arrived in the
+    /// meantime. Caches returned earlier stay valid.
+    pub fn refresh_global() -> Arc<FcFontCache> {
+        let mut state = FcLockState();
+        // the next build that starts
+        let target = state.started + 1;
+        loop {
+            if state.built >= target {
+                if let Some(cache) = state.cache.as_ref() {
+                    return cache.clone();
+                }
+            }
+            state = if state.building {
+                BUILD_DONE.wait(state).unwrap_or_else(|e| e.into_inner())
+            } else {
+                FcRunBuild(state)
+            };
+        }
+    }
+
+    /// Returns the generation of the process-wide cache, or 0 if it
+    /// wasn't built yet - does not build it
+    pub fn global_generation() -> u64 {
+        FcLockState().cache.as_ref().map(|c| c.generation()).unwrap_or(0)
+    }
+
+    /// Sets the function that builds the process-wide cache (default:
+    /// `FcFontCache::build`), for example to use `build_from_directories`
+    ///
+    /// Takes effect on the next build, call it before the first `global()`.
+    pub fn set_global_builder<F>(builder: F)
+    where F: Fn() -> FcFontCache + Send + Sync + 'static
+    {
+        FcLockState().builder = Some(Arc::new(builder));
+    }
+
+    /// Same as `set_global_builder()`, but keeps a builder that was set
+    /// before - returns whether `builder` was installed
+    ///
+    /// For libraries that bring a default builder, without overriding the
+    /// one the application chose.
+    pub fn set_default_global_builder<F>(builder: F) -> bool
+    where F: Fn() -> FcFontCache + Send + Sync + 'static
+    {
+        let mut state = FcLockState();
+        if state.builder.is_some() {
+            return false;
+        }
+        state.builder = Some(Arc::new(builder));
+        true
+    }
+
+    /// Calls `callback` with the added and removed faces after every build
+    /// of the process-wide cache, until the subscription is dropped
+    ///
+    /// The first build reports all faces as added (`from_generation` 0).
+    /// Callbacks run on the building thread, in build order, before
+    /// `global()` / `refresh_global()` return from that build. They must
+    /// not call `refresh_global()`.
+    pub fn subscribe_global<F>(callback: F) -> FcSubscription
+    where F: Fn(&FcCacheDiff) + Send + Sync + 'static
+    {
+        let mut subscribers = FcLockSubscribers();
+        let id = subscribers.next_id;
+        subscribers.next_id += 1;
+        subscribers.list.push((id, Arc::new(callback)));
+        FcSubscription { id }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::{FcFontPath, FcPattern};
+    use std::sync::Barrier;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::thread;
+    use std::time::Duration;
+
+    // the process-wide cache is shared by all tests
+    static TEST_LOCK: Mutex<()> = Mutex::new(());
+
+    fn lock() -> MutexGuard<'static, ()> {
+        let guard = TEST_LOCK.lock().unwrap_or_else(|e| e.into_inner());
+        let mut state = FcLockState();
+        state.cache = None;
+        state.builder = None;
+        guard
+    }
+
+    fn cache(fonts: usize) -> FcFontCache {
+        (0..fonts).map(|i| (FcPattern {
+            name: Some(format!("Font {}", i)),
+            .. Default::default()
+        }, FcFontPath { path: format!("/fonts/{}.ttf", i), .. Default::default() })).collect()
+    }
+
+    #[test]
+    fn concurrent_first_calls_share_one_build() {
+
+        let _lock = lock();
+        static BUILDS: AtomicUsize = AtomicUsize::new(0);
+        BUILDS.store(0, Ordering::SeqCst);
+        FcFontCache::set_global_builder(|| {
+            BUILDS.fetch_add(1, Ordering::SeqCst);
+            thread::sleep(Duration::from_millis(50));
+            cache(3)
+        });
+        assert_eq!(FcFontCache::global_generation(), 0);
+
+        let barrier = Arc::new(Barrier::new(8));
+        let threads = (0..8).map(|_| {
+            let barrier = barrier.clone();
+            thread::spawn(move || {
+                barrier.wait();
+                FcFontCache::global()
+            })
+        }).collect::<Vec<_>>();
+        let caches = threads.into_iter().map(|t| t.join().unwrap()).collect::<Vec<_>>();
+
+        assert_eq!(BUILDS.load(Ordering::SeqCst), 1);
+        assert!(caches.iter().all(|c| Arc::ptr_eq(c, &caches[0])));
+        assert_eq!(caches[0].list().len(), 3);
+        assert_eq!(FcFontCache::global_generation(), caches[0].generation());
+
+        // later calls don't build again
+        assert!(Arc::ptr_eq(&FcFontCache::global(), &caches[0]));
+        assert_eq!(BUILDS.load(Ordering::SeqCst), 1);
+    }
+
+    #[test]
+    fn refreshes_during_a_build_are_coalesced() {
+
+        let _lock = lock();
+        static BUILDS: AtomicUsize = AtomicUsize::new(0);
+        static WAITING: AtomicUsize = AtomicUsize::new(0);
+        BUILDS.store(0, Ordering::SeqCst);
+        WAITING.store(0, Ordering::SeqCst);
+        FcFontCache::set_global_builder(|| {
+            let build = BUILDS.fetch_add(1, Ordering::SeqCst);
+            if build == 0 {
+                // keep the first build running until the others called refresh_global()
+                while WAITING.load(Ordering::SeqCst) < 4 {
+                    thread::yield_now();
+                }
+                thread::sleep(Duration::from_millis(100));
+            }
+            cache(build + 1)
+        });
+
+        let first = thread::spawn(FcFontCache::refresh_global);
+        while BUILDS.load(Ordering::SeqCst) == 0 {
+            thread::yield_now();
+        }
+        let waiting = (0..4).map(|_| thread::spawn(|| {
+            WAITING.fetch_add(1, Ordering::SeqCst);
+            FcFontCache::refresh_global()
+        })).collect::<Vec<_>>();
+
+        let first = first.join().unwrap();
+        let refreshed = waiting.into_iter().map(|t| t.join().unwrap()).collect::<Vec<_>>();
+
+        // the running build didn't count for them, they shared one more
+        assert_eq!(BUILDS.load(Ordering::SeqCst), 2);
+        assert_eq!(refreshed[0].list().len(), 2);
+        assert!(refreshed.iter().all(|c| Arc::ptr_eq(c, &refreshed[0])));
+        // the first caller gets the first build or, if it finished already, the second
+        assert!(first.list().len() == 1 || Arc::ptr_eq(&first, &refreshed[0]));
+        assert!(Arc::ptr_eq(&FcFontCache::global(), &refreshed[0]));
+    }
+
+    #[test]
+    fn subscribers_see_every_build() {
+
+        let _lock = lock();
+        static BUILDS: AtomicUsize = AtomicUsize::new(0);
+        BUILDS.store(0, Ordering::SeqCst);
+        FcFontCache::set_global_builder(|| cache(2 + BUILDS.fetch_add(1, Ordering::SeqCst)));
+
+        let diffs = Arc::new(Mutex::new(Vec::new()));
+        let subscription = {
+            let diffs = diffs.clone();
+            FcFontCache::subscribe_global(move |diff| diffs.lock().unwrap().push(diff.clone()))
+        };
+
+        let first = FcFontCache::global();
+        let second = FcFontCache::refresh_global();
+        drop(subscription);
+        FcFontCache::refresh_global();
+
+        let diffs = diffs.lock().unwrap();
+        assert_eq!(diffs.len(), 2);
+        assert_eq!((diffs[0].added.len(), diffs[0].removed.len()), (2, 0));
+        assert_eq!(diffs[1].from_generation, first.generation());
+        assert_eq!(diffs[1].to_generation, second.generation());
+        assert_eq!((diffs[1].added.len(), diffs[1].removed.len()), (1, 0));
+    }
+
+    #[test]
+    fn default_builders_keep_the_chosen_one() {
+
+        let _lock = lock();
+        assert!(FcFontCache::set_default_global_builder(|| cache(1)));
+        assert!(!FcFontCache::set_default_global_builder(|| cache(2)));
+        assert_eq!(FcFontCache::refresh_global().list().len(), 1);
+
+        FcFontCache::set_global_builder(|| cache(3));
+        assert!(!FcFontCache::set_default_global_builder(|| cache(4)));
+        assert_eq!(FcFontCache::refresh_global().list().len(), 3);
+    }
+}
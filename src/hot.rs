@@ -0,0 +1,392 @@
+//! Popularity-adaptive front cache for `FcFontCache::query`, see
+//! `FcFontCache::set_hot_cache()`
+//!
+//! Real traffic asks for the same few fonts over and over, but a query
+//! for a popular family late in the `FcPattern` order still walks all the
+//! fonts before it. Reordering the fonts would change which font is the
+//! "first match", so instead the queries themselves are tracked: every
+//! `SAMPLE_RATE`th query that misses the table (counted per thread)
+//! increments a shared counter for the hash of its pattern. A pattern
+//! whose counter reaches `PROMOTE_AT` is promoted into a small
+//! direct-mapped table, together with the position (see `FcEntries`) of
+//! the font that `query()` returned for it - later queries for the pattern
+//! are answered from there, without looking at the fonts at all. Every
+//! thread halves all counters after `AGE_INTERVAL` of its own samples, so
+//! patterns that are no longer popular get replaced.
+//!
+//! The table is cleared whenever the fonts or indexes change, so a cached
+//! result is always the one `query()` would return.
+//!
+//! Hits don't take a lock and don't write to shared memory, so threads
+//! asking for the same popular fonts don't bounce cache lines between
+//! cores: each slot stores the parts of the pattern that `query()` looks
+//! at (name, family and style mask) inline and is guarded by a sequence
+//! number (a seqlock). Hits are not counted either, only misses write to
+//! the shared counters - 1 in `SAMPLE_RATE` of them, one atomic add each.
+//! Promotions are serialized by a mutex, a thread that finds it taken
+//! skips the promotion instead of waiting. Patterns whose name and family
+//! don't fit into a slot are never cached.
+
+use crate::{FcFontCache, FcFontPath, FcHashStr, FcPattern};
+use core::cell::Cell;
+use core::fmt;
+use core::mem;
+use core::sync::atomic::{fence, AtomicU32, AtomicU64, Ordering};
+use std::sync::Mutex;
+
+const SAMPLE_RATE: u32 = 16;
+// ~ PROMOTE_AT * SAMPLE_RATE queries
+const PROMOTE_AT: u32 = 4;
+const COUNTERS: usize = 4096;
+const AGE_INTERVAL: u64 = 16 * 1024;
+// name and family of a slot, padded to 8 bytes each
+const KEY_WORDS: usize = 20;
+// `FcHotSlot::style` of an unused slot
+const EMPTY: u32 = u32::MAX;
+// `FcHotSlot::result` of a pattern without a matching font
+const NO_RESULT: u32 = u32::MAX;
+
+pub(crate) struct FcHotCache {
+    capacity: usize,
+    // sampled query counts by pattern hash
+    counters: Box<[AtomicU32]>,
+    // direct-mapped by pattern hash, length is a power of two
+    slots: Box<[FcHotSlot]>,
+    // held while writing a slot
+    writer: Mutex<()>,
+}
+
+// Readers load `sequence`, the fields and `sequence` again, and only use
+// the fields if the sequence was even and didn't change in between
+#[repr(align(64))]
+struct FcHotSlot {
+    // odd while the slot is being written
+    sequence: AtomicU64,
+    hash: AtomicU64,
+    // `FcHotKey::style`, EMPTY if the slot is unused
+    style: AtomicU32,
+    // `FcHotKey::lengths()`
+    lengths: AtomicU32,
+    // position of the result in `FcFontCache::entries`, or NO_RESULT
+    result: AtomicU32,
+    // `FcHotKey::words()`
+    words: [AtomicU64;KEY_WORDS],
+}
+
+// The parts of a pattern that `query()` looks at
+struct FcHotKey<'a> {
+    name: Option<&'a str>,
+    family: Option<&'a str>,
+    // `FcPattern::style_mask()` as `mask << 16 | value`
+    style: u32,
+}
+
+impl<'a> FcHotKey<'a> {
+
+    // None if the name and family don't fit into a slot
+    fn new(pattern: &'a FcPattern) -> Option<Self> {
+        let (mask, value) = pattern.style_mask();
+        let key = FcHotKey {
+            name: pattern.name.as_deref(),
+            family: pattern.family.as_deref(),
+            style: (mask as u32) << 16 | value as u32,
+        };
+        if FcWords(key.name) + FcWords(key.family) > KEY_WORDS {
+            return None;
+        }
+        Some(key)
+    }
+
+    fn hash(&self) -> u64 {
+        let name = self.name.map(FcHashStr).unwrap_or(0);
+        let family = self.family.map(FcHashStr).unwrap_or(0);
+        (name ^ family.rotate_left(21) ^ (self.style as u64).rotate_left(42)).wrapping_mul(0x9e37_79b9_7f4a_7c15)
+    }
+
+    // length + 1 of the name and the family (0 = None), 16 bits each
+    fn lengths(&self) -> u32 {
+        let length = |s: Option<&str>| s.map(|s| s.len() as u32 + 1).unwrap_or(0);
+        length(self.name) | length(self.family) << 16
+    }
+
+    // the name, then the family, each zero-padded to whole words
+    fn words(&self) -> impl Iterator<Item = u64> + 'a {
+        let words = |s: Option<&'a str>| s.map(|s| s.as_bytes()).unwrap_or(&[]).chunks(8).map(FcWord);
+        words(self.name).chain(words(self.family))
+    }
+}
+
+impl FcHotCache {
+
+    pub(crate) fn new(capacity: usize) -> Self {
+        let slots = (capacity.max(1) * 2).next_power_of_two();
+        FcHotCache {
+            capacity,
+            counters: (0..COUNTERS).map(|_| AtomicU32::new(0)).collect(),
+            slots: (0..slots).map(|_| FcHotSlot::new()).collect(),
+            writer: Mutex::new(()),
+        }
+    }
+
+    pub(crate) fn capacity(&self) -> usize {
+        self.capacity
+    }
+
+    /// Estimated heap size in bytes
+    pub(crate) fn bytes(&self) -> usize {
+        self.counters.len() * mem::size_of::<AtomicU32>() +
+        self.slots.len() * mem::size_of::<FcHotSlot>()
+    }
+
+    fn entries(&self) -> usize {
+        self.slots.iter().filter(|s| s.style.load(Ordering::Relaxed) != EMPTY).count()
+    }
+
+    pub(crate) fn query<'a>(&self, cache: &'a FcFontCache, pattern: &FcPattern) -> Option<(&'a FcPattern, &'a FcFontPath)> {
+
+        #[cfg(feature = "instrumentation")]
+        let start = std::time::Instant::now();
+
+        let key = match FcHotKey::new(pattern) {
+            Some(s) => s,
+            None => return cache.query_uncached(pattern),
+        };
+        let hash = key.hash();
+        let slot = &self.slots[hash as usize & (self.slots.len() - 1)];
+
+        if let Some(result) = slot.get(hash, &key) {
+            let result = result.map(|i| cache.entries.get(i as usize));
+            #[cfg(feature = "instrumentation")]
+            crate::instrumentation::record(
+                crate::instrumentation::FcQueryApi::Query, start, 1,
+                crate::instrumentation::FcQueryPath::Hot, result.is_some(),
+            );
+            return result;
+        }
+
+        let result = cache.query_position(pattern);
+
+        if let Some(age) = FcSampleThisQuery() {
+            if self.count(hash, age) >= PROMOTE_AT {
+                self.promote(slot, hash, &key, result.map(|i| i as u32));
+            }
+        }
+
+        result.map(|i| cache.entries.get(i))
+    }
+
+    fn counter(&self, hash: u64) -> &AtomicU32 {
+        &self.counters[(hash >> 32) as usize % self.counters.len()]
+    }
+
+    // sampled count of the pattern hash, after incrementing it - halves
+    // all counters first if `age`
+    fn count(&self, hash: u64, age: bool) -> u32 {
+
+        if age {
+            for c in self.counters.iter() {
+                c.store(c.load(Ordering::Relaxed) / 2, Ordering::Relaxed);
+            }
+        }
+
+        self.counter(hash).fetch_add(1, Ordering::Relaxed) + 1
+    }
+
+    fn promote(&self, slot: &FcHotSlot, hash: u64, key: &FcHotKey, result: Option<u32>) {
+
+        // another thread is promoting, this pattern will be sampled again
+        let _writer = match self.writer.try_lock() {
+            Ok(o) => o,
+            Err(_) => return,
+        };
+
+        // keep the current entry if it is queried more often
+        if slot.style.load(Ordering::Relaxed) != EMPTY {
+            let current = slot.hash.load(Ordering::Relaxed);
+            let current_count = self.counter(current).load(Ordering::Relaxed);
+            let new_count = self.counter(hash).load(Ordering::Relaxed);
+            if current == hash || current_count > new_count {
+                return;
+            }
+        }
+
+        slot.set(hash, key, result);
+    }
+}
+
+impl FcHotSlot {
+
+    fn new() -> Self {
+        FcHotSlot {
+            sequence: AtomicU64::new(0),
+            hash: AtomicU64::new(0),
+            style: AtomicU32::new(EMPTY),
+            lengths: AtomicU32::new(0),
+            result: AtomicU32::new(NO_RESULT),
+            words: Default::default(),
+        }
+    }
+
+    // Some(result) if the slot holds the key
+    #[inline]
+    fn get(&self, hash: u64, key: &FcHotKey) -> Option<Option<u32>> {
+
+        let sequence = self.sequence.load(Ordering::Acquire);
+        if sequence & 1 != 0 {
+            return None;
+        }
+
+        let found =
+            self.hash.load(Ordering::Relaxed) == hash &&
+            self.style.load(Ordering::Relaxed) == key.style &&
+            self.lengths.load(Ordering::Relaxed) == key.lengths() &&
+            key.words().zip(self.words.iter()).all(|(k, w)| w.load(Ordering::Relaxed) == k);
+        let result = self.result.load(Ordering::Relaxed);
+
+        // the loads above happen before the second load of the sequence
+        fence(Ordering::Acquire);
+        if !found || self.sequence.load(Ordering::Relaxed) != sequence {
+            return None;
+        }
+
+        Some(if result == NO_RESULT { None } else { Some(result) })
+    }
+
+    // only called with `FcHotCache::writer` locked
+    fn set(&self, hash: u64, key: &FcHotKey, result: Option<u32>) {
+
+        let sequence = self.sequence.load(Ordering::Relaxed);
+        self.sequence.store(sequence.wrapping_add(1), Ordering::Relaxed);
+        // the odd sequence is visible before any of the stores below
+        fence(Ordering::Release);
+
+        self.hash.store(hash, Ordering::Relaxed);
+        self.style.store(key.style, Ordering::Relaxed);
+        self.lengths.store(key.lengths(), Ordering::Relaxed);
+        self.result.store(result.unwrap_or(NO_RESULT), Ordering::Relaxed);
+        for (w, k) in self.words.iter().zip(key.words()) {
+            w.store(k, Ordering::Relaxed);
+        }
+
+        self.sequence.store(sequence.wrapping_add(2), Ordering::Release);
+    }
+}
+
+// an empty cache with the same capacity
+impl Clone for FcHotCache {
+    fn clone(&self) -> Self {
+        FcHotCache::new(self.capacity)
+    }
+}
+
+impl fmt::Debug for FcHotCache {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.debug_struct("FcHotCache")
+        .field("capacity", &self.capacity)
+        .field("slots", &self.slots.len())
+        .field("entries", &self.entries())
+        .finish()
+    }
+}
+
+// number of slot words a string takes up
+fn FcWords(s: Option<&str>) -> usize {
+    s.map(|s| (s.len() + 7) / 8).unwrap_or(0)
+}
+
+// up to 8 bytes, zero-padded
+fn FcWord(bytes: &[u8]) -> u64 {
+    let mut word = [0;8];
+    word[..bytes.len()].copy_from_slice(bytes);
+    u64::from_le_bytes(word)
+}
+
+// Some for every SAMPLE_RATEth query of the calling thread, Some(true)
+// for every AGE_INTERVALth of these
+fn FcSampleThisQuery() -> Option<bool> {
+    thread_local! {
+        static TICK: Cell<u64> = Cell::new(0);
+    }
+    TICK.with(|t| {
+        let tick = t.get().wrapping_add(1);
+        t.set(tick);
+        if tick % SAMPLE_RATE as u64 != 0 {
+            return None;
+        }
+        Some((tick / SAMPLE_RATE as u64) % AGE_INTERVAL == 0)
+    })
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::PatternMatch;
+    use std::sync::Arc;
+
+    fn cache() -> FcFontCache {
+        (0..200).map(|i| (FcPattern {
+            name: Some(format!("Font {}", i)),
+            family: Some(format!("Family {}", i % 10)),
+            bold: if i % 2 == 0 { PatternMatch::True } else { PatternMatch::False },
+            italic: if i % 3 == 0 { PatternMatch::True } else { PatternMatch::False },
+            .. Default::default()
+        }, FcFontPath { path: format!("/fonts/{}.ttf", i), .. Default::default() })).collect()
+    }
+
+    // hits, misses, patterns that only differ in properties `query()`
+    // ignores, and names too long for a slot
+    fn patterns() -> Vec<FcPattern> {
+        let mut patterns = Vec::new();
+        for i in 0..12 {
+            patterns.push(FcPattern { family: Some(format!("Family {}", i)), bold: PatternMatch::True, .. Default::default() });
+            patterns.push(FcPattern { family: Some(format!("Family {}", i)), bold: PatternMatch::True, weight: 700, .. Default::default() });
+            patterns.push(FcPattern { family: Some(format!("Family {}", i)), italic: PatternMatch::True, bold: PatternMatch::False, .. Default::default() });
+            patterns.push(FcPattern { name: Some(format!("Font {}", i * 17)), .. Default::default() });
+        }
+        patterns.push(FcPattern { name: Some("x".repeat(KEY_WORDS * 8 + 1)), .. Default::default() });
+        patterns.push(FcPattern { italic: PatternMatch::True, .. Default::default() });
+        patterns
+    }
+
+    #[test]
+    fn results_match_uncached_queries() {
+
+        let mut cache = cache();
+        cache.set_hot_cache(Some(8));
+        let cache = Arc::new(cache);
+        let patterns = Arc::new(patterns());
+
+        let threads = (0..4).map(|t| {
+            let cache = cache.clone();
+            let patterns = patterns.clone();
+            std::thread::spawn(move || {
+                for i in 0..20_000 {
+                    let pattern = &patterns[(i * (t + 1)) % patterns.len()];
+                    assert_eq!(cache.query(pattern), cache.query_uncached(pattern).map(|(_, v)| v), "{:?}", pattern);
+                }
+            })
+        }).collect::<Vec<_>>();
+
+        for t in threads {
+            t.join().unwrap();
+        }
+
+        assert!(cache.hot.as_ref().unwrap().entries() > 0);
+    }
+
+    #[test]
+    fn keys() {
+        let a = FcPattern { name: Some(String::from("A")), bold: PatternMatch::True, weight: 400, .. Default::default() };
+        let b = FcPattern { weight: 700, condensed: PatternMatch::True, .. a.clone() };
+        let c = FcPattern { name: None, family: Some(String::from("A")), .. a.clone() };
+        let (a, b, c) = (FcHotKey::new(&a).unwrap(), FcHotKey::new(&b).unwrap(), FcHotKey::new(&c).unwrap());
+        // weight and condensed don't change the result of a query
+        assert_eq!(a.hash(), b.hash());
+        assert_eq!(a.lengths(), b.lengths());
+        assert_ne!(a.lengths(), c.lengths());
+        assert_eq!(a.words().collect::<Vec<_>>(), c.words().collect::<Vec<_>>());
+        let long = FcPattern { name: Some("x".repeat(KEY_WORDS * 4)), family: Some("y".repeat(KEY_WORDS * 4 + 1)), .. Default::default() };
+        assert!(FcHotKey::new(&long).is_none());
+    }
+}
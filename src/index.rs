@@ -0,0 +1,229 @@
+//! Optional lookup index of the `FcFontCache`
+//!
+//! Maps font names and family names to the fonts that have them, so
+//! that queries with a name or family only have to look at a handful of
+//! candidates instead of scanning all fonts. Candidates are stored as
+//! positions in the cache (see `FcEntries`), in the order of the cache, so
+//! that "first match" stays the same with or without index. The index
+//! duplicates each name and family string once - it is the first thing
+//! dropped when a memory budget is exceeded.
+//!
+//! Each name and family gets an id (its position in `lists`), and each
+//! candidate list also stores the packed style bits and the id of the
+//! other string (family for the name index and vice versa), so that
+//! compiled queries can check candidates without comparing strings.
+
+use alloc::collections::btree_map::BTreeMap;
+use alloc::string::{String, ToString};
+use alloc::vec::Vec;
+use core::fmt;
+use core::mem;
+use core::ptr::NonNull;
+use crate::{FcFontPath, FcPattern, FcPatternFields};
+
+/// Id of a missing name / family in `FcCandidates::other_ids`
+pub(crate) const NO_ID: u32 = u32::MAX;
+
+// None = index was dropped to save memory
+#[derive(Debug, Default, Clone, PartialEq, Eq, PartialOrd, Ord)]
+pub(crate) struct FcFontIndex {
+    pub(crate) by_name: Option<FcStringIndex>,
+    pub(crate) by_family: Option<FcStringIndex>,
+    // `FcPattern::style_bits` of all fonts, in cache order
+    pub(crate) style_bits: Vec<u16>,
+}
+
+// Name or family -> fonts
+#[derive(Debug, Default, Clone, PartialEq, Eq, PartialOrd, Ord)]
+pub(crate) struct FcStringIndex {
+    ids: BTreeMap<String, u32>,
+    pub(crate) lists: Vec<FcCandidates>,
+}
+
+// Fonts with the same name or family, in cache order
+#[derive(Debug, Default, Clone, PartialEq, Eq, PartialOrd, Ord)]
+pub(crate) struct FcCandidates {
+    // positions in `FcEntries`
+    pub(crate) positions: Vec<u32>,
+    pub(crate) style_bits: Vec<u16>,
+    pub(crate) other_ids: Vec<u32>,
+}
+
+impl FcStringIndex {
+
+    pub(crate) fn id(&self, s: &str) -> Option<u32> {
+        self.ids.get(s).copied()
+    }
+
+    fn get(&self, s: &str) -> Option<&FcCandidates> {
+        self.ids.get(s).map(|id| &self.lists[*id as usize])
+    }
+
+    fn intern(&mut self, s: &str) -> u32 {
+        if let Some(id) = self.ids.get(s) {
+            return *id;
+        }
+        let id = self.lists.len() as u32;
+        self.ids.insert(s.to_string(), id);
+        self.lists.push(FcCandidates::default());
+        id
+    }
+
+    fn bytes(&self) -> usize {
+        FcBTreeMapBytes::<String, u32>(self.ids.len()) +
+        self.ids.keys().map(|k| k.capacity()).sum::<usize>() +
+        self.lists.capacity() * mem::size_of::<FcCandidates>() +
+        self.lists.iter().map(|l| {
+            l.positions.capacity() * mem::size_of::<u32>() +
+            l.style_bits.capacity() * mem::size_of::<u16>() +
+            l.other_ids.capacity() * mem::size_of::<u32>()
+        }).sum::<usize>()
+    }
+}
+
+impl FcFontIndex {
+
+    pub(crate) fn new(map: &BTreeMap<FcPattern, FcFontPath>) -> Self {
+
+        let mut by_name = FcStringIndex::default();
+        let mut by_family = FcStringIndex::default();
+        let mut style_bits = Vec::with_capacity(map.len());
+
+        for (position, pattern) in map.keys().enumerate() {
+
+            let position = position as u32;
+
+            let bits = pattern.style_bits();
+            style_bits.push(bits);
+
+            let name_id = pattern.name.as_ref().map(|n| by_name.intern(n)).unwrap_or(NO_ID);
+            let family_id = pattern.family.as_ref().map(|f| by_family.intern(f)).unwrap_or(NO_ID);
+
+            if name_id != NO_ID {
+                let list = &mut by_name.lists[name_id as usize];
+                list.positions.push(position);
+                list.style_bits.push(bits);
+                list.other_ids.push(family_id);
+            }
+
+            if family_id != NO_ID {
+                let list = &mut by_family.lists[family_id as usize];
+                list.positions.push(position);
+                list.style_bits.push(bits);
+                list.other_ids.push(name_id);
+            }
+        }
+
+        FcFontIndex {
+            by_name: Some(by_name),
+            by_family: Some(by_family),
+            style_bits,
+        }
+    }
+
+    pub(crate) fn is_empty(&self) -> bool {
+        self.by_name.is_none() && self.by_family.is_none()
+    }
+
+    /// Returns the positions of the candidates for the name / family of the
+    /// pattern (empty if there is no such name or family), or `None` if
+    /// the pattern has neither a name nor a family
+    pub(crate) fn candidates<P: FcPatternFields>(&self, pattern: &P) -> Option<&[u32]> {
+
+        const NONE: &[u32] = &[];
+        let (name, family) = (pattern.query_name(), pattern.query_family());
+
+        let by_name = match (name, self.by_name.as_ref()) {
+            (Some(n), Some(index)) => Some(index.get(n).map(|l| l.positions.as_slice()).unwrap_or(NONE)),
+            _ => None,
+        };
+
+        let by_family = match (family, self.by_family.as_ref()) {
+            (Some(f), Some(index)) => Some(index.get(f).map(|l| l.positions.as_slice()).unwrap_or(NONE)),
+            _ => None,
+        };
+
+        match (by_name, by_family) {
+            (Some(a), Some(b)) => Some(if a.len() <= b.len() { a } else { b }),
+            (a, b) => a.or(b),
+        }
+    }
+
+    /// Estimated heap size of the name index (including the style bits of
+    /// all fonts, which are dropped together with it) in bytes
+    pub(crate) fn name_index_bytes(&self) -> usize {
+        self.by_name.as_ref().map(|i| i.bytes()).unwrap_or(0) +
+        self.style_bits.capacity() * mem::size_of::<u16>()
+    }
+
+    /// Estimated heap size of the family index in bytes
+    pub(crate) fn family_index_bytes(&self) -> usize {
+        self.by_family.as_ref().map(|i| i.bytes()).unwrap_or(0)
+    }
+}
+
+// Pointers to the entries of the `font -> file` map, in map order, so that
+// the index and the scan can refer to a font by its position instead of
+// storing a clone of its pattern. Entries of a B-tree don't move as long
+// as the map isn't modified - `FcFontCache` rebuilds this after every
+// change of its map and for every clone.
+#[derive(Default)]
+pub(crate) struct FcEntries(Vec<(NonNull<FcPattern>, NonNull<FcFontPath>)>);
+
+// only hands out shared references into a map of Send + Sync values
+unsafe impl Send for FcEntries { }
+unsafe impl Sync for FcEntries { }
+
+impl FcEntries {
+
+    pub(crate) fn new(map: &BTreeMap<FcPattern, FcFontPath>) -> Self {
+        FcEntries(map.iter().map(|(k, v)| (NonNull::from(k), NonNull::from(v))).collect())
+    }
+
+    pub(crate) fn len(&self) -> usize {
+        self.0.len()
+    }
+
+    #[inline]
+    pub(crate) fn get(&self, position: usize) -> (&FcPattern, &FcFontPath) {
+        let (k, v) = self.0[position];
+        // the map is owned by the same cache and not modified while the
+        // cache is borrowed, see above
+        unsafe { (k.as_ref(), v.as_ref()) }
+    }
+
+    /// Estimated heap size in bytes
+    pub(crate) fn bytes(&self) -> usize {
+        self.0.capacity() * mem::size_of::<(NonNull<FcPattern>, NonNull<FcFontPath>)>()
+    }
+}
+
+impl fmt::Debug for FcEntries {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.debug_tuple("FcEntries").field(&self.0.len()).finish()
+    }
+}
+
+/// Heap bytes used by the strings of a pattern
+pub(crate) fn FcPatternStringBytes(pattern: &FcPattern) -> usize {
+    pattern.name.as_ref().map(|s| s.capacity()).unwrap_or(0) +
+    pattern.family.as_ref().map(|s| s.capacity()).unwrap_or(0)
+}
+
+// B-tree nodes hold up to 11 entries and are 2/3 full on average
+// (std::collections::BTreeMap with B = 6)
+const BTREE_NODE_CAPACITY: usize = 11;
+const BTREE_AVERAGE_FILL: usize = 8;
+const BTREE_NODE_HEADER: usize = 16;
+
+/// Estimated size of all B-tree nodes (entries included) of a map with `len` entries
+pub(crate) fn FcBTreeMapBytes<K, V>(len: usize) -> usize {
+    if len == 0 {
+        return 0;
+    }
+    let leaves = (len + BTREE_AVERAGE_FILL - 1) / BTREE_AVERAGE_FILL;
+    let internal = (leaves + BTREE_AVERAGE_FILL - 1) / BTREE_AVERAGE_FILL;
+    let leaf_size = BTREE_NODE_HEADER + BTREE_NODE_CAPACITY * (mem::size_of::<K>() + mem::size_of::<V>());
+    let internal_size = leaf_size + (BTREE_NODE_CAPACITY + 1) * mem::size_of::<usize>();
+    leaves * leaf_size + internal * internal_size
+}
@@ -0,0 +1,288 @@
+//! Query instrumentation (only available with the `instrumentation` feature)
+//!
+//! Records latency histograms, candidate set sizes, the lookup path and
+//! the hit rate of every query API. Every thread has its own counters
+//! (summed up by `snapshot()`), so recording never takes a lock and
+//! threads never write to the same cache lines.
+//! Without the feature, none of this code is compiled in.
+//!
+//! ```rust
+//! let stats = rust_fontconfig::instrumentation::snapshot();
+//! for api in stats.apis.iter() {
+//!     println!("{:?}: {} calls, p99 = {:?}", api.api, api.calls, api.latency_percentile(0.99));
+//! }
+//! ```
+
+use std::sync::{Arc, Mutex, MutexGuard};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+/// Number of latency buckets: bucket `i` counts latencies in `[2^(i-1), 2^i)` ns
+pub const LATENCY_BUCKETS: usize = 40;
+
+/// Public lookup API that is being measured
+#[derive(Debug, Copy, Clone, PartialEq, Eq, PartialOrd, Ord, Hash)]
+#[repr(C)]
+pub enum FcQueryApi {
+    /// `FcFontCache::query`
+    Query,
+    /// `FcFontCache::query_compiled`
+    QueryCompiled,
+    /// `FcFontCache::query_ref` and `FcFontCache::query_str`
+    QueryRef,
+}
+
+impl FcQueryApi {
+    const ALL: [FcQueryApi;3] = [FcQueryApi::Query, FcQueryApi::QueryCompiled, FcQueryApi::QueryRef];
+}
+
+/// How a query found its candidates
+#[derive(Debug, Copy, Clone, PartialEq, Eq, PartialOrd, Ord, Hash)]
+#[repr(C)]
+pub enum FcQueryPath {
+    /// Candidates came from an index
+    Index,
+    /// All fonts were scanned
+    Scan,
+    /// Result came from the hot-query cache, see `FcFontCache::set_hot_cache`
+    Hot,
+}
+
+/// Statistics of a single query API, see `snapshot()`
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct FcApiStats {
+    pub api: FcQueryApi,
+    /// Number of calls
+    pub calls: u64,
+    /// Number of calls that returned a font
+    pub found: u64,
+    /// Number of calls that were answered from an index
+    pub index_path: u64,
+    /// Number of calls that had to scan all fonts
+    pub scan_path: u64,
+    /// Number of calls that were answered from the hot-query cache
+    pub hot_path: u64,
+    /// Sum of the number of candidates that were inspected
+    pub candidates_total: u64,
+    /// Largest number of candidates a single call inspected
+    pub candidates_max: u64,
+    /// Latency histogram, see `LATENCY_BUCKETS`
+    pub latency_histogram: [u64;LATENCY_BUCKETS],
+}
+
+impl FcApiStats {
+
+    /// Ratio of calls that returned a font
+    pub fn hit_rate(&self) -> f64 {
+        if self.calls == 0 { 0.0 } else { self.found as f64 / self.calls as f64 }
+    }
+
+    /// Average number of candidates inspected per call
+    pub fn mean_candidates(&self) -> f64 {
+        if self.calls == 0 { 0.0 } else { self.candidates_total as f64 / self.calls as f64 }
+    }
+
+    /// Upper bound of the latency below which `p` (0.0 - 1.0) of all calls finished
+    pub fn latency_percentile(&self, p: f64) -> Duration {
+        let total = self.latency_histogram.iter().sum::<u64>();
+        if total == 0 {
+            return Duration::from_nanos(0);
+        }
+        let target = ((total as f64 * p).ceil() as u64).max(1);
+        let mut seen = 0;
+        for (bucket, count) in self.latency_histogram.iter().enumerate() {
+            seen += count;
+            if seen >= target {
+                return Duration::from_nanos(1_u64 << bucket);
+            }
+        }
+        Duration::from_nanos(1_u64 << (LATENCY_BUCKETS - 1))
+    }
+}
+
+/// Point-in-time copy of all query statistics
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct FcQueryStats {
+    pub apis: Vec<FcApiStats>,
+}
+
+impl FcQueryStats {
+    /// Returns the statistics of a single API
+    pub fn get(&self, api: FcQueryApi) -> Option<&FcApiStats> {
+        self.apis.iter().find(|s| s.api == api)
+    }
+}
+
+/// Sums up the counters of all threads
+pub fn snapshot() -> FcQueryStats {
+    let threads = FcLockThreads();
+    FcQueryStats {
+        apis: FcQueryApi::ALL.iter().map(|api| {
+            let mut stats = FcApiStats {
+                api: *api,
+                calls: 0,
+                found: 0,
+                index_path: 0,
+                scan_path: 0,
+                hot_path: 0,
+                candidates_total: 0,
+                candidates_max: 0,
+                latency_histogram: [0;LATENCY_BUCKETS],
+            };
+            for counters in threads.iter().map(|t| &**t).chain(Some(&EXITED)) {
+                let c = &counters.apis[*api as usize];
+                stats.calls += c.calls.load(Ordering::Relaxed);
+                stats.found += c.found.load(Ordering::Relaxed);
+                stats.index_path += c.index_path.load(Ordering::Relaxed);
+                stats.scan_path += c.scan_path.load(Ordering::Relaxed);
+                stats.hot_path += c.hot_path.load(Ordering::Relaxed);
+                stats.candidates_total += c.candidates_total.load(Ordering::Relaxed);
+                stats.candidates_max = stats.candidates_max.max(c.candidates_max.load(Ordering::Relaxed));
+                for (h, b) in stats.latency_histogram.iter_mut().zip(c.latency_histogram.iter()) {
+                    *h += b.load(Ordering::Relaxed);
+                }
+            }
+            stats
+        }).collect()
+    }
+}
+
+/// Resets all counters to zero
+pub fn reset() {
+    let threads = FcLockThreads();
+    for counters in threads.iter().map(|t| &**t).chain(Some(&EXITED)) {
+        for c in counters.apis.iter() {
+            c.calls.store(0, Ordering::Relaxed);
+            c.found.store(0, Ordering::Relaxed);
+            c.index_path.store(0, Ordering::Relaxed);
+            c.scan_path.store(0, Ordering::Relaxed);
+            c.hot_path.store(0, Ordering::Relaxed);
+            c.candidates_total.store(0, Ordering::Relaxed);
+            c.candidates_max.store(0, Ordering::Relaxed);
+            for b in c.latency_histogram.iter() {
+                b.store(0, Ordering::Relaxed);
+            }
+        }
+    }
+}
+
+// Records a single call - called by the query functions
+pub(crate) fn record(api: FcQueryApi, start: Instant, candidates: usize, path: FcQueryPath, found: bool) {
+
+    let nanos = start.elapsed().as_nanos().min(u64::MAX as u128) as u64;
+    let bucket = ((64 - nanos.leading_zeros()) as usize).min(LATENCY_BUCKETS - 1);
+    let candidates = candidates as u64;
+
+    // only this thread writes to its counters, so the atomics are
+    // uncontended - they are only atomic because `snapshot()` reads them
+    let recorded = THREAD_COUNTERS.try_with(|t| t.0.apis[api as usize].add(bucket, candidates, path, found));
+    // the thread is exiting and its counters were already dropped
+    if recorded.is_err() {
+        EXITED.apis[api as usize].add(bucket, candidates, path, found);
+    }
+}
+
+impl FcApiCounters {
+
+    fn add(&self, bucket: usize, candidates: u64, path: FcQueryPath, found: bool) {
+        self.calls.fetch_add(1, Ordering::Relaxed);
+        if found {
+            self.found.fetch_add(1, Ordering::Relaxed);
+        }
+        match path {
+            FcQueryPath::Index => self.index_path.fetch_add(1, Ordering::Relaxed),
+            FcQueryPath::Scan => self.scan_path.fetch_add(1, Ordering::Relaxed),
+            FcQueryPath::Hot => self.hot_path.fetch_add(1, Ordering::Relaxed),
+        };
+        self.candidates_total.fetch_add(candidates, Ordering::Relaxed);
+        self.candidates_max.fetch_max(candidates, Ordering::Relaxed);
+        self.latency_histogram[bucket].fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn add_all(&self, other: &FcApiCounters) {
+        self.calls.fetch_add(other.calls.load(Ordering::Relaxed), Ordering::Relaxed);
+        self.found.fetch_add(other.found.load(Ordering::Relaxed), Ordering::Relaxed);
+        self.index_path.fetch_add(other.index_path.load(Ordering::Relaxed), Ordering::Relaxed);
+        self.scan_path.fetch_add(other.scan_path.load(Ordering::Relaxed), Ordering::Relaxed);
+        self.hot_path.fetch_add(other.hot_path.load(Ordering::Relaxed), Ordering::Relaxed);
+        self.candidates_total.fetch_add(other.candidates_total.load(Ordering::Relaxed), Ordering::Relaxed);
+        self.candidates_max.fetch_max(other.candidates_max.load(Ordering::Relaxed), Ordering::Relaxed);
+        for (a, b) in self.latency_histogram.iter().zip(other.latency_histogram.iter()) {
+            a.fetch_add(b.load(Ordering::Relaxed), Ordering::Relaxed);
+        }
+    }
+}
+
+// counters of the running threads that recorded a query
+static THREADS: Mutex<Vec<Arc<FcCounterSet>>> = Mutex::new(Vec::new());
+
+// sum of the counters of all threads that exited
+static EXITED: FcCounterSet = ZERO_SET;
+
+thread_local! {
+    static THREAD_COUNTERS: FcThreadCounters = FcThreadCounters::register();
+}
+
+fn FcLockThreads() -> MutexGuard<'static, Vec<Arc<FcCounterSet>>> {
+    THREADS.lock().unwrap_or_else(|e| e.into_inner())
+}
+
+// counters of the current thread, registered on the first query
+struct FcThreadCounters(Arc<FcCounterSet>);
+
+impl FcThreadCounters {
+    fn register() -> Self {
+        let counters = Arc::new(ZERO_SET);
+        FcLockThreads().push(counters.clone());
+        FcThreadCounters(counters)
+    }
+}
+
+impl Drop for FcThreadCounters {
+    // under the lock, so that `snapshot()` counts the thread exactly once
+    fn drop(&mut self) {
+        let mut threads = FcLockThreads();
+        for (exited, c) in EXITED.apis.iter().zip(self.0.apis.iter()) {
+            exited.add_all(c);
+        }
+        threads.retain(|t| !Arc::ptr_eq(t, &self.0));
+    }
+}
+
+struct FcApiCounters {
+    calls: AtomicU64,
+    found: AtomicU64,
+    index_path: AtomicU64,
+    scan_path: AtomicU64,
+    hot_path: AtomicU64,
+    candidates_total: AtomicU64,
+    candidates_max: AtomicU64,
+    latency_histogram: [AtomicU64;LATENCY_BUCKETS],
+}
+
+// aligned to a cache line, so that threads don't share cache lines
+#[repr(align(64))]
+struct FcCounterSet {
+    apis: [FcApiCounters;FcQueryApi::ALL.len()],
+}
+
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO: AtomicU64 = AtomicU64::new(0);
+
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO_COUNTERS: FcApiCounters = FcApiCounters {
+    calls: ZERO,
+    found: ZERO,
+    index_path: ZERO,
+    scan_path: ZERO,
+    hot_path: ZERO,
+    candidates_total: ZERO,
+    candidates_max: ZERO,
+    latency_histogram: [ZERO;LATENCY_BUCKETS],
+};
+
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO_SET: FcCounterSet = FcCounterSet {
+    apis: [ZERO_COUNTERS;FcQueryApi::ALL.len()],
+};
+
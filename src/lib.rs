@@ -28,10 +28,60 @@ extern crate allsorts_no_std;
 extern crate core;
 extern crate alloc;
 
+#[cfg(feature = "instrumentation")]
+pub mod instrumentation;
+#[cfg(feature = "std")]
+pub mod trace;
+#[cfg(feature = "corpus")]
+pub mod corpus;
+#[cfg(feature = "std")]
+pub mod querylog;
+#[cfg(feature = "std")]
+pub mod compact;
+#[cfg(feature = "std")]
+mod streaming;
+#[cfg(feature = "std")]
+pub mod explain;
+pub mod compiled;
+pub mod parse;
+pub mod changes;
+#[cfg(feature = "ffi")]
+pub mod ffi;
+#[cfg(feature = "std")]
+mod hot;
+#[cfg(feature = "std")]
+mod global;
+
+#[cfg(feature = "std")]
+pub use trace::FcTraceRecorder;
+#[cfg(feature = "std")]
+pub use compact::FcCompactCache;
+#[cfg(feature = "std")]
+pub use explain::FcQueryExplanation;
+#[cfg(feature = "std")]
+pub use global::FcSubscription;
+pub use compiled::FcCompiledQuery;
+pub use parse::{FcPatternRef, FcPatternError};
+pub use changes::{FcCacheDiff, FcFace, FcFaceFingerprint};
+
 #[cfg(feature = "std")]
 use std::path::PathBuf;
+#[cfg(feature = "std")]
+use alloc::collections::BTreeSet;
+#[cfg(feature = "std")]
+use std::time::{Duration, Instant};
+#[cfg(feature = "std")]
+use std::sync::Mutex;
+#[cfg(feature = "std")]
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering as AtomicOrdering};
 use alloc::string::String;
+use alloc::vec::Vec;
 use alloc::collections::btree_map::BTreeMap;
+use core::mem;
+use index::{FcEntries, FcFontIndex, FcBTreeMapBytes, FcPatternStringBytes};
+
+mod index;
+mod scan;
 
 #[derive(Debug, Clone, PartialOrd, Ord, PartialEq, Eq)]
 #[repr(C)]
@@ -49,6 +99,32 @@ impl PatternMatch {
             PatternMatch::DontCare => None,
         }
     }
+
+    // True: font has to be True, False: font must not be False
+    fn matches(&self, font: &PatternMatch) -> bool {
+        match self.into_option() {
+            Some(m) => (font == self) == m,
+            None => true,
+        }
+    }
+
+    // 2-bit encoding for the index and the on-disk formats
+    fn to_bits(&self) -> u16 {
+        match self {
+            PatternMatch::True => 1,
+            PatternMatch::False => 2,
+            PatternMatch::DontCare => 0,
+        }
+    }
+
+    #[cfg(feature = "std")]
+    fn from_bits(bits: u16) -> Self {
+        match bits & 0b11 {
+            1 => PatternMatch::True,
+            2 => PatternMatch::False,
+            _ => PatternMatch::DontCare,
+        }
+    }
 }
 
 impl Default for PatternMatch {
@@ -80,45 +156,512 @@ pub struct FcPattern {
     pub unicode_range: [usize;2],
 }
 
-#[derive(Debug, Clone, PartialOrd, Ord, PartialEq, Eq)]
+impl FcPattern {
+
+    // italic, oblique, bold, monospace and condensed, 2 bits each
+    fn style_bits(&self) -> u16 {
+        self.italic.to_bits() |
+        self.oblique.to_bits() << 2 |
+        self.bold.to_bits() << 4 |
+        self.monospace.to_bits() << 6 |
+        self.condensed.to_bits() << 8
+    }
+
+    // (mask, value) so that a font matches the italic, oblique, bold and
+    // monospace properties of this pattern if `font_bits & mask == value`:
+    // True has to be exactly 0b01, False must not be 0b10, DontCare is ignored
+    fn style_mask(&self) -> (u16, u16) {
+        [&self.italic, &self.oblique, &self.bold, &self.monospace]
+        .iter()
+        .enumerate()
+        .fold((0, 0), |(mask, value), (i, m)| {
+            let (m, v) = match m {
+                PatternMatch::True => (0b11, 0b01),
+                PatternMatch::False => (0b10, 0b00),
+                PatternMatch::DontCare => (0b00, 0b00),
+            };
+            (mask | m << (i * 2), value | v << (i * 2))
+        })
+    }
+
+    #[cfg(feature = "std")]
+    fn set_style_bits(&mut self, bits: u16) {
+        self.italic = PatternMatch::from_bits(bits);
+        self.oblique = PatternMatch::from_bits(bits >> 2);
+        self.bold = PatternMatch::from_bits(bits >> 4);
+        self.monospace = PatternMatch::from_bits(bits >> 6);
+        self.condensed = PatternMatch::from_bits(bits >> 8);
+    }
+
+    // same as `accepts`, but for packed style bits (see `style_bits`),
+    // name and family are not checked
+    #[cfg(feature = "std")]
+    fn style_matches(&self, font_style_bits: u16) -> bool {
+        self.italic.matches(&PatternMatch::from_bits(font_style_bits)) &&
+        self.oblique.matches(&PatternMatch::from_bits(font_style_bits >> 2)) &&
+        self.bold.matches(&PatternMatch::from_bits(font_style_bits >> 4)) &&
+        self.monospace.matches(&PatternMatch::from_bits(font_style_bits >> 6))
+    }
+
+}
+
+// The fields of a pattern that `FcFontCache::query` looks at, so that
+// `FcPattern` and the borrowed `FcPatternRef` share the matching and the
+// index / scan dispatch (`FcFontCache::query_position`)
+pub(crate) trait FcPatternFields {
+
+    fn query_name(&self) -> Option<&str>;
+    fn query_family(&self) -> Option<&str>;
+    // italic, oblique, bold and monospace
+    fn query_style(&self) -> [&PatternMatch;4];
+
+    // API that queries for this kind of pattern are recorded as
+    #[cfg(feature = "instrumentation")]
+    const API: instrumentation::FcQueryApi;
+
+    // whether `font` is a result for this pattern in `FcFontCache::query`
+    // (condensed, weight and unicode range are not checked)
+    #[inline]
+    fn accepts(&self, font: &FcPattern) -> bool {
+        self.reject_reason(font).is_none()
+    }
+
+    // first property of `font` that doesn't match, `None` = `font` matches
+    #[inline]
+    fn reject_reason(&self, font: &FcPattern) -> Option<FcRejectReason> {
+        let [italic, oblique, bold, monospace] = self.query_style();
+        if self.query_name().map(|n| font.name.as_deref() != Some(n)).unwrap_or(false) {
+            Some(FcRejectReason::Name)
+        } else if self.query_family().map(|f| font.family.as_deref() != Some(f)).unwrap_or(false) {
+            Some(FcRejectReason::Family)
+        } else if !italic.matches(&font.italic) {
+            Some(FcRejectReason::Italic)
+        } else if !oblique.matches(&font.oblique) {
+            Some(FcRejectReason::Oblique)
+        } else if !bold.matches(&font.bold) {
+            Some(FcRejectReason::Bold)
+        } else if !monospace.matches(&font.monospace) {
+            Some(FcRejectReason::Monospace)
+        } else {
+            None
+        }
+    }
+}
+
+impl FcPatternFields for FcPattern {
+
+    #[inline]
+    fn query_name(&self) -> Option<&str> {
+        self.name.as_deref()
+    }
+
+    #[inline]
+    fn query_family(&self) -> Option<&str> {
+        self.family.as_deref()
+    }
+
+    #[inline]
+    fn query_style(&self) -> [&PatternMatch;4] {
+        [&self.italic, &self.oblique, &self.bold, &self.monospace]
+    }
+
+    #[cfg(feature = "instrumentation")]
+    const API: instrumentation::FcQueryApi = instrumentation::FcQueryApi::Query;
+}
+
+/// Property of a font that doesn't match a `FcPattern`, see `FcFontCache::explain()`
+#[derive(Debug, Copy, Clone, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub enum FcRejectReason {
+    Name,
+    Family,
+    Italic,
+    Oblique,
+    Bold,
+    Monospace,
+}
+
+// 0 is the generation of `FcFontCache::default()`
+fn FcNextGeneration() -> u64 {
+    use core::sync::atomic::{AtomicU64, Ordering};
+    static NEXT_GENERATION: AtomicU64 = AtomicU64::new(1);
+    NEXT_GENERATION.fetch_add(1, Ordering::Relaxed)
+}
+
+// 64-bit FNV-1a, stable across runs and platforms (unlike `DefaultHasher`)
+#[cfg(feature = "std")]
+pub(crate) fn FcHashStr(s: &str) -> u64 {
+    FcHashBytes(FNV_OFFSET, s.as_bytes())
+}
+
+pub(crate) const FNV_OFFSET: u64 = 0xcbf2_9ce4_8422_2325;
+
+// continues an FNV-1a hash, start with `FNV_OFFSET`
+pub(crate) fn FcHashBytes(mut hash: u64, bytes: &[u8]) -> u64 {
+    for b in bytes {
+        hash ^= *b as u64;
+        hash = hash.wrapping_mul(0x0000_0100_0000_01b3);
+    }
+    hash
+}
+
+#[derive(Debug, Default, Clone, PartialOrd, Ord, PartialEq, Eq)]
 #[repr(C)]
 pub struct FcFontPath {
     pub path: String,
     pub font_index: usize,
+    /// Of the file when it was parsed, zero if unknown
+    pub stamp: FcFileStamp,
 }
 
-#[derive(Debug, Default, Clone, PartialOrd, Ord, PartialEq, Eq)]
+/// Size and modification time of a font file, so that a file that was
+/// replaced in place doesn't look like the one that was parsed
+#[derive(Debug, Default, Copy, Clone, PartialOrd, Ord, PartialEq, Eq, Hash)]
+#[repr(C)]
+pub struct FcFileStamp {
+    /// File size in bytes
+    pub size: u64,
+    /// Last modification in nanoseconds since the Unix epoch
+    pub modified: u64,
+}
+
+#[cfg(feature = "std")]
+impl FcFileStamp {
+    /// Stamp of a file, zero if its metadata can't be read
+    pub fn of(file: &std::fs::File) -> Self {
+        let metadata = match file.metadata() {
+            Ok(o) => o,
+            Err(_) => return FcFileStamp::default(),
+        };
+        let modified = metadata.modified().ok()
+            .and_then(|t| t.duration_since(std::time::UNIX_EPOCH).ok())
+            .map(|d| d.as_nanos().min(u64::MAX as u128) as u64)
+            .unwrap_or(0);
+        FcFileStamp { size: metadata.len(), modified }
+    }
+}
+
+#[derive(Debug, Default)]
 pub struct FcFontCache {
-    map: BTreeMap<FcPattern, FcFontPath>
+    map: BTreeMap<FcPattern, FcFontPath>,
+    // entries of `map` by position, rebuilt whenever `map` changes
+    entries: FcEntries,
+    // optional, only speeds up queries, see `set_memory_budget`
+    index: Option<FcFontIndex>,
+    memory_budget: Option<usize>,
+    // changes whenever the fonts or the index change, see `generation()`
+    generation: u64,
+    // results of frequent queries, see `set_hot_cache`
+    #[cfg(feature = "std")]
+    hot: Option<hot::FcHotCache>,
+}
+
+// `entries` point into the map of the cache they were built for
+impl Clone for FcFontCache {
+    fn clone(&self) -> Self {
+        let map = self.map.clone();
+        FcFontCache {
+            entries: FcEntries::new(&map),
+            map,
+            index: self.index.clone(),
+            memory_budget: self.memory_budget,
+            generation: self.generation,
+            #[cfg(feature = "std")]
+            hot: self.hot.clone(),
+        }
+    }
+}
+
+// two caches are equal if they contain the same fonts, regardless of indexes
+
+impl PartialEq for FcFontCache {
+    fn eq(&self, other: &Self) -> bool {
+        self.map == other.map
+    }
+}
+
+impl Eq for FcFontCache { }
+
+impl PartialOrd for FcFontCache {
+    fn partial_cmp(&self, other: &Self) -> Option<core::cmp::Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl Ord for FcFontCache {
+    fn cmp(&self, other: &Self) -> core::cmp::Ordering {
+        self.map.cmp(&other.map)
+    }
+}
+
+/// Estimated memory usage of a `FcFontCache` in bytes, see `FcFontCache::memory_usage()`
+#[derive(Debug, Default, Copy, Clone, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub struct FcMemoryUsage {
+    /// Font names, family names and file paths
+    pub strings: usize,
+    /// `FcPattern` + `FcFontPath` records
+    pub faces: usize,
+    /// B-tree nodes of the `font -> file` map (without the records) and the table of its entries
+    pub map_nodes: usize,
+    /// Font name -> fonts index
+    pub name_index: usize,
+    /// Family name -> fonts index
+    pub family_index: usize,
+    /// Hot-query cache, see `FcFontCache::set_hot_cache()`
+    pub hot_cache: usize,
+}
+
+impl FcMemoryUsage {
+    /// Sum of all components
+    pub fn total(&self) -> usize {
+        self.strings + self.faces + self.map_nodes + self.name_index + self.family_index + self.hot_cache
+    }
+
+    /// Sum of all components that can't be dropped
+    pub fn required(&self) -> usize {
+        self.strings + self.faces + self.map_nodes
+    }
 }
 
 impl FcFontCache {
 
+    // builds the index, unless that would exceed the memory budget
+    fn from_map(map: BTreeMap<FcPattern, FcFontPath>) -> Self {
+        let mut cache = FcFontCache {
+            entries: FcEntries::new(&map),
+            map,
+            index: None,
+            memory_budget: None,
+            generation: 0,
+            #[cfg(feature = "std")]
+            hot: None,
+        };
+        cache.rebuild_index();
+        cache
+    }
+
+    fn rebuild_index(&mut self) {
+        self.entries = FcEntries::new(&self.map);
+        self.index = Some(FcFontIndex::new(&self.map));
+        // cached results may be stale
+        #[cfg(feature = "std")] {
+            self.hot = self.hot.as_ref().map(|h| hot::FcHotCache::new(h.capacity()));
+        }
+        self.enforce_memory_budget();
+        self.generation = FcNextGeneration();
+    }
+
+    /// Returns the generation of this cache
+    ///
+    /// Every build and every change of the fonts or indexes gets a new,
+    /// process-wide unique generation. Clones keep the generation, so equal
+    /// generations mean identical fonts and indexes.
+    pub fn generation(&self) -> u64 {
+        self.generation
+    }
+
+    fn enforce_memory_budget(&mut self) {
+
+        let budget = match self.memory_budget {
+            Some(s) => s,
+            None => return,
+        };
+
+        // family lookups have more candidates than name lookups,
+        // so the family index is less useful and is dropped first
+        if self.memory_usage().total() > budget {
+            if let Some(index) = self.index.as_mut() {
+                index.by_family = None;
+            }
+        }
+
+        if self.memory_usage().total() > budget {
+            self.index = None;
+        }
+    }
+
+    /// Returns an estimate of the memory used by this cache, per component
+    pub fn memory_usage(&self) -> FcMemoryUsage {
+
+        let entry_size = mem::size_of::<FcPattern>() + mem::size_of::<FcFontPath>();
+        let faces = self.map.len() * entry_size;
+
+        FcMemoryUsage {
+            strings: self.map.iter().map(|(k, v)| FcPatternStringBytes(k) + v.path.capacity()).sum(),
+            faces,
+            map_nodes: FcBTreeMapBytes::<FcPattern, FcFontPath>(self.map.len()).saturating_sub(faces) +
+                self.entries.bytes(),
+            name_index: self.index.as_ref().map(|i| i.name_index_bytes()).unwrap_or(0),
+            family_index: self.index.as_ref().map(|i| i.family_index_bytes()).unwrap_or(0),
+            #[cfg(feature = "std")]
+            hot_cache: self.hot.as_ref().map(|h| h.bytes()).unwrap_or(0),
+            #[cfg(not(feature = "std"))]
+            hot_cache: 0,
+        }
+    }
+
+    /// Limits the memory used by this cache to about `budget` bytes
+    ///
+    /// If the cache would exceed the budget, first the family index and then
+    /// the name index are dropped (queries then fall back to scanning all
+    /// fonts). The fonts
+    /// themselves are never dropped, so the budget can still be exceeded.
+    /// `None` removes the budget and rebuilds the indexes.
+    pub fn set_memory_budget(&mut self, budget: Option<usize>) {
+        self.memory_budget = budget;
+        self.rebuild_index();
+    }
+
+    /// Enables a cache for the results of frequently repeated queries
+    ///
+    /// Queries are sampled, and patterns that are queried often are
+    /// remembered together with their result (up to about `capacity`
+    /// patterns), so that repeating them is a single hash lookup instead of
+    /// an index probe or a scan. Results are always the same as without the
+    /// cache. `None` disables it.
+    #[cfg(feature = "std")]
+    pub fn set_hot_cache(&mut self, capacity: Option<usize>) {
+        self.hot = capacity.map(hot::FcHotCache::new);
+    }
+
+    /// Returns whether queries for names or families use an index
+    pub fn has_index(&self) -> bool {
+        self.index.as_ref().map(|i| !i.is_empty()).unwrap_or(false)
+    }
+
     /// Builds a new font cache from all fonts discovered on the system
     ///
     /// NOTE: Performance-intensive, should only be called on startup!
     #[cfg(feature = "std")]
     pub fn build() -> Self {
+        FcFontCache::from_map(FcScanDirectoriesInner(&FcFontDirectories(), &FcBuildHooks::default()).into_iter().collect())
+    }
 
-        #[cfg(target_os = "linux")] {
-            FcFontCache {
-                map: FcScanDirectories().unwrap_or_default().into_iter().collect()
+    /// Same as `build()`, but additionally returns a `FcBuildReport` with
+    /// timings and counters for each phase of the build, including the
+    /// `slowest_files` files that took the longest to parse
+    ///
+    /// Use this to find out why building the cache is slow on a given
+    /// system - `build()` itself does not collect any statistics.
+    #[cfg(feature = "std")]
+    pub fn build_with_report(slowest_files: usize) -> (Self, FcBuildReport) {
+
+        let collector = FcBuildReportCollector::new(slowest_files);
+        let hooks = FcBuildHooks { report: Some(&collector), .. Default::default() };
+
+        let config_start = Instant::now();
+        let dirs = FcFontDirectories();
+        let walk_start = Instant::now();
+        let files_to_parse = FcCollectFontFiles(&dirs, &hooks);
+        let parse_start = Instant::now();
+        let fonts = FcParseFontFiles(&files_to_parse, &hooks);
+        let index_start = Instant::now();
+        let cache = FcFontCache::from_map(fonts.into_iter().collect());
+        let index_end = Instant::now();
+
+        let mut report = collector.into_report();
+        report.config_parsing = walk_start - config_start;
+        report.directory_walking = parse_start - walk_start;
+        report.indexing = index_end - index_start;
+
+        (cache, report)
+    }
+
+    /// Builds a new font cache from all fonts in the given directories
+    /// (and their subdirectories), ignoring the system configuration
+    #[cfg(feature = "std")]
+    pub fn build_from_directories(dirs: &[PathBuf]) -> Self {
+        FcFontCache::from_map(FcScanDirectoriesInner(dirs, &FcBuildHooks::default()).into_iter().collect())
+    }
+
+    /// Same as `build()`, but records every directory walk and every parsed
+    /// font file into the `recorder`, see `FcTraceRecorder::write_chrome_trace()`
+    #[cfg(feature = "std")]
+    pub fn build_with_trace(recorder: &FcTraceRecorder) -> Self {
+        let hooks = FcBuildHooks { trace: Some(recorder), .. Default::default() };
+        FcFontCache::from_map(FcScanDirectoriesInner(&FcFontDirectories(), &hooks).into_iter().collect())
+    }
+
+    /// Same as `build()`, but hands each batch of parsed fonts to the
+    /// `callback` as soon as it is available, so that a UI can be filled
+    /// progressively
+    ///
+    /// Font files are parsed in parallel in batches of `batch_size` files
+    /// (larger batches = less overhead, smaller batches = lower latency).
+    /// If the callback returns `false`, the scan stops early and the cache
+    /// only contains the fonts that were discovered up to that point.
+    #[cfg(feature = "std")]
+    pub fn build_with_callback<F>(batch_size: usize, mut callback: F) -> Self
+    where F: FnMut(&[(FcPattern, FcFontPath)]) -> bool
+    {
+        let hooks = FcBuildHooks::default();
+        let batch_size = batch_size.max(1);
+        let mut map = BTreeMap::new();
+        // the walk is interleaved with parsing, so the first batch doesn't
+        // have to wait until all directories have been read
+        let mut walk = FcDirectoryWalk::new(FcFontDirectories());
+        let mut files_to_parse = Vec::new();
+
+        loop {
+            if files_to_parse.len() < batch_size && !walk.is_finished() {
+                walk.read_next(&mut files_to_parse, &hooks);
+                continue;
+            }
+            if files_to_parse.is_empty() {
+                break;
+            }
+            let batch = files_to_parse.len().min(batch_size);
+            let fonts = FcParseFontFiles(&files_to_parse[..batch], &hooks);
+            files_to_parse.drain(..batch);
+            let continue_scan = callback(&fonts);
+            map.extend(fonts);
+            if !continue_scan {
+                break;
             }
         }
 
-        #[cfg(target_os = "windows")] {
-            FcFontCache {
-                map: FcScanSingleDirectoryRecursive(PathBuf::from("C:\\Windows\\Fonts\\"))
-                .into_iter().collect()
+        FcFontCache::from_map(map)
+    }
+
+    /// Builds as much of the font cache as possible within `timeout`
+    ///
+    /// Directories are scanned in priority order (user fonts first, then
+    /// the configured system directories). If the deadline expires before
+    /// all fonts are parsed, the partial cache is returned together with a
+    /// `FcBuildContinuation`, which finishes the scan on a background
+    /// thread and can later be merged into the cache.
+    #[cfg(feature = "std")]
+    pub fn build_with_deadline(timeout: Duration) -> (Self, Option<FcBuildContinuation>) {
+
+        let deadline = Instant::now() + timeout;
+        let hooks = FcBuildHooks::default();
+        let batch_size = rayon::current_num_threads().max(1) * 2;
+        let mut map = BTreeMap::new();
+        // the deadline is checked after every directory and every batch,
+        // so a large directory tree can't exceed it
+        let mut walk = FcDirectoryWalk::new(FcFontDirectoriesByPriority());
+        let mut files_to_parse = Vec::new();
+
+        while Instant::now() < deadline {
+            if files_to_parse.len() < batch_size && !walk.is_finished() {
+                walk.read_next(&mut files_to_parse, &hooks);
+            } else if files_to_parse.is_empty() {
+                return (FcFontCache::from_map(map), None);
+            } else {
+                let batch = files_to_parse.len().min(batch_size);
+                map.extend(FcParseFontFiles(&files_to_parse[..batch], &hooks));
+                files_to_parse.drain(..batch);
             }
         }
 
-        #[cfg(target_os = "macos")] {
-            FcFontCache {
-                map: FcScanSingleDirectoryRecursive(PathBuf::from("~/Library/Fonts"))
-                .into_iter().collect()
+        let handle = std::thread::spawn(move || {
+            let hooks = FcBuildHooks::default();
+            while !walk.is_finished() {
+                walk.read_next(&mut files_to_parse, &hooks);
             }
-        }
+            FcParseFontFiles(&files_to_parse, &hooks)
+        });
+
+        (FcFontCache::from_map(map), Some(FcBuildContinuation { handle }))
     }
 
     /// Returns the list of fonts and font patterns
@@ -126,74 +669,309 @@ impl FcFontCache {
         &self.map
     }
 
+    /// Queries the `patterns` in order and returns the first font found,
+    /// e.g. for a CSS `font-family` fallback list
+    ///
+    /// NOTE: Does not allocate, same as `query()`
+    pub fn query_stack(&self, patterns: &[FcPattern]) -> Option<&FcFontPath> {
+        patterns.iter().find_map(|p| self.query(p))
+    }
+
+    /// Returns all fonts that match the pattern, in the order in which
+    /// `query()` considers them (so the first one is the result of `query()`)
+    pub fn query_all(&self, pattern: &FcPattern) -> Vec<(&FcPattern, &FcFontPath)> {
+        match self.index.as_ref().and_then(|index| index.candidates(pattern)) {
+            Some(index_candidates) => {
+                index_candidates
+                .iter()
+                .map(|p| self.entries.get(*p as usize))
+                .filter(|(k, _)| pattern.accepts(k))
+                .collect()
+            },
+            None => {
+                self.map
+                .iter()
+                .filter(|(k, _)| pattern.accepts(k))
+                .collect()
+            },
+        }
+    }
+
     /// Queries a font from the in-memory `font -> file` mapping
+    ///
+    /// NOTE: Does not allocate - this is checked by `tests/alloc_free.rs`,
+    /// keep it that way when changing the matching code. This includes the
+    /// hot-query cache, which only writes to slots that already exist.
     pub fn query(&self, pattern: &FcPattern) -> Option<&FcFontPath> {
+        self.query_entry(pattern).map(|(_, v)| v)
+    }
 
-        let name_needs_to_match = pattern.name.is_some();
-        let family_needs_to_match = pattern.family.is_some();
-
-        let italic_needs_to_match = pattern.italic.into_option();
-        let oblique_needs_to_match = pattern.oblique.into_option();
-        let bold_needs_to_match = pattern.bold.into_option();
-        let monospace_needs_to_match = pattern.monospace.into_option();
-
-        let result1 = self.map
-        .iter() // TODO: par_iter!
-        .find(|(k, _)| {
-            let name_matches = k.name == pattern.name;
-            let family_matches = k.family == pattern.family;
-            let italic_matches = k.italic == pattern.italic;
-            let oblique_matches = k.oblique == pattern.oblique;
-            let bold_matches = k.bold == pattern.bold;
-            let monospace_matches = k.monospace == pattern.monospace;
-
-            if name_needs_to_match && !name_matches {
-                return false;
+    /// Same as `query()`, but also returns the pattern of the font
+    pub fn query_entry(&self, pattern: &FcPattern) -> Option<(&FcPattern, &FcFontPath)> {
+        #[cfg(feature = "std")] {
+            if let Some(hot) = self.hot.as_ref() {
+                return hot.query(self, pattern);
             }
+        }
+        self.query_uncached(pattern)
+    }
 
-            if family_needs_to_match && !family_matches {
-                return false;
-            }
+    // `query()` without the hot-query cache
+    pub(crate) fn query_uncached(&self, pattern: &FcPattern) -> Option<(&FcPattern, &FcFontPath)> {
+        self.query_position(pattern).map(|i| self.entries.get(i))
+    }
 
-            if let Some(italic_m) = italic_needs_to_match {
-                if italic_matches != italic_m {
-                    return false;
-                }
-            }
+    // position of the result of `query_uncached()` (or `query_ref()`) in `entries`
+    pub(crate) fn query_position<P: FcPatternFields + Sync>(&self, pattern: &P) -> Option<usize> {
 
+        #[cfg(feature = "instrumentation")]
+        let start = Instant::now();
 
-            if let Some(oblique_m) = oblique_needs_to_match {
-                if oblique_matches != oblique_m {
-                    return false;
-                }
-            }
+        // with a name or family, only look at the fonts that have it
+        let index_candidates = self.index.as_ref().and_then(|index| index.candidates(pattern));
+        #[cfg(feature = "instrumentation")]
+        let used_index = index_candidates.is_some();
 
+        let (result1, candidates) = match index_candidates {
+            Some(index_candidates) => {
+                let found = index_candidates.iter().position(|p| pattern.accepts(self.entries.get(*p as usize).0));
+                let candidates = found.map(|i| i + 1).unwrap_or(index_candidates.len());
+                (found.map(|i| index_candidates[i] as usize), candidates)
+            },
+            // parallel for large caches, see `scan`
+            None => self.scan_positions(|i| pattern.accepts(self.entries.get(i).0)),
+        };
 
-            if let Some(bold_m) = bold_needs_to_match {
-                if bold_matches != bold_m {
-                    return false;
-                }
-            }
+        #[cfg(feature = "instrumentation")] {
+            use crate::instrumentation::FcQueryPath;
+            let path = if used_index { FcQueryPath::Index } else { FcQueryPath::Scan };
+            crate::instrumentation::record(P::API, start, candidates, path, result1.is_some());
+        }
+        #[cfg(not(feature = "instrumentation"))]
+        let _ = candidates;
 
-            if let Some(monospace_m) = monospace_needs_to_match {
-                if monospace_matches != monospace_m {
-                    return false;
-                }
-            }
+        result1
+    }
+}
 
-            true
-        });
+/// Timings and counters collected by `FcFontCache::build_with_report()`
+#[cfg(feature = "std")]
+#[derive(Debug, Default, Clone, PartialEq, Eq)]
+pub struct FcBuildReport {
+    /// Time spent finding the font directories (parsing fonts.conf)
+    pub config_parsing: Duration,
+    /// Time spent walking the font directories
+    pub directory_walking: Duration,
+    /// Time spent parsing font files
+    pub file_parsing: Duration,
+    /// Time spent merging the per-file results
+    pub merging: Duration,
+    /// Time spent building the final font -> file mapping
+    pub indexing: Duration,
+    /// Number of directories that were walked
+    pub directories: usize,
+    /// Number of files that were found
+    pub files: usize,
+    /// Number of files that were not recognized as fonts
+    pub rejected_files: usize,
+    /// Number of font files that could not be parsed
+    pub parse_failures: usize,
+    /// Number of font faces that were found
+    pub faces: usize,
+    /// Number of bytes that were memory-mapped for parsing
+    pub bytes_mapped: u64,
+    /// Files that took the longest to parse, slowest first
+    pub slowest_files: Vec<(PathBuf, Duration)>,
+}
+
+// Optional callbacks into the build pipeline - everything is None
+// for a regular `build()`, so that it doesn't pay for any statistics
+#[cfg(feature = "std")]
+#[derive(Default)]
+struct FcBuildHooks<'a> {
+    report: Option<&'a FcBuildReportCollector>,
+    trace: Option<&'a FcTraceRecorder>,
+}
+
+// Thread-safe accumulator for a FcBuildReport
+#[cfg(feature = "std")]
+struct FcBuildReportCollector {
+    file_parsing_ns: AtomicU64,
+    merging_ns: AtomicU64,
+    directories: AtomicUsize,
+    files: AtomicUsize,
+    rejected_files: AtomicUsize,
+    parse_failures: AtomicUsize,
+    faces: AtomicUsize,
+    bytes_mapped: AtomicU64,
+    max_slowest_files: usize,
+    slowest_files: Mutex<Vec<(PathBuf, Duration)>>,
+}
+
+#[cfg(feature = "std")]
+impl FcBuildReportCollector {
+
+    fn new(max_slowest_files: usize) -> Self {
+        FcBuildReportCollector {
+            file_parsing_ns: AtomicU64::new(0),
+            merging_ns: AtomicU64::new(0),
+            directories: AtomicUsize::new(0),
+            files: AtomicUsize::new(0),
+            rejected_files: AtomicUsize::new(0),
+            parse_failures: AtomicUsize::new(0),
+            faces: AtomicUsize::new(0),
+            bytes_mapped: AtomicU64::new(0),
+            max_slowest_files,
+            slowest_files: Mutex::new(Vec::with_capacity(max_slowest_files + 1)),
+        }
+    }
+
+    fn add_time(&self, counter: &AtomicU64, time: Duration) {
+        counter.fetch_add(time.as_nanos() as u64, AtomicOrdering::Relaxed);
+    }
+
+    fn record_file(&self, file: &PathBuf, time: Duration, progress: &FcParseProgress, success: bool) {
+
+        self.bytes_mapped.fetch_add(progress.bytes_mapped, AtomicOrdering::Relaxed);
+
+        if !progress.is_font_file {
+            self.rejected_files.fetch_add(1, AtomicOrdering::Relaxed);
+        } else if !success {
+            self.parse_failures.fetch_add(1, AtomicOrdering::Relaxed);
+        }
+
+        if self.max_slowest_files == 0 {
+            return;
+        }
+
+        let mut slowest_files = match self.slowest_files.lock() {
+            Ok(o) => o,
+            Err(_) => return,
+        };
+
+        let is_slow = slowest_files.len() < self.max_slowest_files ||
+            slowest_files.last().map(|(_, t)| time > *t).unwrap_or(true);
+
+        if is_slow {
+            let pos = slowest_files.iter().position(|(_, t)| time > *t).unwrap_or(slowest_files.len());
+            slowest_files.insert(pos, (file.clone(), time));
+            slowest_files.truncate(self.max_slowest_files);
+        }
+    }
 
-        if let Some((_, r1)) = result1.as_ref() {
-            return Some(r1);
+    fn into_report(self) -> FcBuildReport {
+        FcBuildReport {
+            file_parsing: Duration::from_nanos(self.file_parsing_ns.into_inner()),
+            merging: Duration::from_nanos(self.merging_ns.into_inner()),
+            directories: self.directories.into_inner(),
+            files: self.files.into_inner(),
+            rejected_files: self.rejected_files.into_inner(),
+            parse_failures: self.parse_failures.into_inner(),
+            faces: self.faces.into_inner(),
+            bytes_mapped: self.bytes_mapped.into_inner(),
+            slowest_files: self.slowest_files.into_inner().unwrap_or_default(),
+            .. Default::default()
         }
+    }
+}
 
-        None
+/// Remainder of a `FcFontCache::build_with_deadline()` scan, running on a
+/// background thread
+#[cfg(feature = "std")]
+#[derive(Debug)]
+pub struct FcBuildContinuation {
+    handle: std::thread::JoinHandle<Vec<(FcPattern, FcFontPath)>>,
+}
+
+#[cfg(feature = "std")]
+impl FcBuildContinuation {
+
+    /// Returns whether the background scan has finished
+    pub fn is_finished(&self) -> bool {
+        self.handle.is_finished()
+    }
+
+    /// Waits for the background scan to finish and merges the
+    /// remaining fonts into the `cache`
+    pub fn merge_into(self, cache: &mut FcFontCache) {
+        if let Ok(fonts) = self.handle.join() {
+            cache.map.extend(fonts);
+            cache.rebuild_index();
+        }
+    }
+}
+
+impl core::iter::FromIterator<(FcPattern, FcFontPath)> for FcFontCache {
+    fn from_iter<I: IntoIterator<Item = (FcPattern, FcFontPath)>>(iter: I) -> Self {
+        FcFontCache::from_map(iter.into_iter().collect())
+    }
+}
+
+/// Parses a single font file and returns all font patterns it contains
+#[cfg(feature = "std")]
+pub fn FcParseFontFile(filepath: &PathBuf) -> Option<Vec<(FcPattern, FcFontPath)>> {
+    FcParseFont(filepath, &FcBuildHooks::default())
+}
+
+/// Latest modification time of the font directories of the system and
+/// their subdirectories, None if none of them can be read
+///
+/// Adding, removing or renaming a font file changes the modification time
+/// of its directory, so a cache built after this time is up to date.
+#[cfg(feature = "std")]
+pub fn FcFontDirectoriesModified() -> Option<std::time::SystemTime> {
+    let mut latest = None;
+    // the same walk as `build()`, so that the same directories are checked
+    let mut walk = FcDirectoryWalk::new(FcFontDirectories());
+    let hooks = FcBuildHooks::default();
+    let mut files = Vec::new();
+    while !walk.is_finished() {
+        if let Some(dir) = walk.read_next(&mut files, &hooks) {
+            if let Ok(modified) = std::fs::metadata(&dir).and_then(|m| m.modified()) {
+                latest = latest.max(Some(modified));
+            }
+        }
+        files.clear();
     }
+    latest
 }
 
+// Returns the font directories of the current system
 #[cfg(feature = "std")]
-fn FcScanDirectories() -> Option<Vec<(FcPattern, FcFontPath)>> {
+fn FcFontDirectories() -> Vec<PathBuf> {
+
+    #[cfg(target_os = "linux")] {
+        FcConfigDirectories().unwrap_or_default()
+    }
+
+    #[cfg(target_os = "windows")] {
+        vec![PathBuf::from("C:\\Windows\\Fonts\\")]
+    }
+
+    #[cfg(target_os = "macos")] {
+        vec![PathBuf::from("~/Library/Fonts")]
+    }
+}
+
+// Returns the font directories of the current system, with the fonts
+// of the current user first
+#[cfg(feature = "std")]
+fn FcFontDirectoriesByPriority() -> Vec<PathBuf> {
+
+    let mut dirs = FcFontDirectories();
+
+    if let Some(home) = std::env::var_os("HOME") {
+        let home = PathBuf::from(home);
+        // stable sort: keeps the configured order otherwise
+        dirs.sort_by_key(|d| !d.starts_with(&home));
+    }
+
+    dirs
+}
+
+// Returns the font directories configured in /etc/fonts/fonts.conf
+#[cfg(feature = "std")]
+fn FcConfigDirectories() -> Option<Vec<PathBuf>> {
 
     use std::path::Path;
     use std::fs;
@@ -214,13 +992,32 @@ fn FcScanDirectories() -> Option<Vec<(FcPattern, FcFontPath)>> {
         return None;
     }
 
-    Some(FcScanDirectoriesInner(font_paths))
+    Some(
+        font_paths
+        .iter()
+        .map(|(prefix, p)| {
+            let mut path = match prefix {
+                // "xdg" => ,
+                None => PathBuf::new(),
+                Some(s) => PathBuf::from(s),
+            };
+            match (p.strip_prefix("~/"), std::env::var_os("HOME")) {
+                (Some(rest), Some(home)) => {
+                    path.push(home);
+                    path.push(rest);
+                },
+                _ => path.push(p),
+            }
+            path
+        }).collect()
+    )
 }
 
-// Parses the fonts.conf file
-//
-// NOTE: This function also works on no_std
-fn ParseFontsConf<'a>(input: &'a str, font_paths: &mut [(Option<&'a str>, &'a str);32]) -> Option<usize> {
+/// Parses the `<dir>` entries of a fonts.conf file into `font_paths`
+/// as `(prefix, directory)` pairs, returns the number of entries found
+///
+/// NOTE: This function also works on no_std
+pub fn ParseFontsConf<'a>(input: &'a str, font_paths: &mut [(Option<&'a str>, &'a str);32]) -> Option<usize> {
 
     use xmlparser::Tokenizer;
     use xmlparser::Token::*;
@@ -294,83 +1091,161 @@ fn ParseFontsConf<'a>(input: &'a str, font_paths: &mut [(Option<&'a str>, &'a st
 }
 
 #[cfg(feature = "std")]
-fn FcScanDirectoriesInner(paths: &[(Option<&str>, &str)]) -> Vec<(FcPattern, FcFontPath)> {
+fn FcScanDirectoriesInner(paths: &[PathBuf], hooks: &FcBuildHooks) -> Vec<(FcPattern, FcFontPath)> {
+    FcParseFontFiles(&FcCollectFontFiles(paths, hooks), hooks)
+}
+
+// Returns all files in the given directories (recursively)
+#[cfg(feature = "std")]
+fn FcCollectFontFiles(paths: &[PathBuf], hooks: &FcBuildHooks) -> Vec<PathBuf> {
 
     use rayon::prelude::*;
 
     // scan directories in parallel
     paths
     .par_iter()
-    .flat_map(|(prefix, p)| {
-        let mut path = match prefix {
-            // "xdg" => ,
-            None => PathBuf::new(),
-            Some(s) => PathBuf::from(s),
-        };
-        path.push(p);
-        FcScanSingleDirectoryRecursive(path)
-    }).collect()
+    .flat_map(|path| {
+        let start = hooks.trace.map(|_| Instant::now());
+        let files = FcCollectFontFilesRecursive(path.clone(), hooks);
+        if let (Some(trace), Some(start)) = (hooks.trace, start) {
+            trace.record(trace::FcTraceCategory::Walk, path, start, files.len() as u64);
+        }
+        files
+    })
+    .collect()
 }
 
 #[cfg(feature = "std")]
-fn FcScanSingleDirectoryRecursive(dir: PathBuf)-> Vec<(FcPattern, FcFontPath)> {
-
+fn FcCollectFontFilesRecursive(dir: PathBuf, hooks: &FcBuildHooks)-> Vec<PathBuf> {
     let mut files_to_parse = Vec::new();
-    let mut dirs_to_parse = vec![dir];
+    let mut walk = FcDirectoryWalk::new(vec![dir]);
+    while !walk.is_finished() {
+        walk.read_next(&mut files_to_parse, hooks);
+    }
+    files_to_parse
+}
 
-    'outer: loop {
+// Directory walk that reads one directory per step, so that it can be
+// interrupted (see `build_with_deadline`) and continued on another thread
+#[cfg(feature = "std")]
+struct FcDirectoryWalk {
+    // directories that weren't read yet, the next one is at the end
+    pending: Vec<PathBuf>,
+    // canonical paths of the directories read so far - symlinks are
+    // followed, and may point back to a parent directory
+    visited: BTreeSet<PathBuf>,
+}
 
-        let mut new_dirs_to_parse = Vec::new();
+#[cfg(feature = "std")]
+impl FcDirectoryWalk {
 
-        'inner: for dir in dirs_to_parse.clone() {
+    // `dirs` in priority order, subdirectories are read before the next `dir`
+    fn new(mut dirs: Vec<PathBuf>) -> Self {
+        dirs.reverse();
+        FcDirectoryWalk { pending: dirs, visited: BTreeSet::new() }
+    }
 
-            let dir = match std::fs::read_dir(dir) {
-                Ok(o) => o,
-                Err(_) => continue 'inner,
-            };
+    fn is_finished(&self) -> bool {
+        self.pending.is_empty()
+    }
 
-            for (path, pathbuf) in dir.filter_map(|entry| {
-                let entry = entry.ok()?;
-                let path = entry.path();
-                let pathbuf = path.to_path_buf();
-                Some((path, pathbuf))
-            }) {
-                if path.is_dir() {
-                    new_dirs_to_parse.push(pathbuf);
-                } else {
-                    files_to_parse.push(pathbuf);
-                }
+    // reads the next directory, appending its files to `files` - returns
+    // the directory, None if it was skipped (unreadable or already read)
+    fn read_next(&mut self, files: &mut Vec<PathBuf>, hooks: &FcBuildHooks) -> Option<PathBuf> {
+
+        let path = self.pending.pop()?;
+        if !self.visited.insert(std::fs::canonicalize(&path).ok()?) {
+            return None;
+        }
+        let dir = std::fs::read_dir(&path).ok()?;
+
+        if let Some(report) = hooks.report {
+            report.directories.fetch_add(1, AtomicOrdering::Relaxed);
+        }
+
+        let files_before = files.len();
+        let subdirs_start = self.pending.len();
+
+        for path in dir.filter_map(|entry| Some(entry.ok()?.path())) {
+            if path.is_dir() {
+                self.pending.push(path);
+            } else {
+                files.push(path);
             }
         }
 
-        if new_dirs_to_parse.is_empty() {
-            break 'outer;
-        } else {
-            dirs_to_parse = new_dirs_to_parse;
+        // keep the directory order of `read_dir`
+        self.pending[subdirs_start..].reverse();
+
+        if let Some(report) = hooks.report {
+            report.files.fetch_add(files.len() - files_before, AtomicOrdering::Relaxed);
         }
-    }
 
-    FcParseFontFiles(&files_to_parse)
+        Some(path)
+    }
 }
 
 #[cfg(feature = "std")]
-fn FcParseFontFiles(files_to_parse: &[PathBuf])-> Vec<(FcPattern, FcFontPath)> {
+fn FcParseFontFiles(files_to_parse: &[PathBuf], hooks: &FcBuildHooks)-> Vec<(FcPattern, FcFontPath)> {
 
     use rayon::prelude::*;
 
+    let parse_start = hooks.report.map(|_| Instant::now());
+
     let result = files_to_parse
     .par_iter()
-    .filter_map(|file| FcParseFont(file))
+    .filter_map(|file| FcParseFont(file, hooks))
     .collect::<Vec<Vec<_>>>();
 
-    result
+    let merge_start = hooks.report.map(|_| Instant::now());
+
+    let fonts = result
     .into_iter()
     .flat_map(|f| f.into_iter())
-    .collect()
+    .collect::<Vec<_>>();
+
+    if let (Some(report), Some(parse_start), Some(merge_start)) = (hooks.report, parse_start, merge_start) {
+        report.add_time(&report.file_parsing_ns, merge_start - parse_start);
+        report.add_time(&report.merging_ns, merge_start.elapsed());
+        report.faces.fetch_add(fonts.len(), AtomicOrdering::Relaxed);
+    }
+
+    fonts
+}
+
+#[cfg(feature = "std")]
+fn FcParseFont(filepath: &PathBuf, hooks: &FcBuildHooks)-> Option<Vec<(FcPattern, FcFontPath)>> {
+
+    if hooks.report.is_none() && hooks.trace.is_none() {
+        return FcParseFontInner(filepath, &mut FcParseProgress::default());
+    }
+
+    let start = Instant::now();
+    let mut progress = FcParseProgress::default();
+    let result = FcParseFontInner(filepath, &mut progress);
+
+    if let Some(report) = hooks.report {
+        report.record_file(filepath, start.elapsed(), &progress, result.is_some());
+    }
+
+    if let Some(trace) = hooks.trace {
+        trace.record(trace::FcTraceCategory::Parse, filepath, start, progress.bytes_mapped);
+    }
+
+    result
 }
 
+// How far FcParseFontInner got before returning, used to tell
+// non-font files apart from broken fonts
 #[cfg(feature = "std")]
-fn FcParseFont(filepath: &PathBuf)-> Option<Vec<(FcPattern, FcFontPath)>> {
+#[derive(Debug, Default)]
+struct FcParseProgress {
+    bytes_mapped: u64,
+    is_font_file: bool,
+}
+
+#[cfg(feature = "std")]
+fn FcParseFontInner(filepath: &PathBuf, progress: &mut FcParseProgress)-> Option<Vec<(FcPattern, FcFontPath)>> {
 
     use allsorts_no_std::{
         tag,
@@ -393,9 +1268,12 @@ fn FcParseFont(filepath: &PathBuf)-> Option<Vec<(FcPattern, FcFontPath)>> {
 
     // try parsing the font file and see if the postscript name matches
     let file = File::open(filepath).ok()?;
+    let stamp = FcFileStamp::of(&file);
     let font_bytes = unsafe { MmapOptions::new().map(&file).ok()? };
+    progress.bytes_mapped = font_bytes.len() as u64;
     let scope = ReadScope::new(&font_bytes[..]);
     let font_file = scope.read::<FontData<'_>>().ok()?;
+    progress.is_font_file = true;
     let provider = font_file.table_provider(font_index).ok()?;
 
     let head_data = provider.table_data(tag::HEAD).ok()??.into_owned();
@@ -442,8 +1320,35 @@ fn FcParseFont(filepath: &PathBuf)-> Option<Vec<(FcPattern, FcFontPath)>> {
         .into_iter()
         .map(|(pat, index)| (pat, FcFontPath {
             path: filepath.to_string_lossy().to_string(),
-            font_index: index
+            font_index: index,
+            stamp,
         }))
         .collect()
     )
 }
+
+#[cfg(all(test, unix, feature = "std"))]
+mod tests {
+
+    use super::*;
+
+    #[test]
+    fn directory_walk_follows_symlinks_once() {
+
+        let root = std::env::temp_dir().join(format!("rust-fontconfig-walk-{}", std::process::id()));
+        let _ = std::fs::remove_dir_all(&root);
+        std::fs::create_dir_all(root.join("a/b")).unwrap();
+        std::fs::create_dir_all(root.join("c")).unwrap();
+        std::fs::write(root.join("a/b/1.ttf"), b"").unwrap();
+        std::fs::write(root.join("c/2.ttf"), b"").unwrap();
+        // a link to a directory outside the walk, and a cycle
+        std::os::unix::fs::symlink(root.join("c"), root.join("a/c")).unwrap();
+        std::os::unix::fs::symlink(root.join("a"), root.join("a/b/up")).unwrap();
+
+        let mut files = FcCollectFontFilesRecursive(root.join("a"), &FcBuildHooks::default());
+        files.sort();
+        assert_eq!(files, vec![root.join("a/b/1.ttf"), root.join("a/c/2.ttf")]);
+
+        std::fs::remove_dir_all(&root).unwrap();
+    }
+}
@@ -0,0 +1,478 @@
+//! Parser for fontconfig pattern strings, see `FcPatternRef::parse()`
+//!
+//! Accepts the syntax of `fc-match` and `FcNameParse`:
+//!
+//! ```text
+//! families[-size][:property[=value]]...
+//! DejaVu Sans Mono:bold:weight=200:lang=ja
+//! Noto Sans,sans-serif-12:slant=italic:spacing=mono
+//! ```
+//!
+//! Only the first family is used. Properties that `FcPattern` has
+//! (`family`, `fullname` / `name`, `style`, `weight`, `slant`, `spacing`,
+//! `width`) and the constants for them (`bold`, `italic`, `mono`,
+//! `condensed`, ...) are applied, other properties (`lang`, `size`, ...)
+//! are skipped. Weights from `bold` up, `italic`, `oblique`, `mono` /
+//! `charcell` spacing and widths below `normal` require the matching
+//! property - lighter weights, `roman` etc. leave it open. To set a
+//! property to `PatternMatch::False`, use `bold=false`, `italic=false`, ...
+//! (also `oblique`, `monospace`, `condensed`). A backslash escapes the
+//! next character.
+//!
+//! Strings are borrowed from the input, so parsing only allocates if a
+//! family or name contains an escaped character.
+
+use alloc::borrow::Cow;
+use core::fmt;
+use core::str::FromStr;
+use crate::{FcFontCache, FcFontPath, FcPattern, FcPatternFields, PatternMatch};
+use crate::compiled::FcCompiledQuery;
+
+// fontconfig values of the numeric properties
+const FC_WEIGHT_BOLD: u32 = 200;
+const FC_SLANT_ITALIC: u32 = 100;
+const FC_SLANT_OBLIQUE: u32 = 110;
+const FC_MONO: u32 = 100;
+const FC_WIDTH_NORMAL: u32 = 100;
+
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+enum FcProperty {
+    Weight,
+    Slant,
+    Spacing,
+    Width,
+}
+
+// fontconfig constants, compared case-insensitively
+const CONSTANTS: &[(&str, FcProperty, u32)] = &[
+    ("thin", FcProperty::Weight, 0),
+    ("extralight", FcProperty::Weight, 40),
+    ("ultralight", FcProperty::Weight, 40),
+    ("light", FcProperty::Weight, 50),
+    ("demilight", FcProperty::Weight, 55),
+    ("semilight", FcProperty::Weight, 55),
+    ("book", FcProperty::Weight, 75),
+    ("regular", FcProperty::Weight, 80),
+    ("normal", FcProperty::Weight, 80),
+    ("medium", FcProperty::Weight, 100),
+    ("demibold", FcProperty::Weight, 180),
+    ("semibold", FcProperty::Weight, 180),
+    ("bold", FcProperty::Weight, 200),
+    ("extrabold", FcProperty::Weight, 205),
+    ("ultrabold", FcProperty::Weight, 205),
+    ("black", FcProperty::Weight, 210),
+    ("heavy", FcProperty::Weight, 210),
+    ("roman", FcProperty::Slant, 0),
+    ("italic", FcProperty::Slant, 100),
+    ("oblique", FcProperty::Slant, 110),
+    ("proportional", FcProperty::Spacing, 0),
+    ("dual", FcProperty::Spacing, 90),
+    ("mono", FcProperty::Spacing, 100),
+    ("monospace", FcProperty::Spacing, 100),
+    ("charcell", FcProperty::Spacing, 110),
+    ("ultracondensed", FcProperty::Width, 50),
+    ("extracondensed", FcProperty::Width, 63),
+    ("condensed", FcProperty::Width, 75),
+    ("semicondensed", FcProperty::Width, 87),
+    ("semiexpanded", FcProperty::Width, 113),
+    ("expanded", FcProperty::Width, 125),
+    ("extraexpanded", FcProperty::Width, 150),
+    ("ultraexpanded", FcProperty::Width, 200),
+];
+
+/// `FcPattern` that borrows its strings, created by `FcPatternRef::parse()`
+#[derive(Debug, Default, Clone, PartialEq, Eq)]
+pub struct FcPatternRef<'a> {
+    pub name: Option<Cow<'a, str>>,
+    pub family: Option<Cow<'a, str>>,
+    pub italic: PatternMatch,
+    pub oblique: PatternMatch,
+    pub bold: PatternMatch,
+    pub monospace: PatternMatch,
+    pub condensed: PatternMatch,
+    /// fontconfig weight (`FC_WEIGHT_*`), 0 if not set
+    pub weight: usize,
+}
+
+/// Error of `FcPatternRef::parse()`
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum FcPatternError {
+    /// Element at this byte offset is not a known constant
+    UnknownConstant { offset: usize },
+    /// Value of the property at this byte offset is invalid
+    InvalidValue { offset: usize, property: &'static str },
+}
+
+impl fmt::Display for FcPatternError {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match self {
+            FcPatternError::UnknownConstant { offset } => write!(f, "unknown constant at byte {}", offset),
+            FcPatternError::InvalidValue { offset, property } => write!(f, "invalid value for {} at byte {}", property, offset),
+        }
+    }
+}
+
+#[cfg(feature = "std")]
+impl std::error::Error for FcPatternError { }
+
+impl<'a> FcPatternRef<'a> {
+
+    /// Parses a fontconfig pattern string, see the `parse` module
+    ///
+    /// NOTE: Does not allocate, unless a family or name contains a
+    /// backslash escape
+    pub fn parse(s: &'a str) -> Result<Self, FcPatternError> {
+
+        let mut pattern = FcPatternRef::default();
+        let mut elements = FcSplitUnescaped::new(s, b':');
+
+        if let Some(families) = elements.next() {
+            let families = FcStripSize(families);
+            pattern.family = FcSplitUnescaped::new(families, b',')
+                .map(FcUnescape)
+                .find(|f| !f.is_empty());
+        }
+
+        for element in elements {
+
+            let offset = element.as_ptr() as usize - s.as_ptr() as usize;
+
+            let (key, value) = match FcFindUnescaped(element, b'=') {
+                Some(p) => (element[..p].trim(), Some(element[p + 1..].trim())),
+                None => (element.trim(), None),
+            };
+
+            let invalid = |property| FcPatternError::InvalidValue { offset, property };
+
+            match (key, value) {
+                ("", None) => { },
+                (key, None) => match FcConstant(key) {
+                    Some((property, value)) => pattern.set(property, value),
+                    None => return Err(FcPatternError::UnknownConstant { offset }),
+                },
+                ("family", Some(v)) => {
+                    pattern.family = FcSplitUnescaped::new(v, b',').map(FcUnescape).find(|f| !f.is_empty());
+                },
+                ("fullname", Some(v)) | ("name", Some(v)) => {
+                    pattern.name = Some(FcUnescape(v)).filter(|n| !n.is_empty());
+                },
+                ("style", Some(v)) => {
+                    // "Bold Italic", "Condensed Oblique", ...
+                    for word in v.split_whitespace() {
+                        if let Some((property, value)) = FcConstant(word) {
+                            pattern.set(property, value);
+                        }
+                    }
+                },
+                ("weight", Some(v)) => pattern.set(FcProperty::Weight, FcNumber(v, FcProperty::Weight).ok_or(invalid("weight"))?),
+                ("slant", Some(v)) => pattern.set(FcProperty::Slant, FcNumber(v, FcProperty::Slant).ok_or(invalid("slant"))?),
+                ("spacing", Some(v)) => pattern.set(FcProperty::Spacing, FcNumber(v, FcProperty::Spacing).ok_or(invalid("spacing"))?),
+                ("width", Some(v)) => pattern.set(FcProperty::Width, FcNumber(v, FcProperty::Width).ok_or(invalid("width"))?),
+                ("bold", Some(v)) => pattern.bold = FcBool(v).ok_or(invalid("bold"))?,
+                ("italic", Some(v)) => pattern.italic = FcBool(v).ok_or(invalid("italic"))?,
+                ("oblique", Some(v)) => pattern.oblique = FcBool(v).ok_or(invalid("oblique"))?,
+                ("monospace", Some(v)) => pattern.monospace = FcBool(v).ok_or(invalid("monospace"))?,
+                ("condensed", Some(v)) => pattern.condensed = FcBool(v).ok_or(invalid("condensed"))?,
+                // lang, size, pixelsize, ...: not part of FcPattern
+                (_, Some(_)) => { },
+            }
+        }
+
+        Ok(pattern)
+    }
+
+    // a pattern property of `PatternMatch::False` only matches fonts that
+    // don't have it set to False, so values that don't require a property
+    // leave it at DontCare
+    fn set(&mut self, property: FcProperty, value: u32) {
+        let require = |required| if required { PatternMatch::True } else { PatternMatch::DontCare };
+        match property {
+            FcProperty::Weight => {
+                self.weight = value as usize;
+                self.bold = require(value >= FC_WEIGHT_BOLD);
+            },
+            FcProperty::Slant => {
+                self.italic = require(value == FC_SLANT_ITALIC);
+                self.oblique = require(value == FC_SLANT_OBLIQUE);
+            },
+            FcProperty::Spacing => self.monospace = require(value >= FC_MONO),
+            FcProperty::Width => self.condensed = require(value < FC_WIDTH_NORMAL),
+        }
+    }
+
+    /// Converts to an owned `FcPattern`
+    pub fn to_pattern(&self) -> FcPattern {
+        FcPattern {
+            name: self.name.as_ref().map(|s| s.as_ref().into()),
+            family: self.family.as_ref().map(|s| s.as_ref().into()),
+            italic: self.italic.clone(),
+            oblique: self.oblique.clone(),
+            bold: self.bold.clone(),
+            monospace: self.monospace.clone(),
+            condensed: self.condensed.clone(),
+            weight: self.weight,
+            .. Default::default()
+        }
+    }
+}
+
+impl<'a> FcPatternFields for FcPatternRef<'a> {
+
+    #[inline]
+    fn query_name(&self) -> Option<&str> {
+        self.name.as_deref()
+    }
+
+    #[inline]
+    fn query_family(&self) -> Option<&str> {
+        self.family.as_deref()
+    }
+
+    #[inline]
+    fn query_style(&self) -> [&PatternMatch;4] {
+        [&self.italic, &self.oblique, &self.bold, &self.monospace]
+    }
+
+    #[cfg(feature = "instrumentation")]
+    const API: crate::instrumentation::FcQueryApi = crate::instrumentation::FcQueryApi::QueryRef;
+}
+
+impl FromStr for FcPattern {
+    type Err = FcPatternError;
+
+    /// Parses a fontconfig pattern string, see `FcPatternRef::parse()`
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        FcPatternRef::parse(s).map(|p| p.to_pattern())
+    }
+}
+
+impl FcFontCache {
+
+    /// Same as `query()`, for a borrowed pattern
+    ///
+    /// NOTE: Does not allocate. Does not use the hot-query cache.
+    pub fn query_ref(&self, pattern: &FcPatternRef) -> Option<&FcFontPath> {
+        self.query_ref_entry(pattern).map(|(_, v)| v)
+    }
+
+    // `query_ref()`, also returning the pattern of the font
+    pub(crate) fn query_ref_entry(&self, pattern: &FcPatternRef) -> Option<(&FcPattern, &FcFontPath)> {
+        self.query_position(pattern).map(|i| self.entries.get(i))
+    }
+
+    /// Parses a fontconfig pattern string and queries it, see `FcPatternRef::parse()`
+    ///
+    /// NOTE: Does not allocate, unless the family or name contains a
+    /// backslash escape
+    pub fn query_str(&self, pattern: &str) -> Result<Option<&FcFontPath>, FcPatternError> {
+        FcPatternRef::parse(pattern).map(|p| self.query_ref(&p))
+    }
+
+    /// Parses a fontconfig pattern string and compiles it, see `compile()`
+    pub fn compile_str(&self, pattern: &str) -> Result<FcCompiledQuery, FcPatternError> {
+        FcPatternRef::parse(pattern).map(|p| self.compile(&p.to_pattern()))
+    }
+}
+
+// splits at `sep`, except where it is escaped with a backslash
+// (the parts still contain the escapes)
+struct FcSplitUnescaped<'a> {
+    rest: Option<&'a str>,
+    sep: u8,
+}
+
+impl<'a> FcSplitUnescaped<'a> {
+    fn new(s: &'a str, sep: u8) -> Self {
+        FcSplitUnescaped { rest: Some(s), sep }
+    }
+}
+
+impl<'a> Iterator for FcSplitUnescaped<'a> {
+    type Item = &'a str;
+
+    fn next(&mut self) -> Option<&'a str> {
+        let rest = self.rest?;
+        match FcFindUnescaped(rest, self.sep) {
+            Some(p) => {
+                self.rest = Some(&rest[p + 1..]);
+                Some(&rest[..p])
+            },
+            None => {
+                self.rest = None;
+                Some(rest)
+            },
+        }
+    }
+}
+
+// byte position of the first unescaped `c` (ASCII)
+fn FcFindUnescaped(s: &str, c: u8) -> Option<usize> {
+    let bytes = s.as_bytes();
+    let mut i = 0;
+    while i < bytes.len() {
+        match bytes[i] {
+            b'\\' => i += 2,
+            b if b == c => return Some(i),
+            _ => i += 1,
+        }
+    }
+    None
+}
+
+// position of the last unescaped `c` (ASCII)
+fn FcFindLastUnescaped(s: &str, c: u8) -> Option<usize> {
+    let mut last = None;
+    let mut offset = 0;
+    while let Some(p) = FcFindUnescaped(&s[offset..], c) {
+        last = Some(offset + p);
+        offset += p + 1;
+    }
+    last
+}
+
+// "Family-12" -> "Family", a hyphen that isn't followed by a number is
+// part of the family name
+fn FcStripSize(families: &str) -> &str {
+    match FcFindLastUnescaped(families, b'-') {
+        Some(p) if families[p + 1..].trim().parse::<f64>().is_ok() => &families[..p],
+        _ => families,
+    }
+}
+
+// removes the backslash escapes, borrows if there are none
+fn FcUnescape(s: &str) -> Cow<'_, str> {
+    let s = s.trim();
+    if !s.contains('\\') {
+        return Cow::Borrowed(s);
+    }
+    let mut unescaped = alloc::string::String::with_capacity(s.len());
+    let mut chars = s.chars();
+    while let Some(c) = chars.next() {
+        match c {
+            '\\' => if let Some(next) = chars.next() { unescaped.push(next) },
+            c => unescaped.push(c),
+        }
+    }
+    Cow::Owned(unescaped)
+}
+
+fn FcConstant(name: &str) -> Option<(FcProperty, u32)> {
+    CONSTANTS.iter().find(|(n, _, _)| n.eq_ignore_ascii_case(name)).map(|(_, p, v)| (*p, *v))
+}
+
+// number or constant of the same property
+fn FcNumber(s: &str, property: FcProperty) -> Option<u32> {
+    match s.parse::<f64>() {
+        Ok(n) if n >= 0.0 && n <= u32::MAX as f64 => Some(n as u32),
+        Ok(_) => None,
+        Err(_) => FcConstant(s).filter(|(p, _)| *p == property).map(|(_, v)| v),
+    }
+}
+
+fn FcBool(s: &str) -> Option<PatternMatch> {
+    ["true", "yes", "1"].iter().find(|t| t.eq_ignore_ascii_case(s)).map(|_| PatternMatch::True)
+    .or_else(|| ["false", "no", "0"].iter().find(|f| f.eq_ignore_ascii_case(s)).map(|_| PatternMatch::False))
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use alloc::format;
+    use alloc::string::String;
+
+    fn parse(s: &str) -> FcPatternRef<'_> {
+        FcPatternRef::parse(s).unwrap()
+    }
+
+    #[test]
+    fn families_and_size() {
+        assert_eq!(parse("DejaVu Sans").family.as_deref(), Some("DejaVu Sans"));
+        assert_eq!(parse("Noto Sans,sans-serif-12").family.as_deref(), Some("Noto Sans"));
+        assert_eq!(parse("Noto Sans-10.5:bold").family.as_deref(), Some("Noto Sans"));
+        // a hyphen that isn't followed by a size is part of the name
+        assert_eq!(parse("sans-serif").family.as_deref(), Some("sans-serif"));
+        assert_eq!(parse(",,Liberation Mono").family.as_deref(), Some("Liberation Mono"));
+        assert_eq!(parse("").family, None);
+        assert_eq!(parse(":bold").family, None);
+    }
+
+    #[test]
+    fn constants_and_properties() {
+
+        let p = parse("DejaVu Sans Mono:Bold:ITALIC:mono:condensed");
+        assert_eq!((p.bold, p.italic, p.monospace, p.condensed), (PatternMatch::True, PatternMatch::True, PatternMatch::True, PatternMatch::True));
+        assert_eq!(p.weight, 200);
+
+        // values that don't require a property leave it open
+        let p = parse("Sans:weight=80:slant=roman:spacing=proportional:width=100");
+        assert_eq!((p.bold, p.italic, p.oblique, p.monospace, p.condensed), Default::default());
+        assert_eq!(p.weight, 80);
+
+        let p = parse("Sans:weight=bold:slant=110:style=Condensed Oblique");
+        assert_eq!((p.bold, p.oblique, p.condensed), (PatternMatch::True, PatternMatch::True, PatternMatch::True));
+
+        let p = parse("Sans:bold=false:italic=no:monospace=0:oblique=yes:condensed=true");
+        assert_eq!((p.bold, p.italic, p.monospace), (PatternMatch::False, PatternMatch::False, PatternMatch::False));
+        assert_eq!((p.oblique, p.condensed), (PatternMatch::True, PatternMatch::True));
+
+        let p = parse("Sans:fullname=DejaVu Sans Bold:family=Other,Fallback:lang=ja:size=12:pixelsize=16");
+        assert_eq!(p.name.as_deref(), Some("DejaVu Sans Bold"));
+        assert_eq!(p.family.as_deref(), Some("Other"));
+        assert_eq!(parse("Sans:name=").name, None);
+    }
+
+    #[test]
+    fn escapes() {
+
+        let p = parse(r"Foo\:Bar\-12:name=A\\B");
+        assert_eq!(p.family.as_deref(), Some("Foo:Bar-12"));
+        assert_eq!(p.name.as_deref(), Some(r"A\B"));
+        assert!(matches!(p.family, Some(Cow::Owned(_))));
+
+        // without escapes, strings are borrowed from the input
+        let p = parse("Foo Bar:name=Foo Bar Bold");
+        assert!(matches!(p.family, Some(Cow::Borrowed(_))));
+        assert!(matches!(p.name, Some(Cow::Borrowed(_))));
+
+        assert_eq!(parse(r"Ü\,ber,Other").family.as_deref(), Some("Ü,ber"));
+    }
+
+    #[test]
+    fn errors() {
+        assert_eq!(FcPatternRef::parse("Sans:bold:nonsense"), Err(FcPatternError::UnknownConstant { offset: 10 }));
+        assert_eq!(FcPatternRef::parse("Sans:weight=heavyish"), Err(FcPatternError::InvalidValue { offset: 5, property: "weight" }));
+        // constants of another property are not a valid value
+        assert_eq!(FcPatternRef::parse("Sans:slant=bold"), Err(FcPatternError::InvalidValue { offset: 5, property: "slant" }));
+        assert_eq!(FcPatternRef::parse("Sans:weight=-1"), Err(FcPatternError::InvalidValue { offset: 5, property: "weight" }));
+        assert_eq!(FcPatternRef::parse("Sans:bold=maybe"), Err(FcPatternError::InvalidValue { offset: 5, property: "bold" }));
+        assert!("Sans:bold".parse::<FcPattern>().is_ok());
+        assert!("Sans:nonsense".parse::<FcPattern>().is_err());
+    }
+
+    #[test]
+    fn query_ref_matches_query() {
+
+        let cache: FcFontCache = (0..40).map(|i| (FcPattern {
+            name: Some(format!("Font {}", i)),
+            family: Some(format!("Family {}", i % 5)),
+            bold: if i % 2 == 0 { PatternMatch::True } else { PatternMatch::False },
+            italic: if i % 3 == 0 { PatternMatch::True } else { PatternMatch::False },
+            monospace: if i % 7 == 0 { PatternMatch::True } else { PatternMatch::DontCare },
+            .. Default::default()
+        }, FcFontPath { path: format!("/fonts/{}.ttf", i), .. Default::default() })).collect();
+
+        for s in [
+            "Family 3", "Family 3:bold", "Family 4:italic:bold=false", "Family 9",
+            ":mono", ":bold:italic", ":name=Font 17", "Family 2:name=Font 17", ":oblique",
+        ].iter() {
+            let pattern = FcPatternRef::parse(s).unwrap();
+            let owned: FcPattern = s.parse().unwrap();
+            assert_eq!(cache.query_ref(&pattern), cache.query(&owned), "{}", s);
+            assert_eq!(cache.query_str(s), Ok(cache.query(&owned)), "{}", s);
+            let accepted = cache.list().keys().filter(|k| pattern.accepts(k)).map(|k| k.name.clone()).collect::<alloc::vec::Vec<Option<String>>>();
+            let expected = cache.query_all(&owned).iter().map(|(k, _)| k.name.clone()).collect::<alloc::vec::Vec<_>>();
+            assert_eq!(accepted, expected, "{}", s);
+        }
+    }
+}
@@ -0,0 +1,434 @@
+//! Recording and replaying of query traffic
+//!
+//! `FcQueryRecorder` wraps a `FcFontCache` and appends every query
+//! (pattern, result and timestamp) to a compact binary log, which
+//! `FcQueryLogReader` reads back. Use `examples/replay.rs` to re-run a
+//! recorded log against a cache and measure throughput and latency.
+//!
+//! ```rust,no_run
+//! use rust_fontconfig::{FcFontCache, FcPattern};
+//! use rust_fontconfig::querylog::FcQueryRecorder;
+//!
+//! let cache = FcFontCache::build();
+//! let file = std::fs::File::create("queries.log").unwrap();
+//! let recorder = FcQueryRecorder::new(&cache, file).unwrap();
+//! let font = recorder.query(&FcPattern {
+//!     name: Some(String::from("Arial")),
+//!     .. Default::default()
+//! });
+//! ```
+//!
+//! Log format: the magic bytes `RFQL`, a version byte, then one record per
+//! query. Integers are LEB128 varints, strings are `len + 1` followed by
+//! UTF-8 bytes (`0` = `None`). A record is: microseconds since the start of
+//! the recording, the five `PatternMatch` fields packed into 2 bits each,
+//! weight, unicode range start and end, name, family, the path of the
+//! result and (if there is a result) its font index, file size and
+//! modification time.
+//!
+//! Every thread encodes its records into its own buffer, which is appended
+//! to the log when it is full, so records of different threads are not in
+//! timestamp order.
+
+use crate::{FcCompiledQuery, FcFileStamp, FcFontCache, FcFontPath, FcPattern, FcPatternError, FcPatternRef};
+use std::cell::RefCell;
+use std::io::{self, BufWriter, Read, Write};
+use std::sync::{Arc, Mutex, MutexGuard};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+const MAGIC: &[u8;4] = b"RFQL";
+const VERSION: u8 = 3;
+
+// size at which a thread buffer is appended to the log
+const CHUNK_SIZE: usize = 64 * 1024;
+
+// longer strings are rejected as corrupt, instead of allocating their length
+const MAX_STRING_LEN: u64 = 64 * 1024;
+
+/// Single recorded query
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct FcQueryLogEntry {
+    /// Time since the recording started
+    pub timestamp: Duration,
+    pub pattern: FcPattern,
+    pub result: Option<FcFontPath>,
+}
+
+type FcThreadBuffer = Arc<Mutex<Vec<u8>>>;
+
+thread_local! {
+    // (recorder id, buffer) for every recorder this thread used
+    static THREAD_BUFFERS: RefCell<Vec<(u64, FcThreadBuffer)>> = RefCell::new(Vec::new());
+}
+
+fn FcLock<T>(m: &Mutex<T>) -> MutexGuard<'_, T> {
+    m.lock().unwrap_or_else(|e| e.into_inner())
+}
+
+/// Wraps a cache and logs every query made through it
+#[derive(Debug)]
+pub struct FcQueryRecorder<'a, W: Write> {
+    cache: &'a FcFontCache,
+    origin: Instant,
+    id: u64,
+    // buffers of all threads that recorded a query
+    buffers: Mutex<Vec<FcThreadBuffer>>,
+    // None after `finish()`
+    writer: Mutex<Option<BufWriter<W>>>,
+}
+
+impl<'a, W: Write> FcQueryRecorder<'a, W> {
+
+    /// Starts a new log by writing the header to `writer`
+    pub fn new(cache: &'a FcFontCache, writer: W) -> io::Result<Self> {
+        static NEXT_ID: AtomicU64 = AtomicU64::new(0);
+        let mut writer = BufWriter::new(writer);
+        writer.write_all(MAGIC)?;
+        writer.write_all(&[VERSION])?;
+        Ok(FcQueryRecorder {
+            cache,
+            origin: Instant::now(),
+            id: NEXT_ID.fetch_add(1, Ordering::Relaxed),
+            buffers: Mutex::new(Vec::new()),
+            writer: Mutex::new(Some(writer)),
+        })
+    }
+
+    /// Same as `FcFontCache::query`, but appends the query to the log
+    ///
+    /// Write errors are ignored, so that logging never affects the result
+    pub fn query(&self, pattern: &FcPattern) -> Option<&'a FcFontPath> {
+        let result = self.cache.query(pattern);
+        self.record(pattern, result);
+        result
+    }
+
+    /// Same as `FcFontCache::query_str`, logs the parsed pattern
+    pub fn query_str(&self, pattern: &str) -> Result<Option<&'a FcFontPath>, FcPatternError> {
+        let pattern = FcPatternRef::parse(pattern)?;
+        let result = self.cache.query_ref(&pattern);
+        self.record(&pattern.to_pattern(), result);
+        Ok(result)
+    }
+
+    /// Same as `FcFontCache::query_compiled`, logs the pattern of the query
+    pub fn query_compiled(&self, query: &FcCompiledQuery) -> Option<&'a FcFontPath> {
+        let result = self.cache.query_compiled(query);
+        self.record(query.pattern(), result);
+        result
+    }
+
+    /// Same as `FcFontCache::query_stack`, logs every pattern that was
+    /// tried, up to the first one with a result
+    pub fn query_stack(&self, patterns: &[FcPattern]) -> Option<&'a FcFontPath> {
+        patterns.iter().find_map(|p| self.query(p))
+    }
+
+    /// Writes the records of all threads to the log and flushes it
+    pub fn flush(&self) -> io::Result<()> {
+        let buffers = FcLock(&self.buffers).clone();
+        for buffer in buffers.iter() {
+            let records = core::mem::take(&mut *FcLock(buffer));
+            self.write(&records)?;
+        }
+        match FcLock(&self.writer).as_mut() {
+            Some(w) => w.flush(),
+            None => Ok(()),
+        }
+    }
+
+    /// Flushes the log and returns the underlying writer
+    pub fn finish(self) -> io::Result<W> {
+        self.flush()?;
+        let writer = FcLock(&self.writer).take();
+        match writer {
+            Some(w) => w.into_inner().map_err(|e| e.into_error()),
+            None => Err(io::Error::new(io::ErrorKind::Other, "log already finished")),
+        }
+    }
+
+    fn record(&self, pattern: &FcPattern, result: Option<&FcFontPath>) {
+        let micros = self.origin.elapsed().as_micros() as u64;
+        THREAD_BUFFERS.with(|buffers| {
+            let mut buffers = buffers.borrow_mut();
+            let buffer = match buffers.iter().position(|(id, _)| *id == self.id) {
+                Some(i) => &buffers[i].1,
+                None => {
+                    // buffers of dropped recorders are only referenced here
+                    buffers.retain(|(_, b)| Arc::strong_count(b) > 1);
+                    let buffer = FcThreadBuffer::default();
+                    FcLock(&self.buffers).push(buffer.clone());
+                    buffers.push((self.id, buffer));
+                    &buffers[buffers.len() - 1].1
+                },
+            };
+            // only contended while `flush()` runs
+            let mut records = FcLock(buffer);
+            let _ = WriteEntry(&mut *records, micros, pattern, result);
+            if records.len() >= CHUNK_SIZE {
+                // never hold a buffer and the writer at the same time
+                let full = core::mem::replace(&mut *records, Vec::with_capacity(CHUNK_SIZE));
+                drop(records);
+                let _ = self.write(&full);
+            }
+        });
+    }
+
+    // appends whole records to the log
+    fn write(&self, records: &[u8]) -> io::Result<()> {
+        match FcLock(&self.writer).as_mut() {
+            Some(w) => w.write_all(records),
+            None => Ok(()),
+        }
+    }
+}
+
+impl<'a, W: Write> Drop for FcQueryRecorder<'a, W> {
+    fn drop(&mut self) {
+        let _ = self.flush();
+    }
+}
+
+/// Reads a log written by `FcQueryRecorder`
+#[derive(Debug)]
+pub struct FcQueryLogReader<R: Read> {
+    reader: R,
+}
+
+impl<R: Read> FcQueryLogReader<R> {
+
+    /// Checks the header of the log
+    pub fn new(mut reader: R) -> io::Result<Self> {
+        let mut header = [0;5];
+        reader.read_exact(&mut header)?;
+        if &header[..4] != MAGIC || header[4] != VERSION {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "not a rust-fontconfig query log"));
+        }
+        Ok(FcQueryLogReader { reader })
+    }
+
+    fn read_entry(&mut self) -> io::Result<Option<FcQueryLogEntry>> {
+
+        let micros = match ReadVarint(&mut self.reader) {
+            Ok(o) => o,
+            Err(ref e) if e.kind() == io::ErrorKind::UnexpectedEof => return Ok(None),
+            Err(e) => return Err(e),
+        };
+
+        let flags = ReadVarint(&mut self.reader)? as u16;
+        let weight = ReadVarint(&mut self.reader)? as usize;
+        let range_start = ReadVarint(&mut self.reader)? as usize;
+        let range_end = ReadVarint(&mut self.reader)? as usize;
+        let name = ReadString(&mut self.reader)?;
+        let family = ReadString(&mut self.reader)?;
+        let path = ReadString(&mut self.reader)?;
+        let result = match path {
+            Some(path) => Some(FcFontPath {
+                path,
+                font_index: ReadVarint(&mut self.reader)? as usize,
+                stamp: FcFileStamp {
+                    size: ReadVarint(&mut self.reader)?,
+                    modified: ReadVarint(&mut self.reader)?,
+                },
+            }),
+            None => None,
+        };
+
+        let mut pattern = FcPattern {
+            name,
+            family,
+            weight,
+            unicode_range: [range_start, range_end],
+            .. Default::default()
+        };
+        pattern.set_style_bits(flags);
+
+        Ok(Some(FcQueryLogEntry {
+            timestamp: Duration::from_micros(micros),
+            pattern,
+            result,
+        }))
+    }
+}
+
+impl<R: Read> Iterator for FcQueryLogReader<R> {
+    type Item = io::Result<FcQueryLogEntry>;
+    fn next(&mut self) -> Option<Self::Item> {
+        self.read_entry().transpose()
+    }
+}
+
+fn WriteEntry<W: Write>(w: &mut W, micros: u64, pattern: &FcPattern, result: Option<&FcFontPath>) -> io::Result<()> {
+    WriteVarint(w, micros)?;
+    WriteVarint(w, pattern.style_bits() as u64)?;
+    WriteVarint(w, pattern.weight as u64)?;
+    WriteVarint(w, pattern.unicode_range[0] as u64)?;
+    WriteVarint(w, pattern.unicode_range[1] as u64)?;
+    WriteString(w, pattern.name.as_deref())?;
+    WriteString(w, pattern.family.as_deref())?;
+    WriteString(w, result.map(|r| r.path.as_str()))?;
+    if let Some(r) = result {
+        WriteVarint(w, r.font_index as u64)?;
+        WriteVarint(w, r.stamp.size)?;
+        WriteVarint(w, r.stamp.modified)?;
+    }
+    Ok(())
+}
+
+fn WriteVarint<W: Write>(w: &mut W, mut v: u64) -> io::Result<()> {
+    let mut buf = [0_u8;10];
+    let mut len = 0;
+    loop {
+        let byte = (v & 0x7F) as u8;
+        v >>= 7;
+        if v == 0 {
+            buf[len] = byte;
+            len += 1;
+            break;
+        }
+        buf[len] = byte | 0x80;
+        len += 1;
+    }
+    w.write_all(&buf[..len])
+}
+
+fn ReadVarint<R: Read>(r: &mut R) -> io::Result<u64> {
+    let mut v = 0_u64;
+    for shift in (0..64).step_by(7) {
+        let mut byte = [0_u8;1];
+        r.read_exact(&mut byte)?;
+        v |= ((byte[0] & 0x7F) as u64) << shift;
+        if byte[0] & 0x80 == 0 {
+            return Ok(v);
+        }
+    }
+    Err(io::Error::new(io::ErrorKind::InvalidData, "varint too long"))
+}
+
+fn WriteString<W: Write>(w: &mut W, s: Option<&str>) -> io::Result<()> {
+    match s {
+        None => WriteVarint(w, 0),
+        Some(s) => {
+            WriteVarint(w, s.len() as u64 + 1)?;
+            w.write_all(s.as_bytes())
+        },
+    }
+}
+
+fn ReadString<R: Read>(r: &mut R) -> io::Result<Option<String>> {
+    let len = match ReadVarint(r)? {
+        0 => return Ok(None),
+        l if l - 1 > MAX_STRING_LEN => return Err(io::Error::new(io::ErrorKind::InvalidData, "string too long")),
+        l => l - 1,
+    };
+    let mut bytes = Vec::new();
+    r.take(len).read_to_end(&mut bytes)?;
+    if bytes.len() as u64 != len {
+        return Err(io::ErrorKind::UnexpectedEof.into());
+    }
+    String::from_utf8(bytes).map(Some).map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::PatternMatch;
+
+    fn cache() -> FcFontCache {
+        (0..20).map(|i| (FcPattern {
+            name: Some(format!("Font {}", i)),
+            family: Some(format!("Family {}", i % 4)),
+            bold: if i % 2 == 0 { PatternMatch::True } else { PatternMatch::False },
+            .. Default::default()
+        }, FcFontPath { path: format!("/fonts/{}.ttf", i), font_index: i % 3, stamp: FcFileStamp { size: 1000 + i as u64, modified: 1 << 50 } })).collect()
+    }
+
+    fn read(log: &[u8]) -> Vec<io::Result<FcQueryLogEntry>> {
+        FcQueryLogReader::new(log).unwrap().collect()
+    }
+
+    #[test]
+    fn round_trip() {
+        let cache = cache();
+        let patterns = vec![
+            FcPattern { name: Some(String::from("Font 3")), .. Default::default() },
+            FcPattern { family: Some(String::from("Family 2")), bold: PatternMatch::True, weight: 700, unicode_range: [32, 127], .. Default::default() },
+            FcPattern { name: Some(String::from("missing")), italic: PatternMatch::False, .. Default::default() },
+            FcPattern::default(),
+        ];
+        let recorder = FcQueryRecorder::new(&cache, Vec::new()).unwrap();
+        let results = patterns.iter().map(|p| recorder.query(p).cloned()).collect::<Vec<_>>();
+        let entries = read(&recorder.finish().unwrap()).into_iter().map(|e| e.unwrap()).collect::<Vec<_>>();
+        assert_eq!(entries.len(), patterns.len());
+        for ((entry, pattern), result) in entries.iter().zip(patterns.iter()).zip(results.iter()) {
+            assert_eq!(&entry.pattern, pattern);
+            assert_eq!(&entry.result, result);
+        }
+        assert!(entries.windows(2).all(|w| w[0].timestamp <= w[1].timestamp));
+    }
+
+    #[test]
+    fn other_apis_are_recorded() {
+        let cache = cache();
+        let compiled = cache.compile(&FcPattern { name: Some(String::from("Font 5")), .. Default::default() });
+        let stack = [
+            FcPattern { family: Some(String::from("missing")), .. Default::default() },
+            FcPattern { family: Some(String::from("Family 1")), .. Default::default() },
+            FcPattern { family: Some(String::from("never tried")), .. Default::default() },
+        ];
+        let recorder = FcQueryRecorder::new(&cache, Vec::new()).unwrap();
+        assert!(recorder.query_str("Family 3:bold").unwrap().is_none());
+        assert!(recorder.query_compiled(&compiled).is_some());
+        assert!(recorder.query_stack(&stack).is_some());
+        let entries = read(&recorder.finish().unwrap()).into_iter().map(|e| e.unwrap()).collect::<Vec<_>>();
+        let families = entries.iter().map(|e| e.pattern.family.as_deref()).collect::<Vec<_>>();
+        assert_eq!(families, [Some("Family 3"), None, Some("missing"), Some("Family 1")]);
+        assert_eq!(entries[0].pattern.bold, PatternMatch::True);
+        assert_eq!(entries[1].pattern.name.as_deref(), Some("Font 5"));
+    }
+
+    #[test]
+    fn threads() {
+        let cache = cache();
+        let recorder = FcQueryRecorder::new(&cache, Vec::new()).unwrap();
+        let pattern = FcPattern { family: Some(String::from("Family 1")), .. Default::default() };
+        // enough records to fill the thread buffers a few times
+        std::thread::scope(|s| {
+            for _ in 0..4 {
+                s.spawn(|| for _ in 0..10_000 { recorder.query(&pattern); });
+            }
+        });
+        let entries = read(&recorder.finish().unwrap());
+        assert_eq!(entries.len(), 40_000);
+        assert!(entries.iter().all(|e| e.as_ref().map(|e| e.pattern == pattern).unwrap_or(false)));
+    }
+
+    #[test]
+    fn truncated_and_corrupt_logs() {
+        let cache = cache();
+        let recorder = FcQueryRecorder::new(&cache, Vec::new()).unwrap();
+        for i in 0..3 {
+            recorder.query(&FcPattern { name: Some(format!("Font {}", i)), .. Default::default() });
+        }
+        let log = recorder.finish().unwrap();
+
+        // the complete records are read, then the incomplete one is an error
+        let entries = read(&log[..log.len() - 3]);
+        assert_eq!(entries.len(), 3);
+        assert!(entries[..2].iter().all(|e| e.is_ok()));
+        assert_eq!(entries[2].as_ref().unwrap_err().kind(), io::ErrorKind::UnexpectedEof);
+
+        // a huge string length is rejected instead of allocated
+        let mut corrupt = log[..5].to_vec();
+        for v in [0, 0, 0, 0, 0].iter() {
+            WriteVarint(&mut corrupt, *v).unwrap();
+        }
+        WriteVarint(&mut corrupt, u64::MAX).unwrap();
+        let entries = read(&corrupt);
+        assert_eq!(entries[0].as_ref().unwrap_err().kind(), io::ErrorKind::InvalidData);
+
+        assert!(FcQueryLogReader::new(&b"RFQL\x01"[..]).is_err());
+    }
+}
@@ -0,0 +1,167 @@
+//! First-match scan over all fonts, used when no index can answer a query
+//!
+//! Scans walk the fonts by position (see `FcEntries` in the `index`
+//! module), so a predicate can also test per-position data such as the
+//! style bits of the index. Small caches are scanned on the calling
+//! thread. Large caches are split into chunks of `SCAN_CHUNK` positions
+//! that rayon scans in parallel - with `find_map_first`, so that chunks
+//! after the first match are skipped and the result is the same as a
+//! sequential scan.
+//!
+//! Whether a scan runs in parallel is decided by a cost model that is
+//! learned from the scans themselves: the sequential cost per font and the
+//! fixed overhead of a parallel scan are running averages, a parallel scan
+//! is used if `overhead + sequential / threads < sequential`. Every
+//! `EXPLORE_INTERVAL`th large scan takes the other path, so that a bad
+//! estimate corrects itself.
+
+use crate::FcFontCache;
+#[cfg(feature = "std")]
+use crate::{FcFontPath, FcPattern};
+
+// number of fonts per parallel scan chunk
+#[cfg(feature = "std")]
+const SCAN_CHUNK: usize = 2048;
+
+// below this, scans always stay on the calling thread (and are not timed)
+#[cfg(feature = "std")]
+const MIN_PARALLEL_FONTS: usize = 2 * SCAN_CHUNK;
+
+#[cfg(feature = "std")]
+const EXPLORE_INTERVAL: u64 = 64;
+
+// scans that stopped after fewer fonts are too noisy to learn from
+#[cfg(feature = "std")]
+const MIN_SAMPLE_FONTS: usize = 256;
+
+#[cfg(feature = "std")]
+mod costs {
+
+    use core::sync::atomic::{AtomicU64, Ordering};
+
+    // sequential scan cost in picoseconds per font
+    static SEQUENTIAL_PS_PER_FONT: AtomicU64 = AtomicU64::new(2_000);
+    // fixed cost of a parallel scan (waking and joining threads) in ns
+    static PARALLEL_OVERHEAD_NS: AtomicU64 = AtomicU64::new(20_000);
+    static LARGE_SCANS: AtomicU64 = AtomicU64::new(0);
+
+    pub(super) fn sequential_ps_per_font() -> u64 {
+        SEQUENTIAL_PS_PER_FONT.load(Ordering::Relaxed)
+    }
+
+    pub(super) fn parallel_overhead_ns() -> u64 {
+        PARALLEL_OVERHEAD_NS.load(Ordering::Relaxed)
+    }
+
+    pub(super) fn next_large_scan() -> u64 {
+        LARGE_SCANS.fetch_add(1, Ordering::Relaxed)
+    }
+
+    pub(super) fn record_sequential(ps_per_font: u64) {
+        update(&SEQUENTIAL_PS_PER_FONT, ps_per_font.max(1));
+    }
+
+    pub(super) fn record_parallel(overhead_ns: u64) {
+        update(&PARALLEL_OVERHEAD_NS, overhead_ns);
+    }
+
+    // running average with weight 1/8 - lost updates under contention are
+    // fine, this is only an estimate
+    fn update(average: &AtomicU64, sample: u64) {
+        let old = average.load(Ordering::Relaxed);
+        average.store(old - old / 8 + sample / 8, Ordering::Relaxed);
+    }
+}
+
+impl FcFontCache {
+
+    /// Returns the first font (in the order of `list()`) for which
+    /// `predicate` returns true
+    ///
+    /// For filters that `query()` can't express. Large caches are scanned
+    /// in parallel, see the `scan` module.
+    #[cfg(feature = "std")]
+    pub fn find<F>(&self, predicate: F) -> Option<(&FcPattern, &FcFontPath)>
+    where F: Fn(&FcPattern, &FcFontPath) -> bool + Sync
+    {
+        let (position, _) = self.scan_positions(|i| {
+            let (k, v) = self.entries.get(i);
+            predicate(k, v)
+        });
+        position.map(|i| self.entries.get(i))
+    }
+
+    // first position for which the predicate is true and the (estimated)
+    // number of positions looked at
+    #[cfg(feature = "std")]
+    pub(crate) fn scan_positions<F>(&self, predicate: F) -> (Option<usize>, usize)
+    where F: Fn(usize) -> bool + Sync
+    {
+        use std::time::Instant;
+
+        let fonts = self.entries.len();
+        let threads = rayon::current_num_threads();
+
+        if fonts < MIN_PARALLEL_FONTS || threads < 2 {
+            return self.scan_sequential(&predicate);
+        }
+
+        let ps_per_font = costs::sequential_ps_per_font();
+        let sequential_ns = fonts as u64 * ps_per_font / 1000;
+        let parallel_ns = costs::parallel_overhead_ns() + sequential_ns / threads as u64;
+        let explore = costs::next_large_scan() % EXPLORE_INTERVAL == 0;
+        let parallel = (parallel_ns < sequential_ns) != explore;
+
+        let start = Instant::now();
+
+        if parallel {
+            let (result, visited) = self.scan_parallel(&predicate);
+            let elapsed_ns = start.elapsed().as_nanos() as u64;
+            let work_ns = visited as u64 * ps_per_font / 1000 / threads as u64;
+            costs::record_parallel(elapsed_ns.saturating_sub(work_ns));
+            (result, visited)
+        } else {
+            let (result, visited) = self.scan_sequential(&predicate);
+            if visited >= MIN_SAMPLE_FONTS {
+                costs::record_sequential(start.elapsed().as_nanos() as u64 * 1000 / visited as u64);
+            }
+            (result, visited)
+        }
+    }
+
+    #[cfg(not(feature = "std"))]
+    pub(crate) fn scan_positions<F>(&self, predicate: F) -> (Option<usize>, usize)
+    where F: Fn(usize) -> bool
+    {
+        self.scan_sequential(&predicate)
+    }
+
+    fn scan_sequential<F>(&self, predicate: &F) -> (Option<usize>, usize)
+    where F: Fn(usize) -> bool
+    {
+        let fonts = self.entries.len();
+        let result = (0..fonts).position(|i| predicate(i));
+        (result, result.map(|i| i + 1).unwrap_or(fonts))
+    }
+
+    // visited = fonts up to the end of the chunk with the match
+    #[cfg(feature = "std")]
+    fn scan_parallel<F>(&self, predicate: &F) -> (Option<usize>, usize)
+    where F: Fn(usize) -> bool + Sync
+    {
+        use rayon::prelude::*;
+
+        let fonts = self.entries.len();
+        let chunks = (fonts + SCAN_CHUNK - 1) / SCAN_CHUNK;
+
+        let result = (0..chunks).into_par_iter().find_map_first(|c| {
+            let start = c * SCAN_CHUNK;
+            (start..(start + SCAN_CHUNK).min(fonts)).find(|i| predicate(*i))
+        });
+
+        match result {
+            Some(i) => (Some(i), ((i / SCAN_CHUNK + 1) * SCAN_CHUNK).min(fonts)),
+            None => (None, fonts),
+        }
+    }
+}
@@ -0,0 +1,421 @@
+//! Out-of-core build of the compact cache, see `FcCompactCache::build_streaming`
+//!
+//! Parsed fonts are collected until `max_faces_in_memory` is reached, then
+//! sorted and spilled to a run file (in the compact cache format) next to
+//! the output. At the end, the runs are merged (at most `MAX_MERGE_FAN_IN`
+//! at a time) into the final file. For duplicate patterns the font that was
+//! found last wins, same as when collecting into a `FcFontCache`.
+//!
+//! Every run file is owned by `FcRunFiles` until it has been merged and
+//! deleted, and every file is written through `FcCompactWriter` (to a
+//! temporary file that is renamed when complete), so a failed build leaves
+//! neither run files nor a partial output behind.
+
+use crate::compact::{FcCheckTrailer, FcCompactCache, FcCompactRecord, FcCompactWriter, FcReadHeader, InvalidData, ReadU32, FIXED_RECORD_LEN, HEADER_LEN, TRAILER_LEN};
+use crate::{FcBuildHooks, FcDirectoryWalk, FcFontPath, FcHashBytes, FcParseFontFiles, FcPattern, FNV_OFFSET};
+use alloc::collections::BinaryHeap;
+use core::cmp::Ordering;
+use std::ffi::OsString;
+use std::fs::File;
+use std::io::{self, BufReader, Read};
+use std::path::{Path, PathBuf};
+
+// maximum number of runs merged at once, limits open files and read buffers
+const MAX_MERGE_FAN_IN: usize = 64;
+
+// font files parsed in parallel per rayon thread, before the results are
+// added to the current run
+const FILES_PER_THREAD: usize = 16;
+
+impl FcCompactCache {
+
+    /// Scans `dirs` (recursively) and writes a compact cache file to
+    /// `output`, without ever holding more than about `max_faces_in_memory`
+    /// fonts in memory
+    ///
+    /// Meant for font repositories that are too large for a `FcFontCache`.
+    /// The directory walk is streamed and parsed fonts are spilled to sorted
+    /// temporary files next to `output`, so peak memory does not depend on
+    /// the number of fonts. Returns the number of fonts written, open the
+    /// result with `FcCompactCache::open()`.
+    pub fn build_streaming<P: AsRef<Path>>(dirs: &[PathBuf], output: P, max_faces_in_memory: usize) -> io::Result<usize> {
+
+        let output = output.as_ref();
+        let hooks = FcBuildHooks::default();
+        let batch_size = rayon::current_num_threads().max(1) * FILES_PER_THREAD;
+
+        let mut build = FcStreamingBuild::new(output, max_faces_in_memory);
+
+        // same walk (and file order, so the same duplicates win) as
+        // `FcFontCache::build_from_directories`
+        let mut walk = FcDirectoryWalk::new(dirs.to_vec());
+        let mut files_to_parse = Vec::with_capacity(batch_size);
+
+        while !walk.is_finished() {
+            walk.read_next(&mut files_to_parse, &hooks);
+            while files_to_parse.len() >= batch_size {
+                build.push(FcParseFontFiles(&files_to_parse[..batch_size], &hooks))?;
+                files_to_parse.drain(..batch_size);
+            }
+        }
+
+        build.push(FcParseFontFiles(&files_to_parse, &hooks))?;
+        build.finish()
+    }
+}
+
+struct FcStreamingBuild {
+    runs: FcRunFiles,
+    faces: Vec<(FcPattern, FcFontPath)>,
+    max_faces: usize,
+}
+
+impl FcStreamingBuild {
+
+    fn new(output: &Path, max_faces: usize) -> Self {
+        FcStreamingBuild {
+            runs: FcRunFiles { output: output.to_path_buf(), runs: Vec::new(), next_id: 0 },
+            faces: Vec::new(),
+            max_faces: max_faces.max(1),
+        }
+    }
+
+    fn push(&mut self, fonts: Vec<(FcPattern, FcFontPath)>) -> io::Result<()> {
+        for font in fonts {
+            self.faces.push(font);
+            if self.faces.len() >= self.max_faces {
+                self.spill()?;
+            }
+        }
+        Ok(())
+    }
+
+    // sorts the fonts in memory and writes them to a new run
+    fn spill(&mut self) -> io::Result<()> {
+
+        // stable, so that the last of several equal patterns stays last
+        self.faces.sort_by(|a, b| a.0.cmp(&b.0));
+
+        let path = self.runs.next_path();
+        let mut writer = FcCompactWriter::create(&path)?;
+        let mut count = 0;
+        let mut faces = self.faces.drain(..).peekable();
+
+        while let Some((pattern, font)) = faces.next() {
+            if faces.peek().map(|(next, _)| *next == pattern).unwrap_or(false) {
+                continue;
+            }
+            writer.push(&pattern, &font)?;
+            count += 1;
+        }
+
+        writer.finish()?;
+        self.runs.runs.push((path, count));
+        Ok(())
+    }
+
+    fn finish(mut self) -> io::Result<usize> {
+
+        if !self.faces.is_empty() || self.runs.runs.is_empty() {
+            self.spill()?;
+        }
+
+        // merge in groups, keeping the runs in the order they were found -
+        // a group is only replaced by its merged run once that is complete
+        while self.runs.runs.len() > MAX_MERGE_FAN_IN {
+            let mut group = 0;
+            while group < self.runs.runs.len() {
+                let end = (group + MAX_MERGE_FAN_IN).min(self.runs.runs.len());
+                if end - group > 1 {
+                    let path = self.runs.next_path();
+                    let count = FcMergeRuns(&self.runs.runs[group..end], &path)?;
+                    for (run, _) in self.runs.runs.splice(group..end, Some((path, count))) {
+                        let _ = std::fs::remove_file(run);
+                    }
+                }
+                group += 1;
+            }
+        }
+
+        let output = self.runs.output.clone();
+
+        if self.runs.runs.len() == 1 {
+            let (path, count) = self.runs.runs.pop().unwrap();
+            if let Err(e) = std::fs::rename(&path, &output) {
+                self.runs.runs.push((path, count));
+                return Err(e);
+            }
+            return Ok(count);
+        }
+
+        FcMergeRuns(&self.runs.runs, &output)
+    }
+}
+
+// Temporary run files, deleted when dropped
+struct FcRunFiles {
+    output: PathBuf,
+    // (path, number of fonts)
+    runs: Vec<(PathBuf, usize)>,
+    next_id: usize,
+}
+
+impl FcRunFiles {
+    fn next_path(&mut self) -> PathBuf {
+        let mut path = OsString::from(self.output.as_os_str());
+        path.push(format!(".run{}", self.next_id));
+        self.next_id += 1;
+        PathBuf::from(path)
+    }
+}
+
+impl Drop for FcRunFiles {
+    fn drop(&mut self) {
+        for (path, _) in self.runs.iter() {
+            let _ = std::fs::remove_file(path);
+        }
+    }
+}
+
+// k-way merge of sorted runs into `output`, returns the number of fonts written
+fn FcMergeRuns(runs: &[(PathBuf, usize)], output: &Path) -> io::Result<usize> {
+
+    let mut readers = runs.iter().map(|(path, _)| FcRunReader::open(path)).collect::<io::Result<Vec<_>>>()?;
+    let mut heap = BinaryHeap::with_capacity(readers.len());
+
+    for (run, reader) in readers.iter_mut().enumerate() {
+        if let Some((pattern, font)) = reader.next_font()? {
+            heap.push(FcMergeHead { pattern, font, run });
+        }
+    }
+
+    let mut writer = FcCompactWriter::create(output)?;
+    let mut count = 0;
+
+    while let Some(head) = heap.pop() {
+
+        if let Some((pattern, font)) = readers[head.run].next_font()? {
+            heap.push(FcMergeHead { pattern, font, run: head.run });
+        }
+
+        // same pattern in earlier runs: the font of the latest run was popped first
+        while heap.peek().map(|next| next.pattern == head.pattern).unwrap_or(false) {
+            let duplicate = heap.pop().unwrap();
+            if let Some((pattern, font)) = readers[duplicate.run].next_font()? {
+                heap.push(FcMergeHead { pattern, font, run: duplicate.run });
+            }
+        }
+
+        writer.push(&head.pattern, &head.font)?;
+        count += 1;
+    }
+
+    writer.finish()?;
+    Ok(count)
+}
+
+// Next font of a run, ordered so that `BinaryHeap` pops the smallest
+// pattern first and, for equal patterns, the one from the latest run
+struct FcMergeHead {
+    pattern: FcPattern,
+    font: FcFontPath,
+    run: usize,
+}
+
+impl Ord for FcMergeHead {
+    fn cmp(&self, other: &Self) -> Ordering {
+        other.pattern.cmp(&self.pattern).then(self.run.cmp(&other.run))
+    }
+}
+
+impl PartialOrd for FcMergeHead {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl PartialEq for FcMergeHead {
+    fn eq(&self, other: &Self) -> bool {
+        self.cmp(other) == Ordering::Equal
+    }
+}
+
+impl Eq for FcMergeHead { }
+
+// Reads the records of a run one by one, and checks the trailer after
+// the last one
+struct FcRunReader {
+    reader: BufReader<File>,
+    count: u64,
+    remaining: u64,
+    // of the records read so far
+    hash: u64,
+    // bytes of the current record
+    record: Vec<u8>,
+}
+
+impl FcRunReader {
+
+    fn open(path: &Path) -> io::Result<Self> {
+        let mut reader = BufReader::new(File::open(path)?);
+        let mut header = [0; HEADER_LEN];
+        reader.read_exact(&mut header)?;
+        let count = FcReadHeader(&header)?;
+        Ok(FcRunReader { reader, count, remaining: count, hash: FNV_OFFSET, record: Vec::new() })
+    }
+
+    fn next_font(&mut self) -> io::Result<Option<(FcPattern, FcFontPath)>> {
+
+        if self.remaining == 0 {
+            return Ok(None);
+        }
+        self.remaining -= 1;
+
+        let font = self.read_record()?;
+
+        if self.remaining == 0 {
+            let mut trailer = [0; TRAILER_LEN];
+            self.reader.read_exact(&mut trailer)?;
+            FcCheckTrailer(&trailer, self.count, self.hash)?;
+        }
+
+        Ok(Some(font))
+    }
+
+    fn read_record(&mut self) -> io::Result<(FcPattern, FcFontPath)> {
+
+        // fixed-size fields, then name, family and path (see `compact`)
+        self.record.clear();
+        self.read_bytes(FIXED_RECORD_LEN)?;
+        for string in 0..3 {
+            let len_offset = self.record.len();
+            self.read_bytes(4)?;
+            let len = ReadU32(&self.record, len_offset).unwrap_or(0) as usize;
+            let is_optional = string < 2;
+            self.read_bytes(if is_optional { len.saturating_sub(1) } else { len })?;
+        }
+
+        self.hash = FcHashBytes(self.hash, &self.record);
+
+        FcCompactRecord::read(&self.record, 0)
+            .map(|r| r.to_owned())
+            .ok_or_else(|| InvalidData("invalid record in compact cache run"))
+    }
+
+    fn read_bytes(&mut self, len: usize) -> io::Result<()> {
+        let start = self.record.len();
+        self.record.resize(start + len, 0);
+        self.reader.read_exact(&mut self.record[start..])
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::{FcFontCache, PatternMatch};
+
+    fn font(i: usize, file: &str) -> (FcPattern, FcFontPath) {
+        (FcPattern {
+            name: Some(format!("Font {:03}", i)),
+            family: Some(format!("Family {}", i % 5)),
+            bold: if i % 2 == 0 { PatternMatch::True } else { PatternMatch::False },
+            .. Default::default()
+        }, FcFontPath { path: format!("/fonts/{}/{}.ttf", file, i), .. Default::default() })
+    }
+
+    // empty directory, unique per test
+    fn test_dir(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("rust-fontconfig-streaming-{}-{}", std::process::id(), name));
+        let _ = std::fs::remove_dir_all(&dir);
+        std::fs::create_dir_all(&dir).unwrap();
+        dir
+    }
+
+    fn files(dir: &Path) -> Vec<PathBuf> {
+        let mut files = std::fs::read_dir(dir).unwrap().map(|e| e.unwrap().path()).collect::<Vec<_>>();
+        files.sort();
+        files
+    }
+
+    fn write_run(path: &Path, fonts: &[(FcPattern, FcFontPath)]) -> (PathBuf, usize) {
+        let mut writer = FcCompactWriter::create(path).unwrap();
+        for (pattern, font) in fonts {
+            writer.push(pattern, font).unwrap();
+        }
+        writer.finish().unwrap();
+        (path.to_path_buf(), fonts.len())
+    }
+
+    fn read(path: &Path) -> Vec<(FcPattern, FcFontPath)> {
+        FcCompactCache::open(path).unwrap().to_cache().list().clone().into_iter().collect()
+    }
+
+    #[test]
+    fn merge_order() {
+
+        let dir = test_dir("merge_order");
+        let runs = [
+            write_run(&dir.join("a"), &[font(1, "a"), font(4, "a"), font(7, "a")]),
+            write_run(&dir.join("b"), &[font(2, "b"), font(4, "b"), font(8, "b")]),
+            write_run(&dir.join("c"), &[font(0, "c"), font(4, "c"), font(7, "c"), font(9, "c")]),
+            write_run(&dir.join("d"), &[]),
+        ];
+        let output = dir.join("out");
+
+        assert_eq!(FcMergeRuns(&runs, &output).unwrap(), 7);
+
+        // sorted by pattern, for duplicates the font of the latest run wins
+        let mut expected = vec![font(0, "c"), font(1, "a"), font(2, "b"), font(4, "c"), font(7, "c"), font(8, "b"), font(9, "c")];
+        expected.sort_by(|a, b| a.0.cmp(&b.0));
+        assert_eq!(read(&output), expected);
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn multi_level_merge() {
+
+        let dir = test_dir("multi_level");
+        let output = dir.join("fonts.rfcc");
+
+        // enough runs for two merge levels, with duplicates across runs
+        let fonts = (0..MAX_MERGE_FAN_IN * 3).map(|i| font((i * 37) % 150, &format!("{}", i))).collect::<Vec<_>>();
+        let mut build = FcStreamingBuild::new(&output, 2);
+        for chunk in fonts.chunks(5) {
+            build.push(chunk.to_vec()).unwrap();
+        }
+        assert!(build.runs.runs.len() > MAX_MERGE_FAN_IN);
+        let count = build.finish().unwrap();
+
+        let expected = fonts.into_iter().collect::<FcFontCache>().list().clone().into_iter().collect::<Vec<_>>();
+        assert_eq!(count, expected.len());
+        assert_eq!(read(&output), expected);
+        // all run files were deleted
+        assert_eq!(files(&dir), vec![output.clone()]);
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn failed_merge_leaves_nothing_behind() {
+
+        let dir = test_dir("failed_merge");
+        let output = dir.join("fonts.rfcc");
+
+        let mut build = FcStreamingBuild::new(&output, 1);
+        build.push((0..MAX_MERGE_FAN_IN + 10).map(|i| font(i, "x")).collect()).unwrap();
+
+        // damage a run of the first merge group
+        let run = build.runs.runs[3].0.clone();
+        let mut bytes = std::fs::read(&run).unwrap();
+        let len = bytes.len();
+        bytes[len - 1] ^= 0xff;
+        std::fs::write(&run, &bytes).unwrap();
+
+        assert!(build.finish().is_err());
+        assert_eq!(files(&dir), Vec::<PathBuf>::new());
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
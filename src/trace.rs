@@ -0,0 +1,147 @@
+//! Chrome trace-event recorder for the build pipeline
+//!
+//! Pass a `FcTraceRecorder` to `FcFontCache::build_with_trace()`, then
+//! write the result with `write_chrome_trace()` and open it in
+//! `chrome://tracing` or https://ui.perfetto.dev. Every directory walk and
+//! every parsed font file shows up as one slice on the thread that did
+//! the work.
+
+use std::io::{self, Write};
+use std::path::Path;
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+/// Kind of work a `FcTraceEvent` measures
+#[derive(Debug, Copy, Clone, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub enum FcTraceCategory {
+    /// Recursive walk of one font directory, `value` = number of files found
+    Walk,
+    /// Parsing of one font file, `value` = number of bytes mapped
+    Parse,
+}
+
+impl FcTraceCategory {
+    fn as_str(&self) -> &'static str {
+        match self {
+            FcTraceCategory::Walk => "walk",
+            FcTraceCategory::Parse => "parse",
+        }
+    }
+
+    fn value_name(&self) -> &'static str {
+        match self {
+            FcTraceCategory::Walk => "files",
+            FcTraceCategory::Parse => "bytes",
+        }
+    }
+}
+
+/// Single timed slice of work
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct FcTraceEvent {
+    pub category: FcTraceCategory,
+    /// Directory or file that was processed
+    pub path: String,
+    /// Thread that did the work (0 = not a rayon worker)
+    pub thread: usize,
+    /// Start time, relative to the creation of the recorder
+    pub start: Duration,
+    pub duration: Duration,
+    /// Number of files (`Walk`) or bytes (`Parse`)
+    pub value: u64,
+}
+
+/// Collects `FcTraceEvent`s from all threads of a build
+#[derive(Debug)]
+pub struct FcTraceRecorder {
+    origin: Instant,
+    // one buffer per rayon worker + one for all other threads,
+    // so that the workers never wait for each other
+    buffers: Vec<Mutex<Vec<FcTraceEvent>>>,
+}
+
+impl Default for FcTraceRecorder {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl FcTraceRecorder {
+
+    /// Creates a new, empty recorder - timestamps are relative to this call
+    pub fn new() -> Self {
+        FcTraceRecorder {
+            origin: Instant::now(),
+            buffers: (0..rayon::current_num_threads() + 1).map(|_| Mutex::new(Vec::new())).collect(),
+        }
+    }
+
+    pub(crate) fn record(&self, category: FcTraceCategory, path: &Path, start: Instant, value: u64) {
+
+        let end = Instant::now();
+        let thread = rayon::current_thread_index().map(|i| i + 1).unwrap_or(0);
+
+        let event = FcTraceEvent {
+            category,
+            path: path.to_string_lossy().to_string(),
+            thread,
+            start: start.saturating_duration_since(self.origin),
+            duration: end.saturating_duration_since(start),
+            value,
+        };
+
+        let buffer = &self.buffers[thread.min(self.buffers.len() - 1)];
+        if let Ok(mut events) = buffer.lock() {
+            events.push(event);
+        }
+    }
+
+    /// Returns all recorded events, sorted by start time
+    pub fn events(&self) -> Vec<FcTraceEvent> {
+        let mut events = self.buffers
+            .iter()
+            .filter_map(|b| b.lock().ok().map(|e| e.clone()))
+            .flat_map(|e| e.into_iter())
+            .collect::<Vec<_>>();
+        events.sort_by_key(|e| e.start);
+        events
+    }
+
+    /// Writes all events in the Chrome trace-event JSON format
+    pub fn write_chrome_trace<W: Write>(&self, w: &mut W) -> io::Result<()> {
+
+        write!(w, "{{\"traceEvents\":[")?;
+
+        for (i, e) in self.events().iter().enumerate() {
+            if i != 0 {
+                write!(w, ",")?;
+            }
+            write!(w, "\n{{\"name\":\"")?;
+            write_json_escaped(w, &e.path)?;
+            write!(
+                w,
+                "\",\"cat\":\"{}\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{:.3},\"dur\":{:.3},\"args\":{{\"{}\":{}}}}}",
+                e.category.as_str(),
+                e.thread,
+                e.start.as_nanos() as f64 / 1000.0,
+                e.duration.as_nanos() as f64 / 1000.0,
+                e.category.value_name(),
+                e.value,
+            )?;
+        }
+
+        write!(w, "\n],\"displayTimeUnit\":\"ms\"}}\n")
+    }
+}
+
+fn write_json_escaped<W: Write>(w: &mut W, s: &str) -> io::Result<()> {
+    for c in s.chars() {
+        match c {
+            '"' => write!(w, "\\\"")?,
+            '\\' => write!(w, "\\\\")?,
+            c if (c as u32) < 0x20 => write!(w, "\\u{:04x}", c as u32)?,
+            c => write!(w, "{}", c)?,
+        }
+    }
+    Ok(())
+}
@@ -0,0 +1,119 @@
+//! Checks that the lookup functions don't allocate on a warm cache
+//!
+//! Installs a counting global allocator and runs every kind of query:
+//! index lookups, the sequential scan of a small cache and the parallel
+//! scan of a large one. Everything runs in a single test, so that no
+//! other test allocates at the same time.
+
+use rust_fontconfig::{FcPattern, FcPatternRef, PatternMatch};
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+#[path = "../benches/common/mod.rs"]
+mod common;
+use common::synthetic_cache;
+
+struct CountingAllocator;
+
+static ALLOCATIONS: AtomicUsize = AtomicUsize::new(0);
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::SeqCst);
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::SeqCst);
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+#[global_allocator]
+static GLOBAL: CountingAllocator = CountingAllocator;
+
+// more than `EXPLORE_INTERVAL` (64) large scans, so that the scan cost
+// model takes both the parallel and the sequential path
+const QUERIES_PER_CHECK: usize = 200;
+
+// 2 * `MIN_PARALLEL_FONTS` in src/scan.rs
+const PARALLEL_SCAN_FONTS: usize = 2 * 2 * 2048;
+
+// Runs `f` a few times and returns the number of allocations
+fn count_allocations<F: FnMut()>(mut f: F) -> usize {
+    // warm up: lazily initialized state is allowed to allocate once
+    f();
+    let before = ALLOCATIONS.load(Ordering::SeqCst);
+    for _ in 0..QUERIES_PER_CHECK {
+        f();
+    }
+    ALLOCATIONS.load(Ordering::SeqCst) - before
+}
+
+#[test]
+fn lookups_do_not_allocate() {
+
+    let cache = synthetic_cache(1000);
+    let large_cache = synthetic_cache(PARALLEL_SCAN_FONTS);
+
+    let by_name = FcPattern { name: Some(String::from("Family 000200 Bold")), .. Default::default() };
+    let by_family = FcPattern { family: Some(String::from("Family 000150")), bold: PatternMatch::True, .. Default::default() };
+    let attributes = FcPattern { monospace: PatternMatch::True, bold: PatternMatch::True, .. Default::default() };
+    // no font is oblique, so this scans all fonts
+    let scan_miss = FcPattern { oblique: PatternMatch::True, .. Default::default() };
+    let miss = FcPattern { name: Some(String::from("Does Not Exist")), .. Default::default() };
+    let stack = [miss.clone(), by_family.clone(), by_name.clone()];
+    let compiled_by_family = cache.compile(&by_family);
+    let compiled_attributes = cache.compile(&attributes);
+    let compiled_scan_miss = large_cache.compile(&scan_miss);
+    let pattern_ref = FcPatternRef::parse("Family 000150:bold:lang=ja").unwrap();
+
+    // a pattern is only promoted after it was queried often enough
+    let mut hot_cache = cache.clone();
+    hot_cache.set_hot_cache(Some(16));
+    for _ in 0..1000 {
+        hot_cache.query(&by_family);
+    }
+
+    // the parallel scan needs at least two threads, also on single-core machines
+    let pool = rayon::ThreadPoolBuilder::new().num_threads(4).build().unwrap();
+
+    // parallel checks run inside the pool as a whole: `install` itself
+    // allocates (the job is pushed onto rayon's injector queue)
+    let checks: [(&str, bool, &(dyn Fn() -> bool + Sync));14] = [
+        ("query by name (index)", false, &|| cache.query(&by_name).is_some()),
+        ("query by family (index)", false, &|| cache.query(&by_family).is_some()),
+        ("query miss (index)", false, &|| cache.query(&miss).is_none()),
+        ("query by attributes (sequential scan)", false, &|| cache.query(&attributes).is_some()),
+        ("query miss (sequential scan)", false, &|| cache.query(&scan_miss).is_none()),
+        ("query by attributes (parallel scan)", true, &|| large_cache.query(&attributes).is_some()),
+        ("query miss (parallel scan)", true, &|| large_cache.query(&scan_miss).is_none()),
+        ("query_stack", false, &|| cache.query_stack(&stack).is_some()),
+        ("query_compiled family", false, &|| cache.query_compiled(&compiled_by_family).is_some()),
+        ("query_compiled attributes", false, &|| cache.query_compiled(&compiled_attributes).is_some()),
+        ("query_compiled miss (parallel scan)", true, &|| large_cache.query_compiled(&compiled_scan_miss).is_none()),
+        ("query hot cache", false, &|| hot_cache.query(&by_family).is_some()),
+        ("query_ref", false, &|| cache.query_ref(&pattern_ref).is_some()),
+        ("query_str", false, &|| cache.query_str("Family 000150:weight=200:slant=roman").ok().flatten().is_some()),
+    ];
+
+    let mut failed = Vec::new();
+
+    for (name, parallel, check) in checks.iter() {
+        let mut found = true;
+        let allocations = if *parallel {
+            pool.install(|| count_allocations(|| found &= check()))
+        } else {
+            count_allocations(|| found &= check())
+        };
+        if allocations != 0 || !found {
+            failed.push(format!("{}: {} allocations in {} calls, found expected result: {}", name, allocations, QUERIES_PER_CHECK, found));
+        }
+    }
+
+    assert!(failed.is_empty(), "{:#?}", failed);
+}